@@ -0,0 +1,154 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "batch.h"
+#include "dependency_file.h"
+#include "mapped_file.h"
+#include "rst2rfcxml.h"
+#include "work_stealing_pool.h"
+
+#include <fstream>
+#include <list>
+#include <sstream>
+
+using namespace std;
+
+int
+read_batch_manifest(istream& manifest, vector<batch_job>& jobs, ostream& diagnostics)
+{
+    string line;
+    for (size_t line_number = 1; getline(manifest, line); line_number++) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+        // Find the ':' that ends the output filename, skipping one in a drive letter like "C:\".
+        size_t colon = line.find(':', start);
+        while (colon != string::npos && colon + 1 < line.length() && line[colon + 1] != ' ' &&
+               line[colon + 1] != '\t') {
+            colon = line.find(':', colon + 1);
+        }
+        if (colon == string::npos) {
+            diagnostics << fmt::format("ERROR: manifest line {} has no ':' after the output filename", line_number)
+                        << endl;
+            return 1;
+        }
+        batch_job job;
+        string_view output_filename = string_view(line).substr(start, colon - start);
+        job.output_filename = output_filename.substr(0, output_filename.find_last_not_of(" \t") + 1);
+        istringstream inputs(line.substr(colon + 1));
+        string input_filename;
+        while (inputs >> input_filename) {
+            job.input_filenames.push_back(input_filename);
+        }
+        if (job.output_filename.empty() || job.input_filenames.empty()) {
+            diagnostics << fmt::format("ERROR: manifest line {} needs an output and at least one input", line_number)
+                        << endl;
+            return 1;
+        }
+        jobs.push_back(move(job));
+    }
+    return 0;
+}
+
+using snapshot_map = map<string, shared_ptr<const rst2rfcxml_snapshot>, less<>>;
+
+static void
+_run_job(
+    const batch_job& job,
+    const map<string, string_view, less<>>& shared_inputs,
+    const snapshot_map& snapshots,
+    include_cache& included_files,
+    batch_result& result)
+{
+    auto start = chrono::steady_clock::now();
+    ostringstream diagnostics;
+    ofstream output_file(job.output_filename);
+    if (!output_file.good()) {
+        diagnostics << "ERROR: can't write " << job.output_filename << endl;
+        result.error = 1;
+    } else {
+        rst2rfcxml converter;
+        converter.set_diagnostics(diagnostics);
+        converter.set_shared_inputs(&shared_inputs);
+        converter.set_include_cache(&included_files);
+        auto snapshot = snapshots.find(job.input_filenames[0]);
+        if (snapshot != snapshots.end()) {
+            converter.start_from(*snapshot->second);
+            vector<string> remaining_inputs(job.input_filenames.begin() + 1, job.input_filenames.end());
+            result.error = converter.process_files(remaining_inputs, output_file);
+        } else {
+            result.error = converter.process_files(job.input_filenames, output_file);
+        }
+        result.bytes_written = converter.output().bytes_written();
+        if (!result.error && !job.dependency_filename.empty()) {
+            result.error = write_dependency_file(
+                job.dependency_filename, job.output_filename, converter.files_read(), diagnostics);
+        }
+    }
+    result.diagnostics = diagnostics.str();
+    result.elapsed = chrono::steady_clock::now() - start;
+}
+
+int
+run_batch(const vector<batch_job>& jobs, size_t thread_count, vector<batch_result>& results)
+{
+    // Map files that several jobs read, such as a common prologue, just once.
+    map<string, size_t, less<>> use_counts;
+    map<string, size_t, less<>> first_use_counts;
+    for (const batch_job& job : jobs) {
+        for (const string& input_filename : job.input_filenames) {
+            use_counts[input_filename]++;
+        }
+        first_use_counts[job.input_filenames[0]]++;
+    }
+    list<mapped_file> mapped_inputs;
+    map<string, string_view, less<>> shared_inputs;
+    for (auto& [input_filename, use_count] : use_counts) {
+        if (use_count < 2) {
+            continue;
+        }
+        mapped_file& mapped_input = mapped_inputs.emplace_back();
+        if (mapped_input.open(input_filename)) {
+            shared_inputs.emplace(input_filename, mapped_input.contents());
+        } else {
+            mapped_inputs.pop_back();
+        }
+    }
+
+    // Files included by several jobs, such as fragments of a shared skeleton,
+    // are read once too, and ahead of the jobs that include them.
+    include_cache included_files;
+
+    // Process a file that several jobs start with, such as a common prologue, just
+    // once, and start those jobs from a snapshot of it. If it can't be processed
+    // on its own, each job processes it and reports why.
+    snapshot_map snapshots;
+    for (auto& [input_filename, use_count] : first_use_counts) {
+        if (use_count < 2) {
+            continue;
+        }
+        rst2rfcxml converter;
+        ostringstream diagnostics;
+        converter.set_diagnostics(diagnostics);
+        converter.set_shared_inputs(&shared_inputs);
+        converter.set_include_cache(&included_files);
+        shared_ptr<const rst2rfcxml_snapshot> snapshot;
+        if (converter.create_snapshot({input_filename}, snapshot) == 0) {
+            snapshots.emplace(input_filename, move(snapshot));
+        }
+    }
+
+    results.assign(jobs.size(), {});
+    work_stealing_pool pool(thread_count);
+    pool.run(jobs.size(), [&](size_t index) {
+        _run_job(jobs[index], shared_inputs, snapshots, included_files, results[index]);
+    });
+
+    for (const batch_result& result : results) {
+        if (result.error) {
+            return 1;
+        }
+    }
+    return 0;
+}
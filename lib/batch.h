@@ -0,0 +1,40 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// One output document of a batch, produced from inputs read as if they were one file.
+struct batch_job
+{
+    std::vector<std::string> input_filenames;
+    std::string output_filename;
+
+    // Dependency file to write listing every file read, or empty to not write one.
+    std::string dependency_filename;
+};
+
+struct batch_result
+{
+    int error = 0;
+    std::chrono::duration<double> elapsed{};
+    size_t bytes_written = 0;
+    std::string diagnostics;
+};
+
+// Read a batch manifest, which has one job per line of the form
+// "output: input...", with blank lines and lines starting with '#' ignored.
+// Returns 0 on success, non-zero error code on failure.
+int
+read_batch_manifest(std::istream& manifest, std::vector<batch_job>& jobs, std::ostream& diagnostics);
+
+// Convert each job on a pool of threads. Input files used by more than one
+// job are loaded once and shared by all of them, and a first input file that
+// several jobs start with is processed once, with those jobs starting from a
+// snapshot of the result.
+// Returns 0 if every job succeeded, non-zero error code if any failed.
+int
+run_batch(const std::vector<batch_job>& jobs, size_t thread_count, std::vector<batch_result>& results);
@@ -0,0 +1,117 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Appends binary values to a buffer, with integers in the byte order of the
+// machine, for files that are caches for the machine that wrote them.
+class binary_writer
+{
+  public:
+    void
+    write(uint32_t value)
+    {
+        _buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    void
+    write(uint64_t value)
+    {
+        _buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    void
+    write(std::string_view value)
+    {
+        write(static_cast<uint64_t>(value.length()));
+        _buffer.append(value);
+    }
+
+    const std::string&
+    buffer() const
+    {
+        return _buffer;
+    }
+
+  private:
+    std::string _buffer;
+};
+
+// Reads binary values from a buffer. Reading past the end of the buffer yields
+// empty values and marks the reader as failed, so callers only need to check
+// once at the end.
+class binary_reader
+{
+  public:
+    explicit binary_reader(std::string_view buffer) : _buffer(buffer) {}
+
+    uint32_t
+    read_uint32()
+    {
+        uint32_t value = 0;
+        read_bytes(&value, sizeof(value));
+        return value;
+    }
+    uint64_t
+    read_uint64()
+    {
+        uint64_t value = 0;
+        read_bytes(&value, sizeof(value));
+        return value;
+    }
+    std::string_view
+    read_string()
+    {
+        uint64_t length = read_uint64();
+        if (length > _buffer.length() - _position) {
+            _failed = true;
+            return {};
+        }
+        std::string_view value = _buffer.substr(_position, length);
+        _position += length;
+        return value;
+    }
+
+    // Read a count of items that each take at least minimum_item_size bytes,
+    // failing if there can't be that many left in the buffer.
+    uint64_t
+    read_count(size_t minimum_item_size)
+    {
+        uint64_t count = read_uint64();
+        if (count > (_buffer.length() - _position) / minimum_item_size) {
+            _failed = true;
+            return 0;
+        }
+        return count;
+    }
+
+    bool
+    failed() const
+    {
+        return _failed;
+    }
+    bool
+    at_end() const
+    {
+        return _position == _buffer.length();
+    }
+
+  private:
+    void
+    read_bytes(void* value, size_t size)
+    {
+        if (size > _buffer.length() - _position) {
+            _failed = true;
+            _position = _buffer.length();
+            return;
+        }
+        std::memcpy(value, _buffer.data() + _position, size);
+        _position += size;
+    }
+
+    std::string_view _buffer;
+    size_t _position = 0;
+    bool _failed = false;
+};
@@ -0,0 +1,619 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "conversion_server.h"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+conversion_server::conversion_server(size_t thread_count)
+    : _thread_count(thread_count ? thread_count : max<size_t>(thread::hardware_concurrency(), 1))
+{
+}
+
+filesystem::path
+conversion_server::default_socket_path()
+{
+#ifdef _WIN32
+    return filesystem::temp_directory_path() / "rst2rfcxml.sock";
+#else
+    return filesystem::temp_directory_path() / fmt::format("rst2rfcxml-{}.sock", getuid());
+#endif
+}
+
+bool
+conversion_server::get_stamp(const string& filename, file_stamp& stamp)
+{
+    error_code ec;
+    stamp.time = filesystem::last_write_time(filename, ec);
+    if (ec) {
+        return false;
+    }
+    stamp.size = filesystem::file_size(filename, ec);
+    return !ec;
+}
+
+// Get the contents of cached files that haven't changed since they were read,
+// dropping any that have. The contents stay valid while they're held, even if
+// another request replaces them in the cache.
+void
+conversion_server::get_cached_files(
+    map<string, string_view, less<>>& inputs, vector<shared_ptr<const string>>& contents)
+{
+    lock_guard<mutex> lock(_cache_mutex);
+    for (auto it = _files.begin(); it != _files.end();) {
+        file_stamp stamp;
+        if (!get_stamp(it->first, stamp) || !(stamp == it->second.stamp)) {
+            _cached_bytes -= it->second.contents->size();
+            it = _files.erase(it);
+            continue;
+        }
+        inputs.emplace(it->first, *it->second.contents);
+        contents.push_back(it->second.contents);
+        ++it;
+    }
+}
+
+// Read files that a request read from disk into the cache, so that later requests
+// don't have to, and count the ones it got from the cache.
+void
+conversion_server::cache_files(const vector<string>& filenames, const map<string, string_view, less<>>& cached_inputs)
+{
+    for (const string& filename : filenames) {
+        {
+            lock_guard<mutex> lock(_cache_mutex);
+            if (cached_inputs.contains(filename)) {
+                _stats.file_hits++;
+                continue;
+            }
+            if (_files.contains(filename)) {
+                continue;
+            }
+        }
+
+        // Get the stamp first, so that a change while reading is noticed next time.
+        file_stamp stamp;
+        if (!get_stamp(filename, stamp)) {
+            continue;
+        }
+        ifstream file(filename, ios::binary);
+        if (!file.good()) {
+            continue;
+        }
+        auto contents = make_shared<const string>(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+
+        lock_guard<mutex> lock(_cache_mutex);
+        if (_cached_bytes + contents->size() > MAX_CACHED_BYTES || _files.contains(filename)) {
+            continue;
+        }
+        _cached_bytes += contents->size();
+        _files.emplace(filename, cached_file{stamp, move(contents)});
+    }
+}
+
+// Get a snapshot of the state after a prologue, creating it if none of the files
+// it reads has been converted since they last changed. Returns nullptr if the
+// prologue can't be snapshotted on its own, in which case the request converts
+// it and reports why.
+shared_ptr<const rst2rfcxml_snapshot>
+conversion_server::get_prologue(const string& filename, const map<string, string_view, less<>>& inputs)
+{
+    cached_prologue prologue;
+    {
+        lock_guard<mutex> lock(_cache_mutex);
+        auto it = _prologues.find(filename);
+        if (it != _prologues.end()) {
+            prologue = it->second;
+        }
+    }
+    bool current = (prologue.snapshot != nullptr);
+    for (size_t i = 0; current && i < prologue.files.size(); i++) {
+        file_stamp stamp;
+        current = get_stamp(prologue.files[i].first, stamp) && stamp == prologue.files[i].second;
+    }
+    if (current) {
+        lock_guard<mutex> lock(_cache_mutex);
+        _stats.prologue_hits++;
+        return prologue.snapshot;
+    }
+
+    // Stamp the files the prologue read last time before converting it again, so
+    // that a change while converting is noticed next time. Files it didn't read
+    // before can only be stamped after they're read, so the snapshot is only kept
+    // once a conversion reads nothing but files that were stamped beforehand.
+    map<string, file_stamp, less<>> stamps;
+    for (auto& [file, previous_stamp] : prologue.files) {
+        file_stamp stamp;
+        if (get_stamp(file, stamp)) {
+            stamps.emplace(file, stamp);
+        }
+    }
+
+    rst2rfcxml converter;
+    ostringstream diagnostics;
+    converter.set_diagnostics(diagnostics);
+    converter.set_shared_inputs(&inputs);
+    converter.set_map_inputs(false);
+    shared_ptr<const rst2rfcxml_snapshot> snapshot;
+    int error = converter.create_snapshot({filename}, snapshot);
+    lock_guard<mutex> lock(_cache_mutex);
+    _stats.prologue_misses++;
+    if (error) {
+        return nullptr;
+    }
+    prologue = {{}, snapshot};
+    for (const string& file : snapshot->files_read()) {
+        file_stamp stamp;
+        if (!get_stamp(file, stamp)) {
+            return snapshot;
+        }
+        auto it = stamps.find(file);
+        if (it == stamps.end() || !(it->second == stamp)) {
+            prologue.snapshot = nullptr;
+        }
+        prologue.files.emplace_back(file, stamp);
+    }
+    _prologues[filename] = move(prologue);
+    return snapshot;
+}
+
+int
+conversion_server::convert(const conversion_request& request, conversion_response& response)
+{
+    response = {};
+    map<string, string_view, less<>> cached_inputs;
+    vector<shared_ptr<const string>> cached_contents;
+    get_cached_files(cached_inputs, cached_contents);
+
+    // Inline inputs are named as if they were files in the request's directory, so
+    // that they're read like any other input and their included files resolve there.
+    filesystem::path directory =
+        request.directory.empty() ? filesystem::current_path() : filesystem::path(request.directory);
+    map<string, string_view, less<>> inputs = cached_inputs;
+    vector<string> input_filenames;
+    for (size_t i = 0; i < request.inputs.size(); i++) {
+        const conversion_input& input = request.inputs[i];
+        if (input.is_text) {
+            string name = (directory / fmt::format("<input {}>", i)).string();
+            inputs[name] = input.value;
+            input_filenames.push_back(move(name));
+        } else {
+            input_filenames.push_back((directory / input.value).string());
+        }
+    }
+
+    ostringstream diagnostics;
+    rst2rfcxml converter;
+    converter.set_diagnostics(diagnostics);
+    converter.set_base_directory(directory);
+    converter.set_shared_inputs(&inputs);
+    converter.set_map_inputs(false);
+    if (input_filenames.empty()) {
+        diagnostics << "ERROR: no input files" << endl;
+        response.status = 1;
+    } else {
+        if (input_filenames.size() > 1 && !request.inputs[0].is_text) {
+            if (auto prologue = get_prologue(input_filenames[0], cached_inputs)) {
+                converter.start_from(*prologue);
+                input_filenames.erase(input_filenames.begin());
+            }
+        }
+        if (request.output_filename.empty()) {
+            ostringstream output;
+            response.status = converter.process_files(input_filenames, output);
+            response.output = output.str();
+        } else {
+            ofstream output_file(request.output_filename);
+            if (!output_file.good()) {
+                diagnostics << "ERROR: can't write " << request.output_filename << endl;
+                response.status = 1;
+            } else {
+                response.status = converter.process_files(input_filenames, output_file);
+            }
+        }
+    }
+    response.diagnostics = diagnostics.str();
+    cache_files(converter.files_read(), cached_inputs);
+
+    lock_guard<mutex> lock(_cache_mutex);
+    _stats.requests++;
+    return response.status;
+}
+
+void
+conversion_server::stop()
+{
+    lock_guard<mutex> lock(_queue_mutex);
+    _stopping = true;
+    _queue_changed.notify_all();
+}
+
+server_stats
+conversion_server::statistics() const
+{
+    lock_guard<mutex> lock(_cache_mutex);
+    return _stats;
+}
+
+#ifdef _WIN32
+int
+conversion_server::serve(const filesystem::path& socket_path, ostream& diagnostics)
+{
+    diagnostics << "ERROR: serving requests needs Unix domain sockets, which aren't supported on this platform"
+                << endl;
+    return 1;
+}
+
+int
+send_conversion_request(
+    const filesystem::path& socket_path,
+    const conversion_request& request,
+    conversion_response& response,
+    ostream& diagnostics)
+{
+    response = {};
+    diagnostics << "ERROR: the client needs Unix domain sockets, which aren't supported on this platform" << endl;
+    return 1;
+}
+#else
+// Largest frame accepted, which is far more than any draft needs. A client
+// can't make the server allocate more than this for a frame, nor more than
+// it has actually sent, however long a frame it claims to be sending.
+constexpr uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+constexpr size_t READ_CHUNK_SIZE = 1024 * 1024;
+constexpr int POLL_MILLISECONDS = 100; // How often waiting threads check whether the server is stopping.
+constexpr size_t FRAME_HEADER_SIZE = 5;
+
+#ifdef MSG_NOSIGNAL
+constexpr int SEND_FLAGS = MSG_NOSIGNAL; // Fail rather than raise SIGPIPE if the peer has gone.
+#else
+constexpr int SEND_FLAGS = 0;
+#endif
+
+static bool
+_write_all(int fd, const char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = send(fd, data, length, SEND_FLAGS);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+static bool
+_read_all(int fd, char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t count = recv(fd, data, length, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
+}
+
+static bool
+_write_frame(int fd, conversion_frame kind, string_view payload)
+{
+    if (payload.size() > MAX_FRAME_SIZE) {
+        return false;
+    }
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    char header[FRAME_HEADER_SIZE] = {
+        static_cast<char>(kind),
+        static_cast<char>(length >> 24),
+        static_cast<char>(length >> 16),
+        static_cast<char>(length >> 8),
+        static_cast<char>(length)};
+    return _write_all(fd, header, sizeof(header)) && _write_all(fd, payload.data(), payload.size());
+}
+
+static bool
+_read_frame(int fd, conversion_frame& kind, string& payload)
+{
+    unsigned char header[FRAME_HEADER_SIZE];
+    if (!_read_all(fd, reinterpret_cast<char*>(header), sizeof(header))) {
+        return false;
+    }
+    kind = static_cast<conversion_frame>(header[0]);
+    uint32_t length = (uint32_t(header[1]) << 24) | (uint32_t(header[2]) << 16) | (uint32_t(header[3]) << 8) |
+                      uint32_t(header[4]);
+    if (length > MAX_FRAME_SIZE) {
+        return false;
+    }
+    payload.clear();
+    while (payload.size() < length) {
+        size_t offset = payload.size();
+        payload.resize(min<size_t>(length, offset + READ_CHUNK_SIZE));
+        if (!_read_all(fd, payload.data() + offset, payload.size() - offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read the frames of one request. Returns false if the connection was closed
+// or the client sent something other than a request frame.
+static bool
+_read_request(int fd, conversion_request& request)
+{
+    conversion_frame kind;
+    string payload;
+    while (_read_frame(fd, kind, payload)) {
+        switch (kind) {
+        case conversion_frame::directory:
+            request.directory = move(payload);
+            break;
+        case conversion_frame::input_file:
+            request.inputs.push_back({false, move(payload)});
+            break;
+        case conversion_frame::input_text:
+            request.inputs.push_back({true, move(payload)});
+            break;
+        case conversion_frame::output_file:
+            request.output_filename = move(payload);
+            break;
+        case conversion_frame::end_request:
+            return true;
+        case conversion_frame::shutdown:
+            request.shutdown = true;
+            return true;
+        default:
+            return false;
+        }
+        payload = {};
+    }
+    return false;
+}
+
+static bool
+_write_request(int fd, const conversion_request& request)
+{
+    if (request.shutdown) {
+        return _write_frame(fd, conversion_frame::shutdown, {});
+    }
+    if (!request.directory.empty() && !_write_frame(fd, conversion_frame::directory, request.directory)) {
+        return false;
+    }
+    for (const conversion_input& input : request.inputs) {
+        conversion_frame kind = input.is_text ? conversion_frame::input_text : conversion_frame::input_file;
+        if (!_write_frame(fd, kind, input.value)) {
+            return false;
+        }
+    }
+    if (!request.output_filename.empty() &&
+        !_write_frame(fd, conversion_frame::output_file, request.output_filename)) {
+        return false;
+    }
+    return _write_frame(fd, conversion_frame::end_request, {});
+}
+
+static bool
+_write_response(int fd, const conversion_response& response)
+{
+    return (response.output.empty() || _write_frame(fd, conversion_frame::output_text, response.output)) &&
+           (response.diagnostics.empty() ||
+            _write_frame(fd, conversion_frame::diagnostics, response.diagnostics)) &&
+           _write_frame(fd, conversion_frame::status, to_string(response.status));
+}
+
+static bool
+_read_response(int fd, conversion_response& response)
+{
+    conversion_frame kind;
+    string payload;
+    while (_read_frame(fd, kind, payload)) {
+        switch (kind) {
+        case conversion_frame::output_text:
+            response.output += payload;
+            break;
+        case conversion_frame::diagnostics:
+            response.diagnostics += payload;
+            break;
+        case conversion_frame::status: {
+            auto [end, error] = from_chars(payload.data(), payload.data() + payload.size(), response.status);
+            return error == errc() && end == payload.data() + payload.size();
+        }
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool
+_get_socket_address(const filesystem::path& socket_path, sockaddr_un& address, ostream& diagnostics)
+{
+    string path = socket_path.string();
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(address.sun_path)) {
+        diagnostics << fmt::format("ERROR: socket path {} is too long", path) << endl;
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.length() + 1);
+    return true;
+}
+
+// Connect to a socket. Returns the connection, or -1 on failure.
+static int
+_connect(const sockaddr_un& address)
+{
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection >= 0 && connect(connection, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        int error = errno;
+        close(connection);
+        errno = error;
+        connection = -1;
+    }
+    return connection;
+}
+
+// Serve the requests of one connection until the client closes it, the server
+// stops, or the client goes idle for too long. A client that stalls part way
+// through sending a request, or stops reading a response, times out too.
+void
+conversion_server::serve_connection(int connection)
+{
+    auto milliseconds = _idle_timeout.count();
+    timeval timeout{static_cast<time_t>(milliseconds / 1000), static_cast<suseconds_t>((milliseconds % 1000) * 1000)};
+    if (setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+        return;
+    }
+    for (;;) {
+        pollfd entry{connection, POLLIN, 0};
+        int ready = 0;
+        auto deadline = chrono::steady_clock::now() + _idle_timeout;
+        while (!_stopping && (ready = poll(&entry, 1, POLL_MILLISECONDS)) == 0 &&
+               chrono::steady_clock::now() < deadline) {
+        }
+        if (ready <= 0) {
+            return;
+        }
+        conversion_request request;
+        if (!_read_request(connection, request)) {
+            return;
+        }
+        conversion_response response;
+        if (request.shutdown) {
+            stop();
+        } else {
+            convert(request, response);
+        }
+        if (!_write_response(connection, response)) {
+            return;
+        }
+    }
+}
+
+void
+conversion_server::run_worker()
+{
+    for (;;) {
+        int connection;
+        {
+            unique_lock<mutex> lock(_queue_mutex);
+            _queue_changed.wait(lock, [this] { return _stopping || !_connections.empty(); });
+            if (_connections.empty()) {
+                return;
+            }
+            connection = _connections.front();
+            _connections.pop_front();
+        }
+        serve_connection(connection);
+        close(connection);
+    }
+}
+
+int
+conversion_server::serve(const filesystem::path& socket_path, ostream& diagnostics)
+{
+    sockaddr_un address;
+    if (!_get_socket_address(socket_path, address, diagnostics)) {
+        return 1;
+    }
+
+    // Replace a socket left behind by a server that didn't shut down cleanly,
+    // but not one that a server is still listening on, nor any other kind of file.
+    error_code ec;
+    if (filesystem::is_socket(socket_path, ec)) {
+        int connection = _connect(address);
+        if (connection >= 0) {
+            close(connection);
+            diagnostics << fmt::format("ERROR: a server is already listening on {}", socket_path.string()) << endl;
+            return 1;
+        }
+        filesystem::remove(socket_path, ec);
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        diagnostics << fmt::format("ERROR: can't listen on {}: {}", socket_path.string(), strerror(errno)) << endl;
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+
+    vector<thread> workers;
+    for (size_t i = 0; i < _thread_count; i++) {
+        workers.emplace_back([this] { run_worker(); });
+    }
+    while (!_stopping) {
+        pollfd entry{listener, POLLIN, 0};
+        if (poll(&entry, 1, POLL_MILLISECONDS) <= 0) {
+            continue;
+        }
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            continue;
+        }
+        lock_guard<mutex> lock(_queue_mutex);
+        _connections.push_back(connection);
+        _queue_changed.notify_one();
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    close(listener);
+    filesystem::remove(socket_path, ec);
+    return 0;
+}
+
+int
+send_conversion_request(
+    const filesystem::path& socket_path,
+    const conversion_request& request,
+    conversion_response& response,
+    ostream& diagnostics)
+{
+    response = {};
+    sockaddr_un address;
+    if (!_get_socket_address(socket_path, address, diagnostics)) {
+        return 1;
+    }
+    int connection = _connect(address);
+    if (connection < 0) {
+        diagnostics << fmt::format(
+                           "ERROR: can't connect to {}: {}; is rst2rfcxml --serve running?",
+                           socket_path.string(),
+                           strerror(errno))
+                    << endl;
+        return 1;
+    }
+    bool answered = _write_request(connection, request) && _read_response(connection, response);
+    close(connection);
+    if (!answered) {
+        diagnostics << fmt::format("ERROR: lost connection to {}", socket_path.string()) << endl;
+        return 1;
+    }
+    return response.status;
+}
+#endif
@@ -0,0 +1,185 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "rst2rfcxml.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Kinds of frames in the conversion protocol spoken over a server's socket.
+// Each frame is a one-byte kind, a four-byte payload length in network byte
+// order, and the payload. A client sends the frames of a request, ending with
+// end_request or shutdown, and the server answers with any output_text and
+// diagnostics frames followed by a status frame. A connection can carry any
+// number of requests, one after another.
+enum class conversion_frame : char
+{
+    // Request frames.
+    directory = 'd',   // Directory that included files of inline input are resolved against.
+    input_file = 'f',  // Absolute path of an input file.
+    input_text = 't',  // RST to convert, as if it were read from a file in the directory.
+    output_file = 'o', // Absolute path to write the XML to, instead of returning it.
+    end_request = 'e', // Convert the inputs so far, in order, as if they were one file.
+    shutdown = 'q',    // Stop the server once the requests in progress are done.
+
+    // Response frames.
+    output_text = 'x', // XML, when no output file was requested.
+    diagnostics = 'm', // Error messages.
+    status = 's',      // Exit status as decimal text, which ends the response.
+};
+
+struct conversion_input
+{
+    bool is_text = false; // The value is RST, rather than an input filename.
+    std::string value;
+};
+
+struct conversion_request
+{
+    std::string directory;
+    std::vector<conversion_input> inputs;
+    std::string output_filename; // Empty to return the output in the response.
+    bool shutdown = false;       // Ask the server to stop, rather than convert anything.
+};
+
+struct conversion_response
+{
+    int status = 0;
+    std::string output;
+    std::string diagnostics;
+};
+
+struct server_stats
+{
+    size_t requests = 0;
+
+    // Requests whose first input was a prologue that a snapshot was reused for, or created for.
+    size_t prologue_hits = 0;
+    size_t prologue_misses = 0;
+
+    // Input files read from memory rather than from disk, counted once per request.
+    size_t file_hits = 0;
+};
+
+// Converts documents for clients connecting over a Unix domain socket, so that a
+// tool that converts often doesn't start a process each time. The contents of
+// input and included files, and a snapshot of the state after each first input
+// that other inputs follow, such as a prologue with a shared bibliography, are
+// kept between requests and reused for as long as the files' modification times
+// and sizes stay the same.
+class conversion_server
+{
+  public:
+    // Limit on the contents of input files kept in memory.
+    static constexpr size_t MAX_CACHED_BYTES = 256 * 1024 * 1024;
+
+    // How long a connection can go without sending anything, whether between
+    // requests or part way through one, before the server closes it.
+    static constexpr std::chrono::milliseconds DEFAULT_IDLE_TIMEOUT{30000};
+
+    // A thread count of 0 means one thread per hardware thread. Each thread
+    // serves one connection at a time.
+    explicit conversion_server(size_t thread_count = 0);
+
+    // Socket used when none is given: one per user in the temporary directory.
+    static std::filesystem::path
+    default_socket_path();
+
+    // Convert a request's inputs, using and adding to the server's caches.
+    // Returns the response's status: 0 on success, non-zero error code on failure.
+    int
+    convert(const conversion_request& request, conversion_response& response);
+
+    // Listen on a socket, replacing any stale socket file, and serve requests
+    // until a client asks for a shutdown or stop() is called.
+    // Returns 0 on success, non-zero error code on failure.
+    int
+    serve(const std::filesystem::path& socket_path, std::ostream& diagnostics);
+
+    // Make serve() return once the requests in progress are done. Can be called from any thread.
+    void
+    stop();
+
+    // Close connections that are idle for longer than this, so that clients that
+    // stall can't keep every thread from serving anyone else. Call before serve().
+    void
+    set_idle_timeout(std::chrono::milliseconds timeout)
+    {
+        _idle_timeout = timeout;
+    }
+
+    server_stats
+    statistics() const;
+
+  private:
+    struct file_stamp
+    {
+        std::filesystem::file_time_type time;
+        uintmax_t size = 0;
+
+        bool
+        operator==(const file_stamp& other) const = default;
+    };
+    struct cached_file
+    {
+        file_stamp stamp;
+        std::shared_ptr<const std::string> contents;
+    };
+    struct cached_prologue
+    {
+        std::vector<std::pair<std::string, file_stamp>> files;
+
+        // Null if some file wasn't stamped before it was read, so the snapshot might not match the stamps.
+        std::shared_ptr<const rst2rfcxml_snapshot> snapshot;
+    };
+
+    static bool
+    get_stamp(const std::string& filename, file_stamp& stamp);
+    void
+    get_cached_files(
+        std::map<std::string, std::string_view, std::less<>>& inputs,
+        std::vector<std::shared_ptr<const std::string>>& contents);
+    void
+    cache_files(
+        const std::vector<std::string>& filenames,
+        const std::map<std::string, std::string_view, std::less<>>& cached_inputs);
+    std::shared_ptr<const rst2rfcxml_snapshot>
+    get_prologue(const std::string& filename, const std::map<std::string, std::string_view, std::less<>>& inputs);
+    void
+    serve_connection(int connection);
+    void
+    run_worker();
+
+    size_t _thread_count;
+    std::chrono::milliseconds _idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    std::atomic<bool> _stopping = false;
+
+    mutable std::mutex _cache_mutex;
+    std::map<std::string, cached_file, std::less<>> _files;
+    size_t _cached_bytes = 0;
+    std::map<std::string, cached_prologue, std::less<>> _prologues;
+    server_stats _stats;
+
+    // Accepted connections waiting for a worker.
+    std::mutex _queue_mutex;
+    std::condition_variable _queue_changed;
+    std::deque<int> _connections;
+};
+
+// Send a request to a server listening on a socket, and wait for its response.
+// Returns the response's status, or a non-zero error code if the server can't be reached.
+int
+send_conversion_request(
+    const std::filesystem::path& socket_path,
+    const conversion_request& request,
+    conversion_response& response,
+    std::ostream& diagnostics);
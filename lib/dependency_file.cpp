@@ -0,0 +1,56 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "dependency_file.h"
+
+#include <fmt/format.h>
+#include <fstream>
+#include <set>
+
+using namespace std;
+
+filesystem::path
+default_dependency_filename(const filesystem::path& output_filename)
+{
+    return filesystem::path(output_filename).replace_extension(".d");
+}
+
+// Escape a filename the way make reads it: a space or '#' is preceded by a
+// backslash, and '$' is doubled.
+static string
+_escape_make_filename(string_view filename)
+{
+    string escaped;
+    escaped.reserve(filename.length());
+    for (char c : filename) {
+        if (c == ' ' || c == '#') {
+            escaped += '\\';
+        } else if (c == '$') {
+            escaped += '$';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+int
+write_dependency_file(
+    const filesystem::path& filename, string_view target, const vector<string>& dependencies, ostream& diagnostics)
+{
+    string rule = _escape_make_filename(target) + ":";
+    set<string_view> written;
+    for (const string& dependency : dependencies) {
+        if (written.insert(dependency).second) {
+            rule += " \\\n  " + _escape_make_filename(dependency);
+        }
+    }
+    rule += '\n';
+
+    ofstream dependency_file(filename, ios::binary);
+    dependency_file << rule;
+    if (!dependency_file.good()) {
+        diagnostics << fmt::format("ERROR: can't write {}", filename.string()) << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Name of the dependency file that -MD writes for an output file: the output
+// filename with its extension replaced by ".d", as a C compiler does.
+std::filesystem::path
+default_dependency_filename(const std::filesystem::path& output_filename);
+
+// Write a rule in Makefile syntax that makes a target depend on files, such as
+// every file read to produce it, which build tools like make and ninja use to
+// tell when the target is out of date. Files listed more than once are written once.
+// Returns 0 on success, non-zero error code on failure.
+int
+write_dependency_file(
+    const std::filesystem::path& filename,
+    std::string_view target,
+    const std::vector<std::string>& dependencies,
+    std::ostream& diagnostics);
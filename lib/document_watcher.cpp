@@ -0,0 +1,338 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "dependency_file.h"
+#include "document_watcher.h"
+#include "work_stealing_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Suffix of the file that an output is written to before it replaces the output.
+constexpr string_view TEMPORARY_SUFFIX = ".rst2rfcxml-tmp";
+
+document_watcher::document_watcher(vector<batch_job> jobs, size_t thread_count) : _thread_count(thread_count)
+{
+    for (batch_job& job : jobs) {
+        _generated.insert(normalize(job.output_filename));
+        _generated.insert(normalize(job.output_filename + string(TEMPORARY_SUFFIX)));
+        if (!job.dependency_filename.empty()) {
+            _generated.insert(normalize(job.dependency_filename));
+        }
+        watched_document document;
+        document.job = move(job);
+        _documents.push_back(move(document));
+    }
+}
+
+string
+document_watcher::normalize(const filesystem::path& filename)
+{
+    error_code ec;
+    return filesystem::absolute(filename, ec).lexically_normal().string();
+}
+
+watch_stats
+document_watcher::statistics() const
+{
+    lock_guard<mutex> lock(_stats_mutex);
+    return _stats;
+}
+
+// Get a snapshot of the state after a first input, creating it if there's none
+// since the files it read last changed. Returns nullptr if it can't be
+// snapshotted on its own, in which case outputs convert it and report why.
+shared_ptr<const rst2rfcxml_snapshot>
+document_watcher::get_prologue(const string& filename)
+{
+    lock_guard<mutex> lock(_prologue_mutex);
+    auto it = _prologues.find(filename);
+    if (it != _prologues.end()) {
+        return it->second;
+    }
+    rst2rfcxml converter;
+    ostringstream diagnostics;
+    converter.set_diagnostics(diagnostics);
+    converter.set_include_cache(&_included_files);
+    converter.set_map_inputs(false);
+    shared_ptr<const rst2rfcxml_snapshot> snapshot;
+    if (converter.create_snapshot({filename}, snapshot)) {
+        snapshot = nullptr;
+    }
+    _prologues.emplace(filename, snapshot);
+    return snapshot;
+}
+
+// Replace a file with new contents by writing them to another file and renaming
+// it over the first, which readers see happen all at once.
+// Returns 0 on success, non-zero error code on failure.
+static int
+_replace_file(const string& filename, string_view contents, ostream& diagnostics)
+{
+    string temporary_filename = filename + string(TEMPORARY_SUFFIX);
+    {
+        ofstream temporary_file(temporary_filename);
+        temporary_file << contents;
+        if (!temporary_file.good()) {
+            diagnostics << "ERROR: can't write " << temporary_filename << endl;
+            return 1;
+        }
+    }
+    error_code ec;
+    filesystem::rename(temporary_filename, filename, ec);
+    if (ec) {
+        diagnostics << "ERROR: can't write " << filename << endl;
+        filesystem::remove(temporary_filename, ec);
+        return 1;
+    }
+    return 0;
+}
+
+int
+document_watcher::convert(watched_document& document, size_t thread_count, batch_result& result)
+{
+    auto start = chrono::steady_clock::now();
+    const batch_job& job = document.job;
+    ostringstream diagnostics;
+    rst2rfcxml converter;
+    converter.set_diagnostics(diagnostics);
+    converter.set_include_cache(&_included_files);
+    converter.set_map_inputs(false);
+    converter.set_section_cache(_section_cache);
+    converter.set_section_threads(thread_count);
+    converter.set_inline_threads(thread_count);
+    vector<string> input_filenames = job.input_filenames;
+    if (input_filenames.size() > 1) {
+        if (auto prologue = get_prologue(input_filenames[0])) {
+            converter.start_from(*prologue);
+            input_filenames.erase(input_filenames.begin());
+        }
+    }
+
+    // Convert to memory, so that the output is left as it was if converting fails.
+    ostringstream output;
+    result.error = converter.process_files(input_filenames, output);
+    if (!result.error) {
+        result.error = _replace_file(job.output_filename, output.view(), diagnostics);
+        result.bytes_written = output.view().length();
+    }
+    if (!result.error && !job.dependency_filename.empty()) {
+        result.error =
+            write_dependency_file(job.dependency_filename, job.output_filename, converter.files_read(), diagnostics);
+    }
+
+    // A failed conversion might not have read every file it would have, so
+    // it's converted again after any change, until it succeeds.
+    document.dependencies.clear();
+    for (const string& filename : converter.files_read()) {
+        document.dependencies.push_back(normalize(filename));
+    }
+    document.failed = (result.error != 0);
+    result.diagnostics = diagnostics.str();
+    result.elapsed = chrono::steady_clock::now() - start;
+    return result.error;
+}
+
+// Convert some of the documents, in parallel if there are several, and report each one.
+void
+document_watcher::convert_all(const vector<size_t>& indices, ostream& report, ostream& diagnostics)
+{
+    vector<batch_result> results(indices.size());
+    if (indices.size() == 1) {
+        convert(_documents[indices[0]], _thread_count, results[0]);
+    } else {
+        work_stealing_pool pool(_thread_count);
+        pool.run(indices.size(), [&](size_t i) { convert(_documents[indices[i]], 1, results[i]); });
+    }
+
+    lock_guard<mutex> lock(_stats_mutex);
+    for (size_t i = 0; i < indices.size(); i++) {
+        const batch_result& result = results[i];
+        diagnostics << result.diagnostics;
+        report << fmt::format(
+            "{}: {} ({:.1f} ms)\n",
+            _documents[indices[i]].job.output_filename,
+            result.error ? "FAILED" : "ok",
+            result.elapsed.count() * 1000);
+        _stats.conversions++;
+        _stats.failures += (result.error != 0);
+    }
+    report.flush();
+}
+
+void
+document_watcher::index_dependencies()
+{
+    _dependents.clear();
+    for (size_t i = 0; i < _documents.size(); i++) {
+        for (const string& filename : _documents[i].dependencies) {
+            _dependents[filename].push_back(i);
+        }
+    }
+}
+
+// Find the documents to convert again after some files changed, forgetting
+// anything kept from before that came from those files.
+vector<size_t>
+document_watcher::find_affected(const set<string>& changed_files, bool overflowed)
+{
+    set<size_t> affected;
+    for (size_t i = 0; i < _documents.size(); i++) {
+        if (overflowed || _documents[i].failed) {
+            affected.insert(i);
+        }
+    }
+    for (const string& filename : changed_files) {
+        _included_files.forget(filename);
+        auto dependents = _dependents.find(filename);
+        if (dependents != _dependents.end()) {
+            affected.insert(dependents->second.begin(), dependents->second.end());
+        }
+    }
+
+    lock_guard<mutex> lock(_prologue_mutex);
+    for (auto it = _prologues.begin(); it != _prologues.end();) {
+        bool changed = overflowed || it->second == nullptr;
+        for (size_t i = 0; !changed && i < it->second->files_read().size(); i++) {
+            changed = changed_files.contains(normalize(it->second->files_read()[i]));
+        }
+        it = changed ? _prologues.erase(it) : next(it);
+    }
+    return {affected.begin(), affected.end()};
+}
+
+#ifndef __linux__
+int
+document_watcher::watch(ostream& report, ostream& diagnostics)
+{
+    diagnostics << "ERROR: watching for changes needs inotify, which isn't supported on this platform" << endl;
+    return 1;
+}
+#else
+constexpr int POLL_MILLISECONDS = 100; // How often watch() checks whether it's stopping.
+constexpr uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB;
+
+int
+document_watcher::watch(ostream& report, ostream& diagnostics)
+{
+    vector<size_t> all(_documents.size());
+    for (size_t i = 0; i < all.size(); i++) {
+        all[i] = i;
+    }
+    convert_all(all, report, diagnostics);
+
+    int notifier = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notifier < 0) {
+        diagnostics << fmt::format("ERROR: can't watch for changes: {}", strerror(errno)) << endl;
+        return 1;
+    }
+
+    // Watch the directory of every file read, and of every input in case it was missing.
+    map<int, filesystem::path> directories;
+    set<filesystem::path> watched;
+    bool any_failed = false;
+    auto watch_directories = [&]() {
+        index_dependencies();
+        any_failed = false;
+        for (const watched_document& document : _documents) {
+            any_failed = any_failed || document.failed;
+            vector<string> filenames = document.dependencies;
+            for (const string& input_filename : document.job.input_filenames) {
+                filenames.push_back(normalize(input_filename));
+            }
+            for (const string& filename : filenames) {
+                filesystem::path directory = filesystem::path(filename).parent_path();
+                if (!watched.insert(directory).second) {
+                    continue;
+                }
+                int watch_descriptor = inotify_add_watch(notifier, directory.c_str(), WATCH_EVENTS);
+                if (watch_descriptor < 0) {
+                    diagnostics << fmt::format("ERROR: can't watch {}: {}", directory.string(), strerror(errno))
+                                << endl;
+                } else {
+                    directories[watch_descriptor] = directory;
+                }
+            }
+        }
+        lock_guard<mutex> lock(_stats_mutex);
+        _stats.directories = directories.size();
+    };
+    watch_directories();
+    report << fmt::format("Watching for changes to {} files\n", _dependents.size()) << flush;
+
+    // Changes are collected until none has come for the debounce time.
+    set<string> changed_files;
+    bool overflowed = false;
+    bool settling = false;
+    chrono::steady_clock::time_point deadline;
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (!_stopping) {
+        int timeout = POLL_MILLISECONDS;
+        if (settling) {
+            auto remaining = chrono::ceil<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+            timeout = static_cast<int>(clamp<chrono::milliseconds::rep>(remaining.count(), 0, POLL_MILLISECONDS));
+        }
+        pollfd entry{notifier, POLLIN, 0};
+        if (poll(&entry, 1, timeout) > 0) {
+            bool relevant = false;
+            ssize_t length;
+            while ((length = read(notifier, buffer, sizeof(buffer))) > 0) {
+                for (char* position = buffer; position < buffer + length;) {
+                    const inotify_event* event = reinterpret_cast<const inotify_event*>(position);
+                    position += sizeof(inotify_event) + event->len;
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        overflowed = relevant = true;
+                        continue;
+                    }
+                    auto directory = directories.find(event->wd);
+                    if (directory == directories.end() || event->len == 0) {
+                        continue;
+                    }
+                    string filename = normalize(directory->second / event->name);
+                    if (_generated.contains(filename)) {
+                        continue;
+                    }
+                    if (any_failed || _dependents.contains(filename)) {
+                        changed_files.insert(move(filename));
+                        relevant = true;
+                    }
+                }
+            }
+            if (relevant) {
+                settling = true;
+                deadline = chrono::steady_clock::now() + _debounce;
+            }
+        }
+        if (!settling || chrono::steady_clock::now() < deadline) {
+            continue;
+        }
+
+        vector<size_t> affected = find_affected(changed_files, overflowed);
+        changed_files.clear();
+        overflowed = false;
+        settling = false;
+        if (affected.empty()) {
+            continue;
+        }
+        {
+            lock_guard<mutex> lock(_stats_mutex);
+            _stats.rebuilds++;
+        }
+        convert_all(affected, report, diagnostics);
+        watch_directories();
+    }
+    close(notifier);
+    return 0;
+}
+#endif
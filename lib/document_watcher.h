@@ -0,0 +1,118 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "batch.h"
+#include "include_cache.h"
+#include "rst2rfcxml.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+struct watch_stats
+{
+    // Directories being watched for changes, once the first conversions are done.
+    size_t directories = 0;
+
+    // Times that changed files made outputs be converted again, after waiting for changes to settle.
+    size_t rebuilds = 0;
+
+    // Outputs converted, including the first conversion of each one.
+    size_t conversions = 0;
+    size_t failures = 0;
+};
+
+// Keeps output documents up to date by converting each one again whenever a
+// file it was converted from changes, including any file it includes directly
+// or indirectly. Changes are watched for with inotify, in the directories of
+// those files, so that files an editor saves by replacing them are noticed too.
+// The contents of unchanged files, and a snapshot of the state after each first
+// input that other inputs follow, such as a prologue, are kept between conversions.
+class document_watcher
+{
+  public:
+    static constexpr std::chrono::milliseconds DEFAULT_DEBOUNCE{10};
+
+    // Several outputs to convert are converted in parallel on the given number
+    // of threads, 0 meaning one per hardware thread, and a single one is
+    // converted section by section on them, if it's large enough, as with -j.
+    explicit document_watcher(std::vector<batch_job> jobs, size_t thread_count = 0);
+
+    // How long to wait after a change for more changes, such as the rest of a
+    // burst of saves, before converting.
+    void
+    set_debounce(std::chrono::milliseconds debounce)
+    {
+        _debounce = debounce;
+    }
+
+    void
+    set_section_cache(section_cache* cache)
+    {
+        _section_cache = cache;
+    }
+
+    // Convert every output, and then watch for changes until stop() is called,
+    // reporting each conversion, like a batch does, and writing error messages
+    // to diagnostics. Each output file is replaced at once, so a reader never
+    // sees a partly written one, and is left as it was if converting fails.
+    // Returns 0 once stopped, non-zero error code if changes can't be watched for.
+    int
+    watch(std::ostream& report, std::ostream& diagnostics);
+
+    // Make watch() return once the conversions in progress are done. Can be called from any thread.
+    void
+    stop()
+    {
+        _stopping = true;
+    }
+
+    watch_stats
+    statistics() const;
+
+  private:
+    struct watched_document
+    {
+        batch_job job;
+        std::vector<std::string> dependencies; // Absolute paths of the files read by the last conversion.
+        bool failed = false;
+    };
+
+    static std::string
+    normalize(const std::filesystem::path& filename);
+    std::shared_ptr<const rst2rfcxml_snapshot>
+    get_prologue(const std::string& filename);
+    int
+    convert(watched_document& document, size_t thread_count, batch_result& result);
+    void
+    convert_all(const std::vector<size_t>& indices, std::ostream& report, std::ostream& diagnostics);
+    void
+    index_dependencies();
+    std::vector<size_t>
+    find_affected(const std::set<std::string>& changed_files, bool overflowed);
+
+    std::vector<watched_document> _documents;
+    size_t _thread_count;
+    std::chrono::milliseconds _debounce = DEFAULT_DEBOUNCE;
+    section_cache* _section_cache = nullptr;
+    include_cache _included_files;
+    std::atomic<bool> _stopping = false;
+
+    // Documents by each file they depend on, and the files that conversions write, whose changes are ignored.
+    std::map<std::string, std::vector<size_t>, std::less<>> _dependents;
+    std::set<std::string, std::less<>> _generated;
+
+    // Snapshots after first inputs that several outputs share.
+    std::mutex _prologue_mutex;
+    std::map<std::string, std::shared_ptr<const rst2rfcxml_snapshot>, std::less<>> _prologues;
+
+    mutable std::mutex _stats_mutex;
+    watch_stats _stats;
+};
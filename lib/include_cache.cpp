@@ -0,0 +1,229 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "include_cache.h"
+
+#include <fstream>
+
+using namespace std;
+
+include_cache::include_cache(size_t max_bytes) : _max_bytes(max_bytes) {}
+
+include_cache::~include_cache()
+{
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+        _changed.notify_all();
+    }
+    if (_prefetcher.joinable()) {
+        _prefetcher.join();
+    }
+}
+
+bool
+include_cache::get_stamp(const filesystem::path& filename, file_stamp& stamp)
+{
+    error_code ec;
+    if (!filesystem::is_regular_file(filename, ec)) {
+        return false;
+    }
+    stamp.time = filesystem::last_write_time(filename, ec);
+    if (ec) {
+        return false;
+    }
+    stamp.size = filesystem::file_size(filename, ec);
+    return !ec;
+}
+
+// Find the files named by include directives, which are resolved against the
+// directory of the including file. Names that a converter would reject, such
+// as those with a path separator, are skipped.
+vector<filesystem::path>
+include_cache::find_included_files(const filesystem::path& directory, string_view contents)
+{
+    constexpr string_view INCLUDE_DIRECTIVE = ".. include:: ";
+    vector<filesystem::path> included_files;
+    for (size_t position = 0;; position++) {
+        position = contents.find(INCLUDE_DIRECTIVE, position);
+        if (position == string_view::npos) {
+            break;
+        }
+        if (position > 0 && contents[position - 1] != '\n') {
+            continue;
+        }
+        size_t start = position + INCLUDE_DIRECTIVE.length();
+        size_t end = contents.find('\n', start);
+        string_view name = contents.substr(start, (end == string_view::npos) ? string_view::npos : end - start);
+        if (name.ends_with('\r')) {
+            name.remove_suffix(1);
+        }
+        if (!name.empty() && name.find_first_of("/\\") == string_view::npos) {
+            included_files.push_back(directory / name);
+        }
+    }
+    return included_files;
+}
+
+// Read a file whose stamp was taken beforehand, so that a change while reading it is noticed next time.
+bool
+include_cache::read_file(const string& filename, const file_stamp& stamp, cached_file& file)
+{
+    ifstream input_file(filename, ios::binary);
+    if (!input_file.good()) {
+        return false;
+    }
+    string contents(stamp.size, '\0');
+    input_file.read(contents.data(), contents.size());
+    contents.resize(input_file.gcount());
+    file.stamp = stamp;
+    file.included_files = find_included_files(filesystem::path(filename).parent_path(), contents);
+    file.contents = make_shared<const string>(move(contents));
+    return true;
+}
+
+void
+include_cache::store(const string& filename, cached_file file)
+{
+    auto it = _files.find(filename);
+    if (it != _files.end()) {
+        _cached_bytes -= it->second.contents->size();
+        _files.erase(it);
+    }
+    if (_cached_bytes + file.contents->size() <= _max_bytes) {
+        _cached_bytes += file.contents->size();
+        _files.emplace(filename, move(file));
+    }
+}
+
+void
+include_cache::enqueue(const vector<filesystem::path>& filenames)
+{
+    bool queued = false;
+    for (const filesystem::path& filename : filenames) {
+        string name = filename.string();
+        if (_queued.insert(name).second) {
+            _queue.push_back(move(name));
+            queued = true;
+        }
+    }
+    if (!queued) {
+        return;
+    }
+    if (!_prefetcher.joinable()) {
+        _prefetcher = thread([this] { run_prefetcher(); });
+    }
+    _changed.notify_all();
+}
+
+shared_ptr<const string>
+include_cache::get(const filesystem::path& filename)
+{
+    file_stamp stamp;
+    if (!get_stamp(filename, stamp)) {
+        return nullptr;
+    }
+    string name = filename.string();
+    unique_lock<mutex> lock(_mutex);
+    if (_reading.contains(name)) {
+        _stats.waits++;
+        _changed.wait(lock, [&] { return !_reading.contains(name); });
+    }
+    auto it = _files.find(name);
+    if (it != _files.end() && it->second.stamp == stamp) {
+        // Files it includes might have changed, so check them ahead of time too.
+        _stats.hits++;
+        enqueue(it->second.included_files);
+        return it->second.contents;
+    }
+    _stats.misses++;
+    lock.unlock();
+
+    cached_file file;
+    if (!read_file(name, stamp, file)) {
+        return nullptr;
+    }
+    shared_ptr<const string> contents = file.contents;
+    lock.lock();
+    enqueue(file.included_files);
+    store(name, move(file));
+    return contents;
+}
+
+void
+include_cache::prefetch_includes(const filesystem::path& directory, string_view contents)
+{
+    vector<filesystem::path> included_files = find_included_files(directory, contents);
+    unique_lock<mutex> lock(_mutex);
+    enqueue(included_files);
+}
+
+// Read queued files that aren't in memory or have changed, queueing the files
+// they include in turn. Files that are already current end the chain, so an
+// include cycle is only followed once.
+void
+include_cache::run_prefetcher()
+{
+    unique_lock<mutex> lock(_mutex);
+    for (;;) {
+        _changed.wait(lock, [this] { return _stopping || !_queue.empty(); });
+        if (_stopping) {
+            return;
+        }
+        string name = move(_queue.front());
+        _queue.pop_front();
+        _reading.insert(name);
+        lock.unlock();
+
+        file_stamp stamp;
+        cached_file file;
+        bool read = get_stamp(name, stamp);
+        if (read) {
+            lock.lock();
+            auto it = _files.find(name);
+            read = (it == _files.end() || !(it->second.stamp == stamp));
+            lock.unlock();
+        }
+        read = read && read_file(name, stamp, file);
+
+        lock.lock();
+        _reading.erase(name);
+        _queued.erase(name);
+        if (read) {
+            _stats.prefetched++;
+            enqueue(file.included_files);
+            store(name, move(file));
+        }
+        _changed.notify_all();
+    }
+}
+
+void
+include_cache::forget(const filesystem::path& filename)
+{
+    error_code ec;
+    filesystem::path name = filesystem::absolute(filename, ec).lexically_normal();
+    lock_guard<mutex> lock(_mutex);
+    for (auto it = _files.begin(); it != _files.end();) {
+        if (filesystem::absolute(it->first, ec).lexically_normal() == name) {
+            _cached_bytes -= it->second.contents->size();
+            it = _files.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void
+include_cache::wait_for_prefetches()
+{
+    unique_lock<mutex> lock(_mutex);
+    _changed.wait(lock, [this] { return _queued.empty() || _stopping; });
+}
+
+include_cache_stats
+include_cache::statistics() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _stats;
+}
@@ -0,0 +1,118 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+struct include_cache_stats
+{
+    // Files found in memory, unchanged since they were read.
+    size_t hits = 0;
+
+    // Files read when they were needed, because they weren't in memory or had changed.
+    size_t misses = 0;
+
+    // Files read ahead of time on the I/O thread.
+    size_t prefetched = 0;
+
+    // Hits that had to wait for the I/O thread to finish reading the file.
+    size_t waits = 0;
+};
+
+// Contents of included files, kept in memory by path and reused for as long as
+// the files' modification times and sizes stay the same. Reading a file finds
+// the files it includes, which are then read ahead on a background I/O thread,
+// as are their own included files, so that reading them overlaps converting
+// the file that includes them. Any number of converters can share a cache.
+class include_cache
+{
+  public:
+    // Limit on the contents kept in memory. Files read beyond it are still returned, but not kept.
+    static constexpr size_t DEFAULT_MAX_BYTES = 256 * 1024 * 1024;
+
+    explicit include_cache(size_t max_bytes = DEFAULT_MAX_BYTES);
+    include_cache(const include_cache&) = delete;
+    include_cache&
+    operator=(const include_cache&) = delete;
+    ~include_cache();
+
+    // Get the contents of a regular file, reading it if it isn't in memory or has
+    // changed since it was, and read ahead the files it includes.
+    // Returns nullptr if the file can't be read, or isn't a regular file.
+    std::shared_ptr<const std::string>
+    get(const std::filesystem::path& filename);
+
+    // Read ahead the files included by the contents of a file in a directory,
+    // such as an input file that isn't itself in the cache.
+    void
+    prefetch_includes(const std::filesystem::path& directory, std::string_view contents);
+
+    // Drop the contents of a file, however its name is spelled, such as when
+    // it's known to have changed even if its modification time and size haven't.
+    void
+    forget(const std::filesystem::path& filename);
+
+    // Wait until the I/O thread has read every file it was asked to.
+    void
+    wait_for_prefetches();
+
+    include_cache_stats
+    statistics() const;
+
+  private:
+    struct file_stamp
+    {
+        std::filesystem::file_time_type time;
+        uintmax_t size = 0;
+
+        bool
+        operator==(const file_stamp& other) const = default;
+    };
+    struct cached_file
+    {
+        file_stamp stamp;
+        std::shared_ptr<const std::string> contents;
+        std::vector<std::filesystem::path> included_files;
+    };
+
+    static bool
+    get_stamp(const std::filesystem::path& filename, file_stamp& stamp);
+    static std::vector<std::filesystem::path>
+    find_included_files(const std::filesystem::path& directory, std::string_view contents);
+    bool
+    read_file(const std::string& filename, const file_stamp& stamp, cached_file& file);
+
+    // Called with the mutex held.
+    void
+    store(const std::string& filename, cached_file file);
+    void
+    enqueue(const std::vector<std::filesystem::path>& filenames);
+
+    void
+    run_prefetcher();
+
+    size_t _max_bytes;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _changed;
+    std::map<std::string, cached_file, std::less<>> _files;
+    size_t _cached_bytes = 0;
+    include_cache_stats _stats;
+
+    // Files waiting for the I/O thread; those waiting or being read by it; and those being read.
+    std::deque<std::string> _queue;
+    std::set<std::string, std::less<>> _queued;
+    std::set<std::string, std::less<>> _reading;
+    bool _stopping = false;
+    std::thread _prefetcher;
+};
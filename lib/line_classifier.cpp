@@ -0,0 +1,194 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "line_classifier.h"
+
+#include <array>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+using namespace std;
+
+#ifdef USE_SSE2
+// Get the index of the lowest set bit in a non-zero mask.
+static unsigned
+_lowest_bit(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// Find the first character at or after a given offset that is neither of two
+// given characters, or npos if there is none.
+static size_t
+_find_first_not_of(string_view line, char first, char second, size_t offset = 0)
+{
+    size_t i = offset;
+#ifdef USE_SSE2
+    const __m128i first_vector = _mm_set1_epi8(first);
+    const __m128i second_vector = _mm_set1_epi8(second);
+    for (; i + 16 <= line.length(); i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line.data() + i));
+        __m128i matches =
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, first_vector), _mm_cmpeq_epi8(bytes, second_vector));
+        unsigned mismatches = ~static_cast<unsigned>(_mm_movemask_epi8(matches)) & 0xFFFF;
+        if (mismatches != 0) {
+            return i + _lowest_bit(mismatches);
+        }
+    }
+#endif
+    for (; i < line.length(); i++) {
+        if (line[i] != first && line[i] != second) {
+            return i;
+        }
+    }
+    return string_view::npos;
+}
+
+// Names of supported directives, indexed by directive_kind.
+static constexpr string_view directive_names[DIRECTIVE_KIND_COUNT] = {
+    {}, // none
+    {}, // comment
+    {}, // variable_definition
+    {}, // unknown
+    "admonition",
+    "code-block",
+    "contents",
+    "glossary",
+    "header",
+    "include",
+    "sectnum",
+    "table",
+};
+
+// Hash a directive name by its length and first character, which is enough
+// to tell all supported directives apart.
+constexpr size_t DIRECTIVE_HASH_SIZE = 16;
+static constexpr size_t
+_hash_directive_name(string_view name)
+{
+    return (name.length() * 4 + static_cast<unsigned char>(name[0])) % DIRECTIVE_HASH_SIZE;
+}
+
+static constexpr array<directive_kind, DIRECTIVE_HASH_SIZE> directive_hash_table = [] {
+    array<directive_kind, DIRECTIVE_HASH_SIZE> table{};
+    for (size_t kind = 0; kind < DIRECTIVE_KIND_COUNT; kind++) {
+        if (!directive_names[kind].empty()) {
+            table[_hash_directive_name(directive_names[kind])] = static_cast<directive_kind>(kind);
+        }
+    }
+    return table;
+}();
+
+static constexpr bool
+_is_directive_hash_perfect()
+{
+    for (size_t kind = 0; kind < DIRECTIVE_KIND_COUNT; kind++) {
+        if (!directive_names[kind].empty() &&
+            directive_hash_table[_hash_directive_name(directive_names[kind])] != static_cast<directive_kind>(kind)) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(_is_directive_hash_perfect(), "Directive names collide in the hash table; adjust _hash_directive_name");
+
+// Look up a directive by name, which takes the same time however many directives are supported.
+static directive_kind
+_get_directive_kind(string_view name)
+{
+    directive_kind kind = directive_hash_table[_hash_directive_name(name)];
+    if (kind != directive_kind::none && directive_names[static_cast<size_t>(kind)] == name) {
+        return kind;
+    }
+    return directive_kind::unknown;
+}
+
+// Classify explicit markup starting at a given offset.
+static void
+_classify_explicit_markup(string_view line, size_t offset, line_info& info)
+{
+    string_view markup = line.substr(offset);
+    if (!markup.starts_with("..")) {
+        return;
+    }
+    if (_find_first_not_of(markup, ' ', ' ', 2) == string_view::npos) {
+        info.directive = directive_kind::comment;
+        return;
+    }
+    if (markup.starts_with(".. |")) {
+        info.directive = directive_kind::variable_definition;
+        return;
+    }
+    if (!markup.starts_with(".. ")) {
+        return;
+    }
+    size_t name_end = markup.find("::", 3);
+    if (name_end == string_view::npos) {
+        return;
+    }
+    string_view name = markup.substr(3, name_end - 3);
+    if (name.empty() || name.find(' ') != string_view::npos) {
+        return;
+    }
+    info.directive = _get_directive_kind(name);
+    info.directive_argument = offset + name_end + 2;
+}
+
+static void
+_classify_list_marker(string_view line, size_t offset, line_info& info)
+{
+    string_view marker = line.substr(offset);
+    if (marker.starts_with("* ")) {
+        info.list = list_marker::bullet;
+        info.list_marker_length = 2;
+    } else if (marker.starts_with("#. ")) {
+        info.list = list_marker::auto_enumerated;
+        info.list_marker_length = 3;
+    } else {
+        size_t digits = 0;
+        while (digits < marker.length() && marker[digits] >= '0' && marker[digits] <= '9') {
+            digits++;
+        }
+        if (digits > 0 && digits <= UINT8_MAX - 2 && marker.substr(digits).starts_with(". ")) {
+            info.list = list_marker::enumerated;
+            info.list_marker_length = static_cast<uint8_t>(digits + 2);
+        }
+    }
+}
+
+line_info
+classify_line(string_view line)
+{
+    line_info info;
+    info.indentation = _find_first_not_of(line, ' ', ' ');
+    if (info.blank()) {
+        return info;
+    }
+
+    char first = line[info.indentation];
+    if (info.indentation == 0 && (first == '=' || first == '-' || first == '~') &&
+        _find_first_not_of(line, first, first) == string_view::npos) {
+        info.underline = first;
+    }
+    if (first == '=') {
+        info.table_border = (_find_first_not_of(line, ' ', '=', info.indentation) == string_view::npos);
+    } else if (first == '.') {
+        _classify_explicit_markup(line, info.indentation, info);
+    } else if (first == '*' || first == '#' || (first >= '0' && first <= '9')) {
+        _classify_list_marker(line, info.indentation, info);
+    }
+    return info;
+}
@@ -0,0 +1,66 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// Kinds of list item markers that can start a line.
+enum class list_marker : uint8_t
+{
+    none,
+    bullet,          // "* "
+    enumerated,      // "1. "
+    auto_enumerated, // "#. "
+};
+
+// Kinds of explicit markup, i.e., lines starting with "..".
+enum class directive_kind : uint8_t
+{
+    none,
+    comment,             // ".." followed by nothing but spaces.
+    variable_definition, // ".. |name| replace:: value"
+    unknown,             // ".. name::" for a directive we don't support.
+    admonition,
+    code_block,
+    contents,
+    glossary,
+    header,
+    include,
+    sectnum,
+    table,
+};
+constexpr size_t DIRECTIVE_KIND_COUNT = static_cast<size_t>(directive_kind::table) + 1;
+
+// Summary of a line of RST, computed once per line so that the parser
+// doesn't have to rescan the line for each construct it checks for.
+struct line_info
+{
+    // Number of leading spaces, or npos if the line is blank.
+    size_t indentation = std::string_view::npos;
+
+    // Offset just past the "::" of a directive, where its argument starts.
+    size_t directive_argument = 0;
+
+    directive_kind directive = directive_kind::none;
+    list_marker list = list_marker::none;
+
+    // Length of the list item marker, including the space after it.
+    uint8_t list_marker_length = 0;
+
+    // Underline character if the line is a run of '=', '-', or '~', or 0 if not.
+    char underline = 0;
+
+    // True if the line is a table border of '=' columns separated by spaces.
+    bool table_border = false;
+
+    bool
+    blank() const
+    {
+        return indentation == std::string_view::npos;
+    }
+};
+
+// Classify a line of RST input.
+line_info
+classify_line(std::string_view line);
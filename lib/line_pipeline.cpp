@@ -0,0 +1,142 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "line_pipeline.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+line_pipeline::line_pipeline(size_t capacity) : _ring(capacity) {}
+
+line_pipeline::~line_pipeline()
+{
+    pipeline_stats ignored;
+    stop(ignored);
+}
+
+// Reader thread: get the next free slot, waiting for the converter if the
+// ring is full. Returns nullptr if the pipeline is being stopped.
+line_pipeline::entry*
+line_pipeline::wait_for_slot()
+{
+    entry* slot = _ring.begin_push();
+    if (slot != nullptr) {
+        return slot;
+    }
+    _reader_stalls++;
+    spsc_backoff backoff;
+    while ((slot = _ring.begin_push()) == nullptr) {
+        if (_stopping.load(memory_order_relaxed)) {
+            return nullptr;
+        }
+        backoff.wait();
+    }
+    return slot;
+}
+
+// Reader thread: fill slots using read_line(slot) until it returns false,
+// then push an entry marking the end of the input.
+template <typename T>
+void
+line_pipeline::read_lines(T read_line)
+{
+    for (;;) {
+        entry* slot = wait_for_slot();
+        if (slot == nullptr) {
+            return;
+        }
+        bool end = !read_line(*slot);
+        slot->end = end;
+        _ring.end_push();
+        if (end) {
+            return;
+        }
+    }
+}
+
+void
+line_pipeline::start(istream& input)
+{
+    _copies_lines = true;
+    _reader = thread([this, &input] {
+        read_lines([&input](entry& slot) {
+            if (!getline(input, slot.storage)) {
+                return false;
+            }
+            slot.info = classify_line(slot.storage);
+            return true;
+        });
+    });
+}
+
+void
+line_pipeline::start(string_view input)
+{
+    _copies_lines = false;
+    _reader = thread([this, input] {
+        line_iterator lines(input);
+        read_lines([&lines](entry& slot) {
+            if (!lines.next(slot.line)) {
+                return false;
+            }
+            slot.info = classify_line(slot.line);
+            return true;
+        });
+    });
+}
+
+bool
+line_pipeline::next(string_view& line, line_info& info)
+{
+    if (_ended) {
+        return false;
+    }
+    entry* slot = _ring.begin_pop();
+    if (slot == nullptr) {
+        _stats.converter_stalls++;
+        spsc_backoff backoff;
+        while ((slot = _ring.begin_pop()) == nullptr) {
+            backoff.wait();
+        }
+    }
+    if (slot->end) {
+        _ended = true;
+        _ring.end_pop();
+        return false;
+    }
+
+    size_t occupancy = _ring.size();
+    _stats.lines++;
+    _stats.occupancy_total += occupancy;
+    _stats.max_occupancy = max(_stats.max_occupancy, occupancy);
+
+    if (_copies_lines) {
+        // Take the copy and give the slot the buffer of the line before the
+        // previous one, which is no longer in use, so its capacity is reused.
+        _current ^= 1;
+        swap(_lines[_current], slot->storage);
+        line = _lines[_current];
+    } else {
+        line = slot->line;
+    }
+    info = slot->info;
+    _ring.end_pop();
+    return true;
+}
+
+void
+line_pipeline::stop(pipeline_stats& stats)
+{
+    if (!_reader.joinable()) {
+        return;
+    }
+    _stopping = true;
+    _reader.join();
+
+    stats.lines += _stats.lines;
+    stats.reader_stalls += _reader_stalls;
+    stats.converter_stalls += _stats.converter_stalls;
+    stats.occupancy_total += _stats.occupancy_total;
+    stats.max_occupancy = max(stats.max_occupancy, _stats.max_occupancy);
+    stats.ring_capacity = _ring.capacity();
+}
@@ -0,0 +1,101 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include "line_classifier.h"
+#include "spsc_ring.h"
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Counters of how the stages of a pipelined conversion kept up with each other.
+// A stage that often waits on a full ring is being held back by the next stage,
+// and one that often waits on an empty ring by the previous stage.
+struct pipeline_stats
+{
+    size_t lines = 0;
+
+    // Number of times the reader found the line ring full, or the converter found it empty.
+    size_t reader_stalls = 0;
+    size_t converter_stalls = 0;
+
+    // Lines waiting in the ring each time the converter took one, summed over all lines,
+    // so that occupancy_total / lines is the average occupancy.
+    size_t occupancy_total = 0;
+    size_t max_occupancy = 0;
+    size_t ring_capacity = 0;
+
+    // Full output buffers handed to the output thread, and the number of times the
+    // converter found the output thread still busy with earlier ones.
+    size_t output_buffers = 0;
+    size_t output_stalls = 0;
+
+    double
+    average_occupancy() const
+    {
+        return lines ? double(occupancy_total) / lines : 0;
+    }
+};
+
+// Reads lines of input on a thread of its own, splitting and classifying them
+// ahead of the thread that converts them.
+class line_pipeline
+{
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+
+    explicit line_pipeline(size_t capacity = DEFAULT_CAPACITY);
+    ~line_pipeline();
+
+    // Start reading lines from a stream, which mustn't be used elsewhere until the
+    // pipeline is stopped. Lines are copied, and each one stays valid until the line
+    // after next is returned, like lines read from a stream directly.
+    // A pipeline reads only one input.
+    void
+    start(std::istream& input);
+
+    // Start splitting a buffer into lines, which are views of the buffer.
+    void
+    start(std::string_view input);
+
+    // Get the next line and its classification. Returns false at the end of the input.
+    bool
+    next(std::string_view& line, line_info& info);
+
+    // Stop reading, even if not all lines were consumed, and add this pipeline's
+    // counters to stats.
+    void
+    stop(pipeline_stats& stats);
+
+  private:
+    struct entry
+    {
+        std::string storage; // Copy of the line, when reading from a stream.
+        std::string_view line;
+        line_info info;
+        bool end = false;
+    };
+
+    template <typename T>
+    void
+    read_lines(T read_line);
+    entry*
+    wait_for_slot();
+
+    spsc_ring<entry> _ring;
+    std::thread _reader;
+    std::atomic<bool> _stopping = false;
+    bool _copies_lines = false;
+    bool _ended = false;
+
+    // Lines handed to the converter, alternating so the previous one stays valid.
+    std::string _lines[2];
+    size_t _current = 0;
+
+    // Counters updated by the reader thread, and by the converter thread.
+    size_t _reader_stalls = 0;
+    pipeline_stats _stats;
+};
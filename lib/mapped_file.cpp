@@ -0,0 +1,113 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+mapped_file::~mapped_file() { close(); }
+
+#ifdef _WIN32
+bool
+mapped_file::open(const filesystem::path& filename)
+{
+    close();
+    HANDLE file = CreateFileW(
+        filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return false;
+    }
+    if (size.QuadPart == 0) {
+        // Empty files can't be mapped, but there's nothing to read anyway.
+        CloseHandle(file);
+        _open = true;
+        return true;
+    }
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == nullptr) {
+        return false;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == nullptr) {
+        CloseHandle(mapping);
+        return false;
+    }
+    _mapping = mapping;
+    _data = static_cast<const char*>(data);
+    _size = static_cast<size_t>(size.QuadPart);
+    _open = true;
+    return true;
+}
+
+void
+mapped_file::close()
+{
+    if (_data != nullptr) {
+        UnmapViewOfFile(_data);
+        CloseHandle(_mapping);
+    }
+    _mapping = nullptr;
+    _data = nullptr;
+    _size = 0;
+    _open = false;
+}
+#else
+bool
+mapped_file::open(const filesystem::path& filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+        ::close(fd);
+        return false;
+    }
+    if (status.st_size == 0) {
+        // Empty files can't be mapped, but there's nothing to read anyway.
+        ::close(fd);
+        _open = true;
+        return true;
+    }
+    void* data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, static_cast<size_t>(status.st_size), MADV_SEQUENTIAL);
+#endif
+    _data = static_cast<const char*>(data);
+    _size = static_cast<size_t>(status.st_size);
+    _open = true;
+    return true;
+}
+
+void
+mapped_file::close()
+{
+    if (_data != nullptr) {
+        munmap(const_cast<char*>(_data), _size);
+    }
+    _data = nullptr;
+    _size = 0;
+    _open = false;
+}
+#endif
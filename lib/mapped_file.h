@@ -0,0 +1,81 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <filesystem>
+#include <string_view>
+
+// Read-only memory mapping of an input file. Only regular files are mapped;
+// callers should fall back to reading a stream when open() fails, e.g., for pipes.
+class mapped_file
+{
+  public:
+    mapped_file() = default;
+    mapped_file(const mapped_file&) = delete;
+    mapped_file&
+    operator=(const mapped_file&) = delete;
+    ~mapped_file();
+
+    // Map a file into memory. Returns true on success, false if the file
+    // can't be opened or isn't a regular file.
+    bool
+    open(const std::filesystem::path& filename);
+
+    // Unmap the file, invalidating any views into its contents.
+    void
+    close();
+
+    bool
+    is_open() const
+    {
+        return _open;
+    }
+
+    std::string_view
+    contents() const
+    {
+        return {_data, _size};
+    }
+
+  private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+    bool _open = false;
+#ifdef _WIN32
+    void* _mapping = nullptr;
+#endif
+};
+
+// Iterates over the lines of a buffer as views into it, with the same
+// splitting as std::getline: a final line without a newline is still a line.
+class line_iterator
+{
+  public:
+    explicit line_iterator(std::string_view text) : _text(text) {}
+
+    // Get the next line, without its line ending. Returns false at the end of the buffer.
+    bool
+    next(std::string_view& line)
+    {
+        if (_position >= _text.length()) {
+            return false;
+        }
+        size_t end = _text.find('\n', _position);
+        if (end == std::string_view::npos) {
+            end = _text.length();
+        }
+        line = _text.substr(_position, end - _position);
+        _position = end + 1;
+#ifdef _WIN32
+        // Match a text-mode stream, which strips the carriage return.
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+#endif
+        return true;
+    }
+
+  private:
+    std::string_view _text;
+    size_t _position = 0;
+};
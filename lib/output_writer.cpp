@@ -0,0 +1,172 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "output_writer.h"
+#include "spsc_ring.h"
+
+#include <thread>
+
+using namespace std;
+
+// Thread that writes full buffers to their streams, and the buffers waiting for it.
+struct output_writer::background_writer
+{
+    struct chunk
+    {
+        ostream* stream = nullptr;
+        string text;
+    };
+
+    // A few buffers are enough to smooth out a stream that's slow now and then.
+    spsc_ring<chunk> chunks{4};
+    atomic<bool> stopping = false;
+    thread writer;
+
+    void
+    write_chunks()
+    {
+        spsc_backoff backoff;
+        for (;;) {
+            chunk* next = chunks.begin_pop();
+            if (next == nullptr) {
+                // Anything handed off before stopping was set is visible once it's seen.
+                if (stopping.load(memory_order_acquire) && (next = chunks.begin_pop()) == nullptr) {
+                    return;
+                }
+                if (next == nullptr) {
+                    backoff.wait();
+                    continue;
+                }
+            }
+            backoff.reset();
+            next->stream->write(next->text.data(), next->text.size());
+            next->stream->flush();
+            next->text.clear();
+            chunks.end_pop();
+        }
+    }
+};
+
+// Run of spaces that indentation is copied from, so indenting never builds a temporary string.
+static constexpr string_view SPACES = "                                                                ";
+
+output_writer::output_writer(size_t capacity) : _capacity(capacity)
+{
+    // Leave room for the line that crosses the capacity threshold.
+    _buffer.reserve(capacity + 1024);
+}
+
+output_writer::output_writer(output_writer&& other) noexcept = default;
+output_writer&
+output_writer::operator=(output_writer&& other) noexcept = default;
+
+output_writer::~output_writer()
+{
+    end_background_flush();
+}
+
+ostream*
+output_writer::attach(ostream* stream)
+{
+    ostream* previous = _stream;
+    _stream = stream;
+    return previous;
+}
+
+void
+output_writer::indent(size_t count)
+{
+    while (count > SPACES.length()) {
+        _buffer.append(SPACES);
+        count -= SPACES.length();
+    }
+    _buffer.append(SPACES.substr(0, count));
+}
+
+void
+output_writer::flush()
+{
+    if (_buffer.empty() || _stream == nullptr) {
+        return;
+    }
+    wait_for_background();
+    _stream->write(_buffer.data(), _buffer.size());
+    _stream->flush();
+    _bytes_flushed += _buffer.size();
+    _flush_count++;
+    _buffer.clear();
+}
+
+void
+output_writer::begin_background_flush()
+{
+    if (_background != nullptr) {
+        return;
+    }
+    _background = make_unique<background_writer>();
+    _background->writer = thread([background = _background.get()] { background->write_chunks(); });
+}
+
+void
+output_writer::end_background_flush()
+{
+    if (_background == nullptr) {
+        return;
+    }
+    _background->stopping.store(true, memory_order_release);
+    _background->writer.join();
+    _background.reset();
+}
+
+// Wait until the background thread, if any, has written every buffer handed to it,
+// so the stream can be written directly.
+void
+output_writer::wait_for_background()
+{
+    if (_background == nullptr) {
+        return;
+    }
+    spsc_backoff backoff;
+    while (_background->chunks.size() > 0) {
+        backoff.wait();
+    }
+}
+
+// Hand the full buffer to the background thread, taking an empty one in exchange.
+void
+output_writer::hand_off()
+{
+    background_writer::chunk* chunk = _background->chunks.begin_push();
+    if (chunk == nullptr) {
+        _background_stall_count++;
+        spsc_backoff backoff;
+        while ((chunk = _background->chunks.begin_push()) == nullptr) {
+            backoff.wait();
+        }
+    }
+    _bytes_flushed += _buffer.size();
+    _flush_count++;
+    chunk->stream = _stream;
+    swap(chunk->text, _buffer);
+    _background->chunks.end_push();
+    if (_buffer.capacity() < _capacity + 1024) {
+        _buffer.reserve(_capacity + 1024);
+    }
+}
+
+output_scope::output_scope(output_writer& writer, ostream& stream) : _writer(writer)
+{
+    _previous = writer.stream();
+    if (_previous != &stream) {
+        writer.flush();
+        writer.attach(&stream);
+    }
+}
+
+output_scope::~output_scope()
+{
+    if (_previous != _writer.stream()) {
+        _writer.flush();
+        _writer.attach(_previous);
+    }
+}
@@ -0,0 +1,188 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#ifndef FMT_HEADER_ONLY
+#define FMT_HEADER_ONLY
+#endif
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 6285)  // (non-zero-constant || non-zero-constant) is always a non-zero constant.
+#pragma warning(disable : 26450) // '*' operation causes overflow at compile time.
+#pragma warning(disable : 26451) // Using operator '+' on a 4 byte value and then casting the result to a 8 byte value.
+#pragma warning(disable : 26498) // Mark variable constexpr if compile-time evaluation is desired.
+#endif
+#include <fmt/format.h>
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Buffered sink for generated XML. Output is accumulated in a reusable buffer
+// and only handed to the underlying stream when the buffer fills up or when
+// flush() is called at the end of a document.
+class output_writer
+{
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    explicit output_writer(size_t capacity = DEFAULT_CAPACITY);
+    output_writer(output_writer&& other) noexcept;
+    output_writer&
+    operator=(output_writer&& other) noexcept;
+    ~output_writer();
+
+    // Set the stream that buffered output is written to, returning the previous one.
+    std::ostream*
+    attach(std::ostream* stream);
+    std::ostream*
+    stream() const
+    {
+        return _stream;
+    }
+
+    void
+    write(std::string_view text)
+    {
+        _buffer.append(text);
+        flush_if_full();
+    }
+    void
+    write_line(std::string_view text)
+    {
+        _buffer.append(text);
+        end_line();
+    }
+    void
+    end_line()
+    {
+        _buffer.push_back('\n');
+        flush_if_full();
+    }
+
+    // Write a run of spaces to indent the current line.
+    void
+    indent(size_t count);
+
+    template <typename... T>
+    void
+    format(fmt::format_string<T...> format, T&&... args)
+    {
+        fmt::format_to(std::back_inserter(_buffer), format, std::forward<T>(args)...);
+        flush_if_full();
+    }
+
+    // Direct access for code that appends to the output in place.
+    // Callers should follow up with end_line() or write() so a full buffer gets flushed.
+    std::string&
+    buffer()
+    {
+        return _buffer;
+    }
+    const std::string&
+    buffer() const
+    {
+        return _buffer;
+    }
+
+    // Whether the buffer has reached the size at which it gets flushed.
+    bool
+    full() const
+    {
+        return _buffer.size() >= _capacity;
+    }
+
+    // While held, a full buffer isn't flushed automatically, e.g., because parts
+    // of it are still to be filled in. Releasing flushes the buffer if it's full.
+    void
+    hold()
+    {
+        _held = true;
+    }
+    void
+    release()
+    {
+        _held = false;
+        flush_if_full();
+    }
+
+    // Write all buffered output to the attached stream.
+    void
+    flush();
+
+    // Hand buffers that fill up to a thread that writes them to the attached stream,
+    // so that producing output overlaps with writing it. flush() still returns only
+    // once everything has been written. end_background_flush() waits for the buffers
+    // handed off so far and stops the thread.
+    void
+    begin_background_flush();
+    void
+    end_background_flush();
+
+    // Total number of bytes of output produced, whether flushed yet or not.
+    size_t
+    bytes_written() const
+    {
+        return _bytes_flushed + _buffer.size();
+    }
+
+    // Number of times buffered output has been handed to the attached stream.
+    size_t
+    flush_count() const
+    {
+        return _flush_count;
+    }
+
+    // Number of times a full buffer had to wait for the background thread to
+    // finish writing earlier ones.
+    size_t
+    background_stall_count() const
+    {
+        return _background_stall_count;
+    }
+
+  private:
+    struct background_writer;
+
+    void
+    flush_if_full()
+    {
+        if (full() && !_held) {
+            if (_background != nullptr && _stream != nullptr) {
+                hand_off();
+            } else {
+                flush();
+            }
+        }
+    }
+    void
+    hand_off();
+    void
+    wait_for_background();
+
+    std::ostream* _stream = nullptr;
+    std::string _buffer;
+    size_t _capacity;
+    size_t _bytes_flushed = 0;
+    size_t _flush_count = 0;
+    size_t _background_stall_count = 0;
+    bool _held = false;
+    std::unique_ptr<background_writer> _background;
+};
+
+// Directs a writer's output to a stream for the lifetime of the scope. Buffered
+// output is flushed when leaving the outermost scope or switching streams.
+class output_scope
+{
+  public:
+    output_scope(output_writer& writer, std::ostream& stream);
+    ~output_scope();
+
+  private:
+    output_writer& _writer;
+    std::ostream* _previous;
+};
@@ -0,0 +1,303 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+// Reading and writing snapshots as precompiled prologue files. A file holds a
+// header identifying the format and the input files the snapshot was created
+// from, then the size and hash of every file read to create it, including
+// included files, followed by the snapshot's state. Integers are written in the byte
+// order of the machine, which the header records, since the files are caches
+// for the machine that wrote them rather than a way to exchange state.
+
+#include "binary_io.h"
+#include "mapped_file.h"
+#include "rst2rfcxml.h"
+
+#include <fstream>
+
+using namespace std;
+
+static constexpr string_view PRECOMPILED_MAGIC = "rst2rfcxml-prologue";
+static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// Get the size and a 64-bit FNV-1a hash of the contents of a file.
+// Returns false if the file can't be read.
+static bool
+_hash_file(const string& filename, uint64_t& size, uint64_t& hash)
+{
+    mapped_file mapped_input;
+    string contents;
+    string_view input;
+    if (mapped_input.open(filename)) {
+        input = mapped_input.contents();
+    } else {
+        ifstream input_file(filename, ios::binary);
+        if (!input_file.good()) {
+            return false;
+        }
+        contents.assign(istreambuf_iterator<char>(input_file), istreambuf_iterator<char>());
+        input = contents;
+    }
+    size = input.length();
+    hash = string_index<uint32_t>::hash_key(input);
+    return true;
+}
+
+// Members of an author, in the order they're written.
+static constexpr string author::*AUTHOR_MEMBERS[] = {
+    &author::anchor,
+    &author::initials,
+    &author::asciiInitials,
+    &author::surname,
+    &author::asciiSurname,
+    &author::fullname,
+    &author::asciiFullname,
+    &author::role,
+    &author::organization,
+    &author::email,
+    &author::phone,
+    &author::city,
+    &author::code,
+    &author::country,
+    &author::region,
+    &author::street,
+};
+
+static void
+_write_authors(binary_writer& writer, const map<string, author>& authors)
+{
+    writer.write(static_cast<uint64_t>(authors.size()));
+    for (auto& [key, author] : authors) {
+        writer.write(key);
+        for (string author::*member : AUTHOR_MEMBERS) {
+            writer.write(author.*member);
+        }
+        writer.write(static_cast<uint64_t>(author.postalLine.size()));
+        for (const string& line : author.postalLine) {
+            writer.write(line);
+        }
+    }
+}
+
+static void
+_read_authors(binary_reader& reader, map<string, author>& authors)
+{
+    for (uint64_t count = reader.read_count(sizeof(uint64_t)); count > 0 && !reader.failed(); count--) {
+        author& author = authors[string(reader.read_string())];
+        for (string author::*member : AUTHOR_MEMBERS) {
+            author.*member = reader.read_string();
+        }
+        for (uint64_t lines = reader.read_count(sizeof(uint64_t)); lines > 0; lines--) {
+            author.postalLine.emplace_back(reader.read_string());
+        }
+    }
+}
+
+string rst2rfcxml::*const rst2rfcxml_snapshot::_document_members[7] = {
+    &rst2rfcxml::_document_name,
+    &rst2rfcxml::_base_target_uri,
+    &rst2rfcxml::_ipr,
+    &rst2rfcxml::_category,
+    &rst2rfcxml::_submission_type,
+    &rst2rfcxml::_abbreviated_title,
+    &rst2rfcxml::_abstract,
+};
+
+int
+rst2rfcxml_snapshot::save(const filesystem::path& filename, ostream& diagnostics) const
+{
+    binary_writer writer;
+    writer.write(PRECOMPILED_MAGIC);
+    writer.write(PRECOMPILED_FORMAT_VERSION);
+    writer.write(BYTE_ORDER_MARK);
+    writer.write(static_cast<uint64_t>(_input_filenames.size()));
+    for (const string& input_filename : _input_filenames) {
+        writer.write(input_filename);
+    }
+    writer.write(static_cast<uint64_t>(files_read().size()));
+    for (const string& file_read : files_read()) {
+        uint64_t size;
+        uint64_t hash;
+        if (!_hash_file(file_read, size, hash)) {
+            diagnostics << fmt::format("ERROR: can't read {}", file_read) << endl;
+            return 1;
+        }
+        writer.write(file_read);
+        writer.write(size);
+        writer.write(hash);
+    }
+
+    const rst2rfcxml& state = _state;
+    for (string rst2rfcxml::*member : _document_members) {
+        writer.write(state.*member);
+    }
+    _write_authors(writer, state._authors);
+
+    const reference_table& references = *state._references;
+    writer.write(static_cast<uint64_t>(references.by_anchor.size()));
+    for (auto& [anchor, reference] : references.by_anchor) {
+        writer.write(anchor);
+        writer.write(reference.definitions);
+    }
+    writer.write(static_cast<uint64_t>(references.by_target.size()));
+    references.by_target.for_each([&writer](string_view target, const lazy_reference* reference) {
+        writer.write(target);
+        writer.write(reference->anchor);
+    });
+
+    writer.write(static_cast<uint64_t>(state._anchors.size()));
+    state._anchors.for_each([&writer](string_view text, const rst2rfcxml::anchor_definition& definition) {
+        writer.write(text);
+        writer.write(definition.anchor);
+    });
+    writer.write(static_cast<uint64_t>(state._reference_use_counts.size()));
+    state._reference_use_counts.for_each([&writer](string_view anchor, uint32_t use_count) {
+        writer.write(anchor);
+        writer.write(use_count);
+    });
+
+    writer.write(static_cast<uint64_t>(state._contexts.size()));
+    for (size_t i = 0; i < state._contexts.size(); i++) {
+        writer.write(static_cast<uint32_t>(state._contexts[i].value));
+        writer.write(state._contexts[i].indentation);
+    }
+    writer.write(static_cast<uint64_t>(state._column_indices.size()));
+    for (size_t column_index : state._column_indices) {
+        writer.write(static_cast<uint64_t>(column_index));
+    }
+    writer.write(state._output.buffer());
+
+    // Write a temporary file and rename it over the target, so that a converter
+    // loading the file concurrently never sees a partially written one.
+    filesystem::path temporary_filename = filename;
+    temporary_filename += ".tmp";
+    {
+        ofstream output_file(temporary_filename, ios::binary | ios::trunc);
+        output_file.write(writer.buffer().data(), writer.buffer().size());
+        if (!output_file.good()) {
+            diagnostics << fmt::format("ERROR: can't write {}", temporary_filename.string()) << endl;
+            return 1;
+        }
+    }
+    error_code error;
+    filesystem::rename(temporary_filename, filename, error);
+    if (error) {
+        diagnostics << fmt::format("ERROR: can't write {}: {}", filename.string(), error.message()) << endl;
+        filesystem::remove(temporary_filename, error);
+        return 1;
+    }
+    return 0;
+}
+
+int
+rst2rfcxml_snapshot::load(
+    const filesystem::path& filename,
+    shared_ptr<const rst2rfcxml_snapshot>& snapshot,
+    vector<string>& input_filenames,
+    ostream& diagnostics)
+{
+    input_filenames.clear();
+    mapped_file mapped_input;
+    if (!mapped_input.open(filename)) {
+        diagnostics << fmt::format("ERROR: can't read {}", filename.string()) << endl;
+        return 1;
+    }
+    binary_reader reader(mapped_input.contents());
+    if (reader.read_string() != PRECOMPILED_MAGIC) {
+        diagnostics << fmt::format("ERROR: {} is not a precompiled prologue", filename.string()) << endl;
+        return 1;
+    }
+    uint32_t version = reader.read_uint32();
+    if (version != PRECOMPILED_FORMAT_VERSION || reader.read_uint32() != BYTE_ORDER_MARK) {
+        diagnostics << fmt::format(
+                           "ERROR: {} was precompiled by another version of rst2rfcxml or on another kind of machine",
+                           filename.string())
+                    << endl;
+        return 1;
+    }
+
+    for (uint64_t count = reader.read_count(sizeof(uint64_t)); count > 0; count--) {
+        input_filenames.emplace_back(reader.read_string());
+    }
+
+    // Check whether any file read, whether an input file or one it included, has
+    // changed since, hashing each one whose size is still the same.
+    bool changed = false;
+    vector<string> files_read;
+    for (uint64_t count = reader.read_count(3 * sizeof(uint64_t)); count > 0; count--) {
+        string file_read(reader.read_string());
+        uint64_t size = reader.read_uint64();
+        uint64_t hash = reader.read_uint64();
+        error_code error;
+        uint64_t current_size = filesystem::file_size(file_read, error);
+        uint64_t current_hash;
+        if (error || current_size != size || !_hash_file(file_read, current_size, current_hash) ||
+            current_size != size || current_hash != hash) {
+            changed = true;
+        }
+        files_read.push_back(move(file_read));
+    }
+    if (reader.failed()) {
+        input_filenames.clear();
+    } else if (changed) {
+        diagnostics << fmt::format("ERROR: {} is out of date", filename.string()) << endl;
+        return 1;
+    }
+
+    bool corrupt = false;
+    auto result = make_shared<rst2rfcxml_snapshot>();
+    result->_input_filenames = input_filenames;
+    rst2rfcxml& state = result->_state;
+    state._files_read = move(files_read);
+    for (string rst2rfcxml::*member : _document_members) {
+        state.*member = reader.read_string();
+    }
+    _read_authors(reader, state._authors);
+
+    reference_table& references = *state._references;
+    for (uint64_t count = reader.read_count(2 * sizeof(uint64_t)); count > 0 && !reader.failed(); count--) {
+        string anchor(reader.read_string());
+        lazy_reference& reference = references.by_anchor[anchor];
+        reference.anchor = move(anchor);
+        reference.definitions = reader.read_string();
+    }
+    for (uint64_t count = reader.read_count(2 * sizeof(uint64_t)); count > 0 && !reader.failed(); count--) {
+        string_view target = reader.read_string();
+        auto reference = references.by_anchor.find(string(reader.read_string()));
+        if (reference == references.by_anchor.end()) {
+            corrupt = true;
+            break;
+        }
+        references.by_target[target] = &reference->second;
+    }
+
+    for (uint64_t count = reader.read_count(2 * sizeof(uint64_t)); count > 0 && !reader.failed(); count--) {
+        auto [definition, inserted] = state._anchors.try_emplace(reader.read_string());
+        definition->anchor = reader.read_string();
+    }
+    for (uint64_t count = reader.read_count(sizeof(uint64_t)); count > 0 && !reader.failed(); count--) {
+        string_view anchor = reader.read_string();
+        state._reference_use_counts[anchor] = reader.read_uint32();
+    }
+
+    state._contexts.clear();
+    for (uint64_t count = reader.read_count(2 * sizeof(uint32_t)); count > 0 && !reader.failed(); count--) {
+        uint32_t tag = reader.read_uint32();
+        uint32_t indentation = reader.read_uint32();
+        if (tag >= xml_context::TAG_COUNT) {
+            corrupt = true;
+            break;
+        }
+        state._contexts.push_back(xml_context(static_cast<xml_context::tag>(tag), indentation));
+    }
+    for (uint64_t count = reader.read_count(sizeof(uint64_t)); count > 0 && !reader.failed(); count--) {
+        state._column_indices.push_back(reader.read_uint64());
+    }
+    state._output.write(reader.read_string());
+
+    if (corrupt || reader.failed() || !reader.at_end()) {
+        diagnostics << fmt::format("ERROR: {} is corrupt", filename.string()) << endl;
+        return 1;
+    }
+    snapshot = move(result);
+    return 0;
+}
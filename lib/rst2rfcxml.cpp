@@ -2,101 +2,92 @@
 // SPDX-License-Identifier: MIT
 
 #include "CLI11.hpp"
+#include "line_classifier.h"
+#include "mapped_file.h"
 #include "rst2rfcxml.h"
+#include "work_stealing_pool.h"
 
-#define FMT_HEADER_ONLY
-#ifdef _MSC_VER
-#pragma warning(push)
-#pragma warning(disable : 6285)  // (non-zero-constant || non-zero-constant) is always a non-zero constant.
-#pragma warning(disable : 26450) // '*' operation causes overflow at compile time.
-#pragma warning(disable : 26451) // Using operator '+' on a 4 byte value and then casting the result to a 8 byte value.
-#pragma warning(disable : 26498) // Mark variable constexpr if compile-time evaluation is desired.
-#endif
-#include <fmt/format.h>
-#ifdef _MSC_VER
-#pragma warning(pop)
-#endif
+#include <algorithm>
+#include <array>
+#include <deque>
 #include <fstream>
-#include <regex>
-#include <sstream>
 #include <string>
+#include <string_view>
 
 using namespace std;
 
-const string xml_context::ABSTRACT = "abstract";
-const string xml_context::ARTWORK = "artwork";
-const string xml_context::ASIDE = "aside";
-const string xml_context::BACK = "back";
-const string xml_context::BLOCKQUOTE = "blockquote";
-const string xml_context::CONSUME_BLANK_LINE = ""; // Pseudo XML context that maps to nothing.
-const string xml_context::COMMENT = "comment";
-const string xml_context::DEFINITION_LIST = "dl";
-const string xml_context::DEFINITION_TERM = "dt";
-const string xml_context::DEFINITION_DESCRIPTION = "dd";
-const string xml_context::FRONT = "front";
-const string xml_context::LIST_ELEMENT = "li";
-const string xml_context::MIDDLE = "middle";
-const string xml_context::NAME = "name";
-const string xml_context::ORDERED_LIST = "ol";
-const string xml_context::RFC = "rfc";
-const string xml_context::SECTION = "section";
-const string xml_context::SOURCE_CODE = "sourcecode";
-const string xml_context::TABLE = "table";
-const string xml_context::TABLE_BODY = "tbody";
-const string xml_context::TABLE_BODY_ROW = "tr";
-const string xml_context::TABLE_CELL = "td";
-const string xml_context::TABLE_HEADER = "thead";
-const string xml_context::TABLE_HEADER_ROW = "tr";
-const string xml_context::TEXT = "t";
-const string xml_context::TITLE = "title";
-const string xml_context::UNORDERED_LIST = "ul";
-
-// Remove whitespace from beginning and end of string.
-static string
-_trim(string s)
+// Check whether a character is whitespace, i.e., one of " \t\n\v\f\r".
+static bool
+_is_space(char c)
 {
-    regex e("^\\s+|\\s+$");
-    return regex_replace(s, e, "");
+    return c == ' ' || (c >= '\t' && c <= '\r');
 }
 
-static string
-_spaces(size_t count)
+// Remove whitespace from beginning and end of a string view.
+static string_view
+_trim_view(string_view s)
 {
-    string spaces = "                                ";
-    return spaces.substr(0, count);
+    size_t start = 0;
+    while (start < s.length() && _is_space(s[start])) {
+        start++;
+    }
+    size_t end = s.length();
+    while (end > start && _is_space(s[end - 1])) {
+        end--;
+    }
+    return s.substr(start, end - start);
 }
 
-static string
-_anchor(string value)
+// Character classes for anchors, indexed by byte. Each entry is the
+// lowercased character if it is legal in an anchor, or 0 if not, with the
+// high bit set if the character is also legal as the first character.
+static constexpr uint8_t ANCHOR_FIRST_CHARACTER = 0x80;
+static constexpr array<uint8_t, 256> anchor_characters = [] {
+    array<uint8_t, 256> table{};
+    for (int c = 'a'; c <= 'z'; c++) {
+        table[c] = static_cast<uint8_t>(c | ANCHOR_FIRST_CHARACTER);
+        table[c - 'a' + 'A'] = static_cast<uint8_t>(c | ANCHOR_FIRST_CHARACTER);
+    }
+    table['_'] = '_' | ANCHOR_FIRST_CHARACTER;
+    table[':'] = ':' | ANCHOR_FIRST_CHARACTER;
+    for (int c = '0'; c <= '9'; c++) {
+        table[c] = static_cast<uint8_t>(c);
+    }
+    table['-'] = '-';
+    table['.'] = '.';
+    return table;
+}();
+
+// Append the anchor for a given piece of text, replacing any characters that
+// aren't legal in an anchor with '-'.
+static void
+_append_anchor(string& output, string_view value)
 {
-    const string legal_first_character = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_:";
-    const string legal_anchor_characters = legal_first_character + "1234567890-.";
-    string anchor = "";
     for (size_t i = 0; i < value.length(); i++) {
-        char c = value[i];
-        if (legal_anchor_characters.find(c) == string::npos) {
+        uint8_t c = anchor_characters[static_cast<unsigned char>(value[i])];
+        if (c == 0 || (i == 0 && !(c & ANCHOR_FIRST_CHARACTER))) {
             // Replace disallowed characters.
-            anchor += "-";
-            continue;
-        }
-        if (anchor.empty() && legal_first_character.find(c) == string::npos) {
-            // Drop disallowed start characters.
-            anchor += "-";
-            continue;
-        }
-        if (isupper(c)) {
-            c = tolower(c);
+            output += '-';
+        } else {
+            output += static_cast<char>(c & ~ANCHOR_FIRST_CHARACTER);
         }
-        anchor += c;
     }
+}
+
+static string
+_anchor(string_view value)
+{
+    string anchor;
+    anchor.reserve(value.length());
+    _append_anchor(anchor, value);
     return anchor;
 }
 
 // Output XML header.
 void
-rst2rfcxml::output_header(ostream& output_stream)
+rst2rfcxml::output_header()
 {
-    output_stream << R"(<?xml version="1.0" encoding="UTF-8"?>
+    _output.write(R"(<?xml version="1.0" encoding="UTF-8"?>
   <?xml-stylesheet type="text/xsl" href="rfc2629.xslt"?>
   <!-- generated by https://github.com/dthaler/rst2rfcxml version 0.1 -->
 
@@ -114,10 +105,9 @@ rst2rfcxml::output_header(ostream& output_stream)
 <?rfc text-list-symbols="-o*+"?>
 <?rfc docmapping="yes"?>
 
-)";
+)");
 
     push_context(
-        output_stream,
         xml_context::RFC,
         0,
         fmt::format(
@@ -126,245 +116,205 @@ rst2rfcxml::output_header(ostream& output_stream)
             _document_name,
             _category,
             _submission_type));
-    push_context(output_stream, xml_context::FRONT);
+    push_context(xml_context::FRONT);
 }
 
 static void
-_output_optional_attribute(ostream& output_stream, string name, string value)
+_output_optional_attribute(output_writer& output, string_view name, const string& value)
 {
     if (!value.empty()) {
-        output_stream << fmt::format(" {}=\"{}\"", name, value);
+        output.format(" {}=\"{}\"", name, value);
     }
 }
 
 static void
-_output_optional_text_element(ostream& output_stream, string name, string value)
+_output_optional_text_element(output_writer& output, string_view name, const string& value)
 {
     if (!value.empty()) {
-        output_stream << fmt::format("    <{}>{}</{}>", name, value, name) << endl;
+        output.format("    <{}>{}</{}>\n", name, value, name);
     }
 }
 
 // Generare the authors section in XML.
 void
-rst2rfcxml::output_authors(ostream& output_stream) const
+rst2rfcxml::output_authors()
 {
     for (auto& [anchor, author] : _authors) {
-        output_stream << fmt::format("  <author");
-        _output_optional_attribute(output_stream, "initials", author.initials);
-        _output_optional_attribute(output_stream, "asciiInitials", author.asciiInitials);
-        _output_optional_attribute(output_stream, "surname", author.surname);
-        _output_optional_attribute(output_stream, "asciiSurname", author.asciiSurname);
-        _output_optional_attribute(output_stream, "fullname", author.fullname);
-        _output_optional_attribute(output_stream, "role", author.role);
-        _output_optional_attribute(output_stream, "asciiFullname", author.asciiFullname);
-        output_stream << ">" << endl;
-        _output_optional_text_element(output_stream, "organization", author.organization);
-        output_stream << "   <address>" << endl;
-        output_stream << "    <postal>" << endl;
-        _output_optional_text_element(output_stream, "city", author.city);
-        _output_optional_text_element(output_stream, "code", author.code);
-        _output_optional_text_element(output_stream, "country", author.country);
-        _output_optional_text_element(output_stream, "region", author.region);
-        _output_optional_text_element(output_stream, "street", author.street);
+        _output.write("  <author");
+        _output_optional_attribute(_output, "initials", author.initials);
+        _output_optional_attribute(_output, "asciiInitials", author.asciiInitials);
+        _output_optional_attribute(_output, "surname", author.surname);
+        _output_optional_attribute(_output, "asciiSurname", author.asciiSurname);
+        _output_optional_attribute(_output, "fullname", author.fullname);
+        _output_optional_attribute(_output, "role", author.role);
+        _output_optional_attribute(_output, "asciiFullname", author.asciiFullname);
+        _output.write_line(">");
+        _output_optional_text_element(_output, "organization", author.organization);
+        _output.write_line("   <address>");
+        _output.write_line("    <postal>");
+        _output_optional_text_element(_output, "city", author.city);
+        _output_optional_text_element(_output, "code", author.code);
+        _output_optional_text_element(_output, "country", author.country);
+        _output_optional_text_element(_output, "region", author.region);
+        _output_optional_text_element(_output, "street", author.street);
         for (auto& postalLine : author.postalLine) {
-            _output_optional_text_element(output_stream, "postalLine", postalLine);
+            _output_optional_text_element(_output, "postalLine", postalLine);
         }
-        output_stream << "    </postal>" << endl;
-        _output_optional_text_element(output_stream, "phone", author.phone);
-        _output_optional_text_element(output_stream, "email", author.email);
-        output_stream << "   </address>" << endl;
-        output_stream << "  </author>" << endl;
+        _output.write_line("    </postal>");
+        _output_optional_text_element(_output, "phone", author.phone);
+        _output_optional_text_element(_output, "email", author.email);
+        _output.write_line("   </address>");
+        _output.write_line("  </author>");
     }
 }
 
 void
-rst2rfcxml::push_context(ostream& output_stream, string context, size_t indentation, string attributes)
+rst2rfcxml::push_context(xml_context::tag context, size_t indentation, string_view attributes)
 {
     if (context == xml_context::COMMENT) {
-        output_stream << _spaces(_contexts.size()) << "<!--" << endl;
-    } else if (context != xml_context::CONSUME_BLANK_LINE) {
-        output_stream << _spaces(_contexts.size()) << "<" << context;
-        if (!attributes.empty()) {
-            output_stream << " " << attributes;
+        _output.indent(_contexts.size());
+        _output.write_line("<!--");
+    } else if (xml_context::has_property(context, xml_context::EMITS_ELEMENT)) {
+        _output.indent(_contexts.size());
+        if (attributes.empty()) {
+            _output.format("<{}>\n", xml_context::name(context));
+        } else {
+            _output.format("<{} {}>\n", xml_context::name(context), attributes);
         }
-        output_stream << ">" << endl;
     }
-    _contexts.push(xml_context(context, indentation));
+    _contexts.push_back(xml_context(context, indentation));
 }
 
-static size_t
-find_extra_indentation(string content)
+void
+rst2rfcxml::push_context(ostream& output_stream, xml_context::tag context, size_t indentation, string_view attributes)
 {
-    size_t extra_indentation = SIZE_MAX;
-    stringstream ss(content);
-    string line;
-    while (getline(ss, line)) {
-        size_t indentation = line.find_first_not_of(" ");
-        if (extra_indentation > indentation) {
-            extra_indentation = indentation;
+    output_scope scope(_output, output_stream);
+    push_context(context, indentation, attributes);
+}
+
+// Append text to the output, escaping things XML requires to be escaped.
+static void
+_append_xml_escaped(string& output, string_view text)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < text.length(); i++) {
+        string_view escape;
+        switch (text[i]) {
+        case '&':
+            escape = "&amp;";
+            break;
+        case '<':
+            escape = "&lt;";
+            break;
+        case '>':
+            escape = "&gt;";
+            break;
+        default:
+            continue;
         }
+        output.append(text.substr(start, i - start));
+        output.append(escape);
+        start = i + 1;
     }
-    return extra_indentation;
+    output.append(text.substr(start));
 }
 
-// Forward declaration.
-static string _handle_xml_escapes(string line);
-
 void
-rst2rfcxml::pop_context(ostream& output_stream)
-{
-    string top = _contexts.top().value;
-    if ((top == xml_context::ARTWORK || top == xml_context::SOURCE_CODE) && !_block_rst.empty()) {
-        // Process all content previously stored in the block.
-        string rst_content = _block_rst;
-        size_t consume_indentation = find_extra_indentation(rst_content);
-        stringstream ss(rst_content);
-        string line;
-        while (getline(ss, line)) {
-            string value = (line.length() > consume_indentation) ? line.substr(consume_indentation) : "";
-            output_stream << _handle_xml_escapes(value) << endl;
-        }
-        _block_rst.clear();
-    }
-    if (top == xml_context::TABLE_BODY && !_table_cell_rst.empty()) {
-        // Output last row in the table before closing the table.
-        output_table_row(output_stream);
+rst2rfcxml::pop_context()
+{
+    xml_context::tag top = _contexts.back().value;
+    if (xml_context::has_property(top, xml_context::PRESERVES_WHITESPACE) && !_block_lines.empty()) {
+        // Output all content previously stored in the block, without the
+        // indentation common to all of its lines.
+        for (string_view line : _block_lines) {
+            if (line.length() > _block_indentation) {
+                _append_xml_escaped(_output.buffer(), line.substr(_block_indentation));
+            }
+            _output.end_line();
+        }
+        _block_lines.clear();
+        _block_line_storage.clear();
+        _block_indentation = SIZE_MAX;
     }
-    if (top != xml_context::CONSUME_BLANK_LINE) {
-        output_stream << _spaces(_contexts.size() - 1);
+    if (top == xml_context::TABLE_BODY && !_table_cells.empty()) {
+        // Output last row in the table before closing the table.
+        output_table_row();
     }
-    if (top.empty()) {
-        // CONSUME_BLANK_LINE, nothing to do.
-    } else if (top == xml_context::COMMENT) {
-        output_stream << "-->" << endl;
-    } else {
-        output_stream << "</" << top << ">" << endl;
+    if (top == xml_context::COMMENT) {
+        _output.indent(_contexts.size() - 1);
+        _output.write_line("-->");
+    } else if (xml_context::has_property(top, xml_context::EMITS_ELEMENT)) {
+        _output.indent(_contexts.size() - 1);
+        _output.format("</{}>\n", xml_context::name(top));
     }
-    _contexts.pop();
+    _contexts.pop_back();
 }
 
 // Pop all XML contexts until we are down to a specified XML level.
 void
-rst2rfcxml::pop_contexts(size_t level, ostream& output_stream)
+rst2rfcxml::pop_contexts(size_t level)
 {
     while (_contexts.size() > level) {
-        pop_context(output_stream);
+        pop_context();
     }
 }
 
 void
-rst2rfcxml::pop_contexts_until(string end, ostream& output_stream)
+rst2rfcxml::pop_contexts(size_t level, ostream& output_stream)
 {
-    while (_contexts.size() > 0 && _contexts.top().value != end) {
-        pop_context(output_stream);
-    }
-}
-
-// Replace paired occurrences of one markup with another, e.g., **foo** with
-// <strong>foo</strong>, while carefully skipped escaped sequences like \*\*.
-string
-_replace_all_paired(string line, string from, string to)
-{
-    size_t index;
-    while (((index = line.find(from)) != string::npos) && (index == 0 || line[index - 1] != '\\')) {
-        // Find the closing sequence, avoiding escaped sequences.
-        size_t next_index = index + from.length();
-        for (;;) {
-            next_index = line.find(from, next_index);
-            if ((next_index == string::npos) || (line[next_index - 1] != '\\')) {
-                break;
-            }
-            next_index++;
-        }
-        if (next_index == string::npos) {
-            break;
-        }
-
-        // Now do the transform.
-        string before = line.substr(0, index);
-        string middle = line.substr(index + from.length(), next_index - index - from.length());
-        string after = line.substr(next_index + from.length());
-        line = fmt::format("{}<{}>{}</{}>{}", before, to, _trim(middle), to, after);
-    }
-    return line;
+    output_scope scope(_output, output_stream);
+    pop_contexts(level);
 }
 
-// Given a string, replace all occurrences of a given substring.
-static string
-_replace_all(string line, string from, string to)
+void
+rst2rfcxml::pop_contexts_until(xml_context::tag end)
 {
-    size_t index;
-    size_t start = 0;
-    while ((index = line.find(from, start)) != string::npos) {
-        line.replace(index, from.length(), to);
-        start = index + to.length();
+    while (_contexts.size() > 0 && _contexts.back().value != end) {
+        pop_context();
     }
-    return line;
 }
 
 string
-rst2rfcxml::define_anchor(string value)
+rst2rfcxml::define_anchor(string_view value)
 {
-    string anchor;
-    if (_anchors.find(value) == _anchors.end()) {
+    render_deferred_lines();
+    if (!_rendering) {
+        _scan->definitions.push_back({false, string(value)});
+    }
+    auto [definition, inserted] = _anchors.try_emplace(value);
+    if (inserted) {
         // Create a new anchor.
-        anchor = _anchor(value);
+        definition->anchor = _anchor(value);
     } else {
         // This is a duplicate anchor definition so create a new one and
-        // map all future lookups to this latest one.
-        anchor = _anchors[value] + "-";
+        // map all future lookups to this latest one. The Nth duplicate of
+        // the same text gets N '-' characters appended to the base anchor.
+        definition->anchor.push_back('-');
     }
-    _anchors[value] = anchor;
-    return anchor;
- }
-
-string
-rst2rfcxml::lookup_anchor(string value)
-{
-    if (_anchors.find(value) != _anchors.end()) {
-        return _anchors[value];
-    }
-
-    // Undefined anchor.
-    return _anchor(value);
+    return definition->anchor;
 }
 
-string
-rst2rfcxml::replace_term_links(string line)
+// Append the anchor previously defined for some text, or the anchor the text
+// would have if it hasn't been defined (yet).
+void
+rst2rfcxml::append_anchor(string& output, string_view value)
 {
-    size_t start;
-    while ((start = line.find(":term:`")) != string::npos) {
-        size_t end = line.find("`", start + 7);
-        if (end == string::npos) {
-            break;
-        }
-        string before = line.substr(0, start);
-        string middle = line.substr(start + 7, end - start - 7);
-        string after = line.substr(end + 1);
-        string term = middle;
-        string label = term;
-
-        size_t term_end = middle.find("&gt;");
-        if (term_end != string::npos) {
-            size_t label_end = middle.find("&lt;");
-            label = _trim(middle.substr(0, label_end));
-            term = middle.substr(label_end + 4, term_end - label_end - 4);
-        }
-
-        line = fmt::format("{}<xref target=\"{}\">{}</xref>{}", before, lookup_anchor("term-" + term), label, after);
+    if (const anchor_definition* definition = _anchors.find(value)) {
+        output += definition->anchor;
+    } else {
+        // Undefined anchor.
+        _append_anchor(output, value);
     }
-    return line;
 }
 
 static bool
-is_rfc_section(string title)
+is_rfc_section(string_view title)
 {
     if (title.starts_with("RFC")) {
         return true;
     }
     if ((title.starts_with("Section ") || title.starts_with("section ")) &&
-        title.find(" of RFC") != std::string::npos) {
+        title.find(" of RFC") != string_view::npos) {
         return true;
     }
     return false;
@@ -388,386 +338,827 @@ get_title_section(string& title, string& fragment)
     return {};
 }
 
-string
-rst2rfcxml::replace_reference_links(string line)
+// Find the next occurrence of some markup at or after a given offset,
+// skipping occurrences that are escaped with a backslash.
+static size_t
+_find_unescaped(string_view line, string_view markup, size_t offset)
 {
-    size_t start;
-    while ((start = line.find("`")) != string::npos) {
-        size_t end = line.find("`_", start + 1);
-        if (end == string::npos) {
-            break;
+    for (size_t index = line.find(markup, offset); index != string_view::npos; index = line.find(markup, index + 1)) {
+        if (index == 0 || line[index - 1] != '\\') {
+            return index;
         }
-        string before = line.substr(0, start);
-        string middle = line.substr(start + 1, end - start - 1);
-        string after = line.substr(end + 2);
-
-        // Handle external reference.
-        size_t link_end = middle.find("&gt;");
-        if (link_end != string::npos) {
-            size_t title_end = middle.find("&lt;");
-            string title = _trim(middle.substr(0, title_end));
-            size_t fragment_start = middle.find("#", title_end);
-
-            string filename;
-            string fragment;
-            if (fragment_start != string::npos) {
-                filename = middle.substr(title_end + 4, fragment_start - title_end - 4);
-                fragment = middle.substr(fragment_start, link_end - fragment_start);
-                reference* reference = get_reference_by_target(filename);
-                if (reference == nullptr) {
-                    // Reference not found.
-                    fragment = {};
-                    filename = middle.substr(title_end + 4, link_end - title_end - 4);
-                    reference = get_reference_by_target(filename);
-                    if (reference == nullptr) {
-                        return line;
-                    }
+    }
+    return string_view::npos;
+}
+
+// Find the end of emphasis or strong emphasis whose start ends just before an
+// offset. As in RST, the end can't be escaped or follow whitespace, and for
+// emphasis, it can't be part of a run of asterisks, such as strong emphasis.
+static size_t
+_find_emphasis_end(string_view line, string_view markup, size_t offset)
+{
+    for (size_t index = _find_unescaped(line, markup, offset); index != string_view::npos;
+         index = _find_unescaped(line, markup, index + 1)) {
+        if (isspace(static_cast<unsigned char>(line[index - 1]))) {
+            continue;
+        }
+        size_t after = index + markup.length();
+        if (markup.length() == 1 && (line[index - 1] == '*' || (after < line.length() && line[after] == '*'))) {
+            continue;
+        }
+        return index;
+    }
+    return string_view::npos;
+}
+
+// Check whether emphasis or strong emphasis can start before an offset, which
+// as in RST it can't if followed by whitespace or the end of the line.
+static bool
+_can_start_emphasis(string_view line, size_t offset)
+{
+    return offset < line.length() && !isspace(static_cast<unsigned char>(line[offset]));
+}
+
+// Append an XML element, such as <em>content</em>, whose content is trimmed
+// and then has inline markup handled.
+void
+rst2rfcxml::append_inline_element(
+    inline_scratch& scratch, string& output, string_view tag, string_view content, inline_markup markup)
+{
+    fmt::format_to(back_inserter(output), "<{}>", tag);
+    append_inline_markup(scratch, output, _trim_view(content), markup);
+    fmt::format_to(back_inserter(output), "</{}>", tag);
+}
+
+// Append a :term:`label <term>` or :term:`term` link to the output.
+void
+rst2rfcxml::append_term_link(inline_scratch& scratch, string& output, string_view content)
+{
+    string_view label = content;
+    string_view term = content;
+    size_t term_start = content.find('<');
+    size_t term_end = (term_start == string_view::npos) ? string_view::npos : content.find('>', term_start);
+    if (term_end != string_view::npos) {
+        label = _trim_view(content.substr(0, term_start));
+        term = content.substr(term_start + 1, term_end - term_start - 1);
+    }
+    scratch.anchor_key.assign("term-");
+    scratch.anchor_key.append(term);
+    output += "<xref target=\"";
+    append_anchor(output, scratch.anchor_key);
+    output += "\">";
+    append_inline_markup(scratch, output, label, inline_markup::emphasis);
+    output += "</xref>";
+}
+
+// Append a `Section title`_ or `Title <uri#fragment>`_ reference link to the output.
+void
+rst2rfcxml::append_reference_link(inline_scratch& scratch, string& output, string_view content)
+{
+    size_t uri_start = content.find('<');
+    size_t uri_end = (uri_start == string_view::npos) ? string_view::npos : content.find('>', uri_start);
+    if (uri_end == string_view::npos) {
+        // Handle internal reference, whose anchor is based on the label as rendered.
+        scratch.link_label.clear();
+        append_inline_markup(scratch, scratch.link_label, content, inline_markup::emphasis);
+        output += "<xref target=\"";
+        append_anchor(output, scratch.link_label);
+        output += "\">";
+        output += scratch.link_label;
+        output += "</xref>";
+        return;
+    }
+
+    // Handle external reference, where the fragment might instead be part of the target itself.
+    string_view uri = content.substr(uri_start + 1, uri_end - uri_start - 1);
+    size_t fragment_start = uri.find('#');
+    string fragment;
+    const lazy_reference* reference = nullptr;
+    if (fragment_start != string_view::npos) {
+        reference = get_reference_by_target(uri.substr(0, fragment_start));
+        if (reference != nullptr) {
+            fragment = uri.substr(fragment_start);
+        }
+    }
+    if (reference == nullptr) {
+        reference = get_reference_by_target(uri);
+    }
+    if (reference == nullptr) {
+        // Reference not found, so leave it as interpreted text.
+        append_inline_element(scratch, output, "em", content, inline_markup::emphasis);
+        output += '_';
+        return;
+    }
+    if (_rendering) {
+        string_index<uint32_t>& use_counts =
+            scratch.reference_use_counts ? *scratch.reference_use_counts : _reference_use_counts;
+        use_counts[reference->anchor]++;
+    }
+
+    string_view title_rst = _trim_view(content.substr(0, uri_start));
+    if (fragment_start == string_view::npos) {
+        output += "<xref target=\"";
+        output += reference->anchor;
+        output += "\">";
+        append_inline_markup(scratch, output, title_rst, inline_markup::emphasis);
+        output += "</xref>";
+        return;
+    }
+
+    string title;
+    append_inline_markup(scratch, title, title_rst, inline_markup::emphasis);
+
+    // The latest spec is https://www.ietf.org/archive/id/draft-iab-rfc7991bis-04.html#element.xref
+    string section = get_title_section(title, fragment);
+    fmt::format_to(back_inserter(output), "<xref target=\"{}\"", reference->anchor);
+    if (!section.empty()) {
+        fmt::format_to(back_inserter(output), " section=\"{}\"", section);
+        if (!fragment.empty()) {
+            fmt::format_to(back_inserter(output), " relative=\"{}\"", fragment);
+        }
+    }
+    if (title.empty()) {
+        output += "/>";
+    } else {
+        fmt::format_to(back_inserter(output), ">{}</xref>", title);
+    }
+}
+
+// Append RST text to the output as XML, escaping characters XML requires to be
+// escaped and converting inline markup in a single left-to-right scan.
+void
+rst2rfcxml::append_inline_markup(inline_scratch& scratch, string& output, string_view line, inline_markup markup)
+{
+    // Whether markup can end at a given place doesn't depend on where it started,
+    // so once a search for its end fails, any later search would too. Remember
+    // where each kind of search failed so that a line of markup that never ends
+    // is still converted in linear time.
+    enum
+    {
+        LITERAL_END,
+        STRONG_END,
+        EMPHASIS_END,
+        TERM_END,
+        INTERPRETED_END,
+        END_KINDS,
+    };
+    size_t unended[END_KINDS];
+    fill(begin(unended), end(unended), string_view::npos);
+    auto find_end = [&unended](size_t kind, size_t offset, auto find) {
+        if (offset >= unended[kind]) {
+            return string_view::npos;
+        }
+        size_t end = find(offset);
+        if (end == string_view::npos) {
+            unended[kind] = offset;
+        }
+        return end;
+    };
+
+    size_t i = 0;
+    while (i < line.length()) {
+        char c = line[i];
+        char next = (i + 1 < line.length()) ? line[i + 1] : '\0';
+
+        // Escape things XML requires to be escaped.
+        if (c == '&') {
+            output += "&amp;";
+            i++;
+            continue;
+        }
+        if (c == '<') {
+            output += "&lt;";
+            i++;
+            continue;
+        }
+        if (c == '>') {
+            output += "&gt;";
+            i++;
+            continue;
+        }
+
+        // Unescape additional things RST requires to be escaped.
+        if (c == '\\') {
+            if (next == '*' || next == '|') {
+                output += next;
+                i += 2;
+            } else if (next == '`') {
+                output += "\\`";
+                i += 2;
+            } else {
+                output += c;
+                i++;
+            }
+            continue;
+        }
+
+        // Replace paired items.
+        if (markup != inline_markup::literal) {
+            if (c == '`' && next == '`') {
+                size_t end = find_end(LITERAL_END, i + 2, [line](size_t offset) {
+                    return _find_unescaped(line, "``", offset);
+                });
+                if (end != string_view::npos) {
+                    append_inline_element(scratch, output, "tt", line.substr(i + 2, end - i - 2), inline_markup::literal);
+                    i = end + 2;
+                    continue;
                 }
-                reference->use_count++;
-                string section = get_title_section(title, fragment);
-
-                // The latest spec is https://www.ietf.org/archive/id/draft-iab-rfc7991bis-04.html#element.xref
-                string result = fmt::format("{}<xref target=\"{}\"", before, reference->anchor);
-                if (!section.empty()) {
-                    result += fmt::format(" section=\"{}\"", section);
-                    if (!fragment.empty()) {
-                        result += fmt::format(" relative=\"{}\"", fragment);
-                    }
+            }
+            if (c == '*' && next == '*' && _can_start_emphasis(line, i + 2)) {
+                size_t end = find_end(STRONG_END, i + 2, [line](size_t offset) {
+                    return _find_emphasis_end(line, "**", offset);
+                });
+                if (end != string_view::npos) {
+                    append_inline_element(scratch, output, "strong", line.substr(i + 2, end - i - 2), markup);
+                    i = end + 2;
+                    continue;
                 }
-                if (title.empty()) {
-                    result += fmt::format("/>");
-                } else {
-                    result += fmt::format(">{}</xref>", title);
+            }
+            if (c == '*' && next != '*' && _can_start_emphasis(line, i + 1)) {
+                size_t end = find_end(EMPHASIS_END, i + 1, [line](size_t offset) {
+                    return _find_emphasis_end(line, "*", offset);
+                });
+                if (end != string_view::npos) {
+                    append_inline_element(scratch, output, "em", line.substr(i + 1, end - i - 1), markup);
+                    i = end + 1;
+                    continue;
                 }
-                return result + after;
-            } else {
-                filename = middle.substr(title_end + 4, link_end - title_end - 4);
-                reference* reference = get_reference_by_target(filename);
-                if (reference == nullptr) {
-                    // Reference not found.
-                    return line;
+            }
+        }
+
+        // Replace links and interpreted text.
+        if (markup == inline_markup::all) {
+            if (c == ':' && line.substr(i).starts_with(":term:`")) {
+                size_t end = find_end(TERM_END, i + 7, [line](size_t offset) { return line.find('`', offset); });
+                if (end != string_view::npos) {
+                    append_term_link(scratch, output, line.substr(i + 7, end - i - 7));
+                    i = end + 1;
+                    continue;
+                }
+            }
+            if (c == '`') {
+                size_t end = find_end(INTERPRETED_END, i + 1, [line](size_t offset) {
+                    return _find_unescaped(line, "`", offset);
+                });
+                if (end != string_view::npos) {
+                    string_view content = line.substr(i + 1, end - i - 1);
+                    if (end + 1 < line.length() && line[end + 1] == '_') {
+                        append_reference_link(scratch, output, content);
+                        i = end + 2;
+                    } else {
+                        append_inline_element(scratch, output, "em", content, markup);
+                        i = end + 1;
+                    }
+                    continue;
                 }
-                reference->use_count++;
-                return fmt::format("{}<xref target=\"{}\">{}</xref>{}", before, reference->anchor, title, after);
             }
         }
 
-        line = fmt::format("{}<xref target=\"{}\">{}</xref>{}", before, lookup_anchor(middle), middle, after);
+        output += c;
+        i++;
     }
-    return line;
 }
 
-static string
-_handle_xml_escapes(string line)
+// Append a line of RST text to the output as XML.
+void
+rst2rfcxml::append_inline_line(inline_scratch& scratch, string& output, string_view line, inline_markup markup)
 {
-    // Escape things XML requires to be escaped.
-    line = _replace_all(line, "&", "&amp;");
-    line = _replace_all(line, "<", "&lt;");
-    line = _replace_all(line, ">", "&gt;");
+    size_t start = output.length();
+    append_inline_markup(scratch, output, _trim_view(line), markup);
+    if (string_view(output).substr(start).ends_with("::")) {
+        output.pop_back();
+    }
+}
 
-    return line;
+// Handle escapes and paired markup, but not links.
+string
+rst2rfcxml::handle_escapes(string_view line)
+{
+    string output;
+    append_inline_line(_inline_scratch, output, line, inline_markup::emphasis);
+    return output;
 }
 
-// Handle escapes.
-static string
-_handle_escapes(string line)
+string
+rst2rfcxml::handle_escapes_and_links(string_view line)
 {
-    // Trim whitespace.
-    line = _trim(line);
+    string output;
+    append_inline_line(_inline_scratch, output, line, inline_markup::all);
+    return output;
+}
 
-    // Escape things XML requires to be escaped.
-    line = _handle_xml_escapes(line);
+// Deferred lines are rendered once there are this many, or once the output buffer is full.
+constexpr size_t MAX_DEFERRED_LINES = 4096;
 
-    // Replace paired items, which must be done after escaping <>.
-    line = _replace_all_paired(line, "``", "tt");
-    line = _replace_all_paired(line, "**", "strong");
-    line = _replace_all_paired(line, "*", "em");
+// Fewer deferred lines than this are rendered on the converter's own thread,
+// since starting threads for them would cost more than it saves.
+constexpr size_t MIN_PARALLEL_DEFERRED_LINES = 64;
 
-    // Unescape additional things RST requires to be escaped.
-    line = _replace_all(line, "\\*", "*");
-    line = _replace_all(line, "\\|", "|");
-    if (line.ends_with("::")) {
-        line = line.substr(0, line.length() - 1);
+// Output a line of RST text as XML, converted directly into the output buffer,
+// or later along with other lines if rendering inline markup on several threads.
+void
+rst2rfcxml::output_inline_line(string_view line, inline_markup markup)
+{
+    if (!_rendering) {
+        // Output is discarded while scanning, so skip the work of rendering it.
+        return;
     }
-
-    return line;
+    if (_inline_threads > 1 && _scan == nullptr) {
+        if (!_input_is_stable) {
+            line = _deferred_line_storage.emplace_back(line);
+        }
+        _deferred_lines.push_back({_output.buffer().size(), line, markup});
+        _output.hold();
+        if (_deferred_lines.size() >= MAX_DEFERRED_LINES || _output.full()) {
+            render_deferred_lines();
+        }
+        return;
+    }
+    append_inline_line(_inline_scratch, _output.buffer(), line, markup);
+    _output.end_line();
 }
 
-string
-rst2rfcxml::handle_escapes_and_links(string line)
+// Render the inline markup of deferred lines, on a pool of threads if there are
+// enough of them, and splice the results into the output where the lines belong.
+// This must be done before anything that rendering depends on, such as anchors
+// and references, changes.
+void
+rst2rfcxml::render_deferred_lines()
 {
-    line = _handle_escapes(line);
-
-    // Replace links after handling escapes so we don't escape the <> in links.
-    line = replace_reference_links(line);
-    line = replace_term_links(line);
-
-    // Handle interpreted text which must be done after reference links.
-    line = _replace_all_paired(line, "`", "em");
+    if (_deferred_lines.empty()) {
+        return;
+    }
+
+    // Render contiguous runs of lines, each with its own output and scratch space.
+    struct rendered_run
+    {
+        std::string text;
+        vector<size_t> line_ends;
+        inline_scratch scratch;
+        string_index<uint32_t> reference_use_counts;
+    };
+    size_t line_count = _deferred_lines.size();
+    size_t run_count = (line_count < MIN_PARALLEL_DEFERRED_LINES) ? 1 : min(line_count, _inline_threads * 4);
+    vector<rendered_run> runs(run_count);
+    auto render_run = [&](size_t index) {
+        rendered_run& run = runs[index];
+        run.scratch.reference_use_counts = &run.reference_use_counts;
+        size_t end = line_count * (index + 1) / run_count;
+        for (size_t i = line_count * index / run_count; i < end; i++) {
+            append_inline_line(run.scratch, run.text, _deferred_lines[i].line, _deferred_lines[i].markup);
+            run.text.push_back('\n');
+            run.line_ends.push_back(run.text.length());
+        }
+    };
+    if (run_count == 1) {
+        render_run(0);
+    } else {
+        work_stealing_pool pool(_inline_threads);
+        pool.run(run_count, render_run);
+    }
+
+    // Reassemble the output in order, and merge the counts of citations.
+    string& output = _output.buffer();
+    _reassembled_output.clear();
+    size_t copied = 0;
+    size_t line = 0;
+    for (rendered_run& run : runs) {
+        size_t start = 0;
+        for (size_t end : run.line_ends) {
+            size_t offset = _deferred_lines[line++].offset;
+            _reassembled_output.append(output, copied, offset - copied);
+            _reassembled_output.append(run.text, start, end - start);
+            copied = offset;
+            start = end;
+        }
+        run.reference_use_counts.for_each(
+            [this](string_view anchor, uint32_t use_count) { _reference_use_counts[anchor] += use_count; });
+    }
+    _reassembled_output.append(output, copied);
+    output.swap(_reassembled_output);
 
-    return line;
+    _deferred_lines.clear();
+    _deferred_line_storage.clear();
+    _output.release();
 }
 
 constexpr size_t BASE_SECTION_LEVEL = 2; // <rfc><front/middle/back>.
 
-// Returns true if the current line was handled, false if not.
-static bool
-_handle_variable_initialization(string line, string label, string& field)
+author&
+rst2rfcxml::get_author_by_anchor(std::map<string, author>& map, string anchor)
 {
-    string prefix = fmt::format(".. |{}| replace:: ", _trim(label));
-    if (line.starts_with(prefix)) {
-        field = _handle_escapes(line.substr(prefix.length()));
-        return true;
+    auto [it, inserted] = map.try_emplace(anchor);
+    if (inserted) {
+        // Created an author.
+        it->second.anchor = anchor;
     }
-    return false;
+    return it->second;
 }
 
-author&
-rst2rfcxml::get_author_by_anchor(std::map<string, author>& map, string anchor)
+reference_table::reference_table(const reference_table& other) : by_anchor(other.by_anchor)
 {
-    if (map.contains(anchor)) {
-        return map[anchor];
-    }
+    // Index the copies rather than the other table's references.
+    other.by_target.for_each([this](string_view target, const lazy_reference* reference) {
+        by_target[target] = &by_anchor.at(reference->anchor);
+    });
+}
 
-    // Create an author.
-    author author;
-    author.anchor = anchor;
-    map[anchor] = author;
-    return map[anchor];
+// Get the references for changing them, first copying them if they are shared with another converter.
+reference_table&
+rst2rfcxml::mutable_references()
+{
+    render_deferred_lines();
+    if (_references.use_count() > 1) {
+        _references = make_shared<reference_table>(*_references);
+    }
+    return *_references;
 }
 
-reference&
+lazy_reference&
 rst2rfcxml::get_reference_by_anchor(string anchor)
 {
-    if (_xml_references.contains(anchor)) {
-        return _xml_references[anchor];
+    auto [it, inserted] = mutable_references().by_anchor.try_emplace(anchor);
+    if (inserted) {
+        // Created a reference.
+        it->second.anchor = anchor;
     }
+    return it->second;
+}
 
-    // Create a reference.
-    reference reference = {};
-    reference.anchor = anchor;
-    _xml_references[anchor] = reference;
-    return _xml_references[anchor];
+const lazy_reference*
+rst2rfcxml::get_reference_by_target(string_view target)
+{
+    lazy_reference** entry = _references->by_target.find(target);
+    return (entry == nullptr) ? nullptr : *entry;
 }
 
-reference*
-rst2rfcxml::get_reference_by_target(string target)
+// One segment of a substitution name, e.g., "ref[SAMPLE]" or "title".
+struct substitution_segment
 {
-    if (_rst_references.contains(target)) {
-        return &_xml_references[_rst_references[target]];
-    }
-    return nullptr;
+    string_view name;
+    string_view key;
+};
+
+// A substitution name has at most three segments, as in "ref[SAMPLE].author[0].surname".
+constexpr size_t MAX_SUBSTITUTION_SEGMENTS = 3;
+
+static bool
+_is_key_character(char c)
+{
+    return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-';
 }
 
-// Handle variable initializations. Returns true if input has been handled.
-bool
-rst2rfcxml::handle_variable_initializations(string line)
-{
-    if (_handle_variable_initialization(line, "baseTargetUri", _base_target_uri) ||
-        _handle_variable_initialization(line, "category", _category) ||
-        _handle_variable_initialization(line, "docName", _document_name) ||
-        _handle_variable_initialization(line, "ipr", _ipr) ||
-        _handle_variable_initialization(line, "submissionType", _submission_type) ||
-        _handle_variable_initialization(line, "abstract", _abstract) ||
-        _handle_variable_initialization(line, "titleAbbr", _abbreviated_title)) {
-        return true;
+// Split a substitution name like "ref[SAMPLE].date.year" into segments.
+// Returns the number of segments found, or 0 if the name is malformed.
+static size_t
+_parse_substitution_name(string_view name, substitution_segment (&segments)[MAX_SUBSTITUTION_SEGMENTS])
+{
+    size_t count = 0;
+    size_t i = 0;
+    while (i < name.length()) {
+        if (count == MAX_SUBSTITUTION_SEGMENTS) {
+            return 0;
+        }
+        size_t name_end = name.find_first_of("[.", i);
+        if (name_end == string_view::npos) {
+            name_end = name.length();
+        }
+        substitution_segment& segment = segments[count++];
+        segment.name = name.substr(i, name_end - i);
+        segment.key = {};
+        if (segment.name.empty()) {
+            return 0;
+        }
+        i = name_end;
+        if (i < name.length() && name[i] == '[') {
+            size_t key_end = name.find(']', i);
+            if (key_end == string_view::npos || key_end == i + 1) {
+                return 0;
+            }
+            segment.key = name.substr(i + 1, key_end - i - 1);
+            for (char c : segment.key) {
+                if (!_is_key_character(c)) {
+                    return 0;
+                }
+            }
+            i = key_end + 1;
+        }
+        if (i < name.length()) {
+            if (name[i] != '.' || i + 1 == name.length()) {
+                return 0;
+            }
+            i++;
+        }
     }
+    return count;
+}
 
-    // Handle author field initializations.
-    cmatch match;
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].fullname\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.fullname = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].asciiFullname\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.asciiFullname = match.suffix().str();
-        return true;
-    }
-    string author_role_prefix = ".. |author.role| replace:: ";
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].role\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.role = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].surname\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.surname = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].asciiSurname\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.asciiSurname = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].initials\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.initials = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].asciiInitials\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.asciiInitials = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].email\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.email = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].phone\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.phone = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].city\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.city = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].code\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.code = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].organization\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.organization = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].country\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.country = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].region\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.region = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].street\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.street = match.suffix().str();
-        return true;
-    }
-    if (regex_search(line.c_str(), match, regex("^.. \\|author\\[([\\w-]+)\\].postalLine\\| replace:: "))) {
-        author& author = get_author_by_anchor(_authors, match[1]);
-        author.postalLine.emplace_back(match.suffix().str());
-        return true;
+template <typename T> struct field_descriptor
+{
+    string_view name;
+    string T::*member;
+};
+
+// Find the member named by a field, or nullptr if there is no such field.
+template <typename T, size_t N>
+static constexpr string T::*
+_find_field(const field_descriptor<T> (&fields)[N], string_view name)
+{
+    for (const field_descriptor<T>& field : fields) {
+        if (field.name == name) {
+            return field.member;
+        }
     }
+    return nullptr;
+}
 
-    // Handle reference initializations.
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].title\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        reference.title = match.suffix().str();
+static constexpr field_descriptor<author> author_fields[] = {
+    {"asciiFullname", &author::asciiFullname},
+    {"asciiInitials", &author::asciiInitials},
+    {"asciiSurname", &author::asciiSurname},
+    {"city", &author::city},
+    {"code", &author::code},
+    {"country", &author::country},
+    {"email", &author::email},
+    {"fullname", &author::fullname},
+    {"initials", &author::initials},
+    {"organization", &author::organization},
+    {"phone", &author::phone},
+    {"region", &author::region},
+    {"role", &author::role},
+    {"street", &author::street},
+    {"surname", &author::surname},
+};
+
+// Reference authors only support a subset of the document author fields.
+static constexpr field_descriptor<author> reference_author_fields[] = {
+    {"fullname", &author::fullname},
+    {"initials", &author::initials},
+    {"surname", &author::surname},
+};
+
+static constexpr field_descriptor<reference> reference_fields[] = {
+    {"target", &reference::target},
+    {"title", &reference::title},
+    {"type", &reference::type},
+};
+
+static constexpr field_descriptor<seriesinfo> seriesinfo_fields[] = {
+    {"name", &seriesinfo::name},
+    {"value", &seriesinfo::value},
+};
+
+static constexpr field_descriptor<reference_date> reference_date_fields[] = {
+    {"day", &reference_date::day},
+    {"month", &reference_date::month},
+    {"year", &reference_date::year},
+};
+
+// Set a field of a reference from a definition, given the segments of its name
+// after "ref[anchor]", or if reference is null, only check that there is such a field.
+// Returns false if there isn't.
+static bool
+_apply_reference_field(
+    reference* reference, const substitution_segment* segments, size_t segment_count, string_view value)
+{
+    if (segment_count == 1) {
+        auto member = _find_field(reference_fields, segments[0].name);
+        if (member == nullptr || !segments[0].key.empty()) {
+            return false;
+        }
+        if (reference != nullptr) {
+            reference->*member = value;
+        }
         return true;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].target\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        reference.target = match.suffix().str();
-        _rst_references[reference.target] = match[1];
-        return true;
+    if (!segments[1].key.empty()) {
+        return false;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].type\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        reference.type = match.suffix().str();
+    if (segments[0].name == "seriesInfo" && segments[0].key.empty()) {
+        auto member = _find_field(seriesinfo_fields, segments[1].name);
+        if (member == nullptr) {
+            return false;
+        }
+        if (reference != nullptr) {
+            if (reference->seriesinfos.empty() || !(reference->seriesinfos.back().*member).empty()) {
+                // Each name or value after the first one starts a new seriesInfo.
+                reference->seriesinfos.emplace_back();
+            }
+            reference->seriesinfos.back().*member = value;
+        }
         return true;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].seriesInfo.name\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        if (reference.seriesinfos.empty()) {
-            reference.seriesinfos.emplace_back();
+    if (segments[0].name == "date" && segments[0].key.empty()) {
+        auto member = _find_field(reference_date_fields, segments[1].name);
+        if (member == nullptr) {
+            return false;
         }
-        seriesinfo& info = reference.seriesinfos.back();
-        if (info.name.empty()) {
-            info.name = match.suffix().str();
-        } else {
-            seriesinfo& info2 = reference.seriesinfos.emplace_back();
-            info2.name = match.suffix().str();
+        if (reference != nullptr) {
+            reference->date.*member = value;
         }
         return true;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].seriesInfo.value\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        if (reference.seriesinfos.empty()) {
-            reference.seriesinfos.emplace_back();
+    if (segments[0].name == "author" && !segments[0].key.empty()) {
+        auto member = _find_field(reference_author_fields, segments[1].name);
+        if (member == nullptr) {
+            return false;
         }
-        seriesinfo& info = reference.seriesinfos.back();
-        if (info.value.empty()) {
-            info.value = match.suffix().str();
-        } else {
-            seriesinfo& info2 = reference.seriesinfos.emplace_back();
-            info2.value = match.suffix().str();
+        if (reference != nullptr) {
+            auto [it, inserted] = reference->authors.try_emplace(string(segments[0].key));
+            if (inserted) {
+                it->second.anchor = segments[0].key;
+            }
+            it->second.*member = value;
         }
         return true;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].author\\[([\\w-]+)\\].fullname\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        author& author = get_author_by_anchor(reference.authors, match[2]);
-        author.fullname = match.suffix().str();
-        return true;
+    return false;
+}
+
+// Parse the field definitions of a reference, in order, so later ones override earlier ones.
+reference
+lazy_reference::materialize() const
+{
+    reference result;
+    result.anchor = anchor;
+    string_view remaining = definitions;
+    while (!remaining.empty()) {
+        size_t name_end = remaining.find('\n');
+        size_t value_end = remaining.find('\n', name_end + 1);
+        if (name_end == string_view::npos || value_end == string_view::npos) {
+            break;
+        }
+        substitution_segment segments[MAX_SUBSTITUTION_SEGMENTS];
+        size_t segment_count = _parse_substitution_name(remaining.substr(0, name_end), segments);
+        _apply_reference_field(
+            &result, segments, segment_count, remaining.substr(name_end + 1, value_end - name_end - 1));
+        remaining.remove_prefix(value_end + 1);
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].author\\[([\\w-]+)\\].initials\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        author& author = get_author_by_anchor(reference.authors, match[2]);
-        author.initials = match.suffix().str();
+    return result;
+}
+
+// Handle variable initializations of the form ".. |name[key].field| replace:: value".
+// Returns true if input has been handled.
+bool
+rst2rfcxml::handle_variable_initializations(string_view line)
+{
+    constexpr string_view definition_prefix = ".. |";
+    constexpr string_view definition_separator = "| replace:: ";
+    if (!line.starts_with(definition_prefix)) {
+        return false;
+    }
+    string_view definition = line;
+    size_t name_end = definition.find('|', definition_prefix.length());
+    if (name_end == string_view::npos ||
+        definition.substr(name_end, definition_separator.length()) != definition_separator) {
+        return false;
+    }
+    string_view name = definition.substr(definition_prefix.length(), name_end - definition_prefix.length());
+    string value(definition.substr(name_end + definition_separator.length()));
+
+    // Handle document settings.
+    static constexpr field_descriptor<rst2rfcxml> document_fields[] = {
+        {"abstract", &rst2rfcxml::_abstract},
+        {"baseTargetUri", &rst2rfcxml::_base_target_uri},
+        {"category", &rst2rfcxml::_category},
+        {"docName", &rst2rfcxml::_document_name},
+        {"ipr", &rst2rfcxml::_ipr},
+        {"submissionType", &rst2rfcxml::_submission_type},
+        {"titleAbbr", &rst2rfcxml::_abbreviated_title},
+    };
+    if (auto member = _find_field(document_fields, name)) {
+        this->*member = handle_escapes(value);
         return true;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].author\\[([\\w-]+)\\].surname\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        author& author = get_author_by_anchor(reference.authors, match[2]);
-        author.surname = match.suffix().str();
-        return true;
+
+    substitution_segment segments[MAX_SUBSTITUTION_SEGMENTS];
+    size_t segment_count = _parse_substitution_name(name, segments);
+    if (segment_count < 2 || segments[0].key.empty()) {
+        return false;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].date.day\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        reference.date.day = match.suffix().str();
-        return true;
+    string anchor(segments[0].key);
+
+    // Handle author field initializations.
+    if (segments[0].name == "author") {
+        if (segment_count != 2 || !segments[1].key.empty()) {
+            return false;
+        }
+        if (segments[1].name == "postalLine") {
+            get_author_by_anchor(_authors, anchor).postalLine.emplace_back(value);
+            return true;
+        }
+        if (auto member = _find_field(author_fields, segments[1].name)) {
+            get_author_by_anchor(_authors, anchor).*member = value;
+            return true;
+        }
+        return false;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].date.month\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        reference.date.month = match.suffix().str();
-        return true;
+
+    // Handle reference initializations, which are only checked for now, and parsed
+    // again if the reference is cited.
+    if (segments[0].name != "ref" || !_apply_reference_field(nullptr, segments + 1, segment_count - 1, value)) {
+        return false;
+    }
+    lazy_reference& reference = get_reference_by_anchor(anchor);
+    reference.definitions.append(name.substr(segments[1].name.data() - name.data())).append(1, '\n');
+    reference.definitions.append(value).append(1, '\n');
+    if (segment_count == 2 && segments[1].name == "target") {
+        _references->by_target[value] = &reference;
     }
-    if (regex_search(line.c_str(), match, regex("^.. \\|ref\\[([\\w-]+)\\].date.year\\| replace:: "))) {
-        reference& reference = get_reference_by_anchor(match[1]);
-        reference.date.year = match.suffix().str();
+    return true;
+}
+
+// Iterates over the lines of a table cell.
+class cell_line_iterator
+{
+  public:
+    explicit cell_line_iterator(const vector<string_view>& lines) : _lines(lines) {}
+
+    bool
+    next(string_view& line)
+    {
+        if (_index >= _lines.size()) {
+            return false;
+        }
+        line = _lines[_index++];
         return true;
     }
 
-    return false;
-}
+  private:
+    const vector<string_view>& _lines;
+    size_t _index = 0;
+};
 
 void
-rst2rfcxml::output_table_row(ostream& output_stream)
+rst2rfcxml::output_table_row()
 {
-    push_context(output_stream, xml_context::TABLE_BODY_ROW);
-
-    for (int column = 0; column < _column_indices.size(); column++) {
+    // Take ownership of the row, so that any table nested in a cell starts
+    // with clean table state and leaves ours alone.
+    vector<vector<string_view>> cells;
+    cells.swap(_table_cells);
+    deque<string> table_lines;
+    table_lines.swap(_table_lines);
+    vector<size_t> column_indices;
+    column_indices.swap(_column_indices);
+
+    // Cell content stays valid until all cells are output.
+    bool was_stable = exchange(_input_is_stable, true);
+    push_context(xml_context::TABLE_BODY_ROW);
+    for (vector<string_view>& lines : cells) {
         size_t context_level = _contexts.size();
-        string rst_content = _table_cell_rst[column];
-        size_t offset = rst_content.find_first_not_of(" ");
-        string attributes;
-        if (offset != std::string::npos && offset > 0) {
-            rst_content = rst_content.substr(offset);
+
+        // Leading spaces in a cell center its content.
+        string_view attributes;
+        size_t offset = lines[0].find_first_not_of(" ");
+        if (offset == string_view::npos && lines.size() > 1) {
+            offset = lines[0].length();
+        }
+        if (offset != string_view::npos && offset > 0) {
+            lines[0] = lines[0].substr(offset);
             attributes = "align=\"center\"";
         }
 
-        push_context(output_stream, xml_context::TABLE_CELL, 0, attributes);
+        // A cell whose last line is empty ends there, like a stream ending in a newline.
+        if (lines.back().empty()) {
+            lines.pop_back();
+        }
+
+        push_context(xml_context::TABLE_CELL, 0, attributes);
 
         // Process all content previously stored in the table cell.
-        stringstream ss(rst_content);
-        process_input_stream(ss, output_stream);
+        cell_line_iterator cell_lines(lines);
+        process_lines(cell_lines);
 
-        pop_contexts(context_level, output_stream);
+        pop_contexts(context_level);
+    }
+    pop_context();
+    _input_is_stable = was_stable;
+
+    _column_indices.swap(column_indices);
+    if (_table_cells.empty()) {
+        // Keep the storage for the next row.
+        table_lines.clear();
+        _table_lines.swap(table_lines);
+    }
+}
+
+// Copy any pending table cell or block content that refers to input lines,
+// for when the input is about to go away before the content is output.
+void
+rst2rfcxml::detach_input_lines()
+{
+    for (vector<string_view>& lines : _table_cells) {
+        for (string_view& line : lines) {
+            line = _table_lines.emplace_back(line);
+        }
+    }
+    for (string_view& line : _block_lines) {
+        line = _block_line_storage.emplace_back(line);
     }
-    pop_context(output_stream);
-    _table_cell_rst.clear();
 }
 
 bool
-rst2rfcxml::is_cell_blank(string current, int column)
+rst2rfcxml::is_cell_blank(string_view current, size_t column)
 {
     size_t start_column = _column_indices[column];
     size_t end_column = (_column_indices.size() > (column + 1)) ? _column_indices[column + 1] : current.size();
@@ -782,34 +1173,34 @@ rst2rfcxml::is_cell_blank(string current, int column)
 // Perform table handling.
 // Returns true if a valid table line was processed, false if it's not a table line.
 bool
-rst2rfcxml::handle_table_line(string current, string next, ostream& output_stream)
+rst2rfcxml::handle_table_line(string_view current, const line_info& current_info)
 {
     // Process column definitions.
-    if (current.find_first_not_of(" ") != string::npos && current.find_first_not_of(" =") == string::npos) {
+    if (current_info.table_border) {
         if (in_context(xml_context::TABLE_BODY)) {
-            pop_context(output_stream); // TABLE_BODY
-            pop_context(output_stream); // TABLE
+            pop_context(); // TABLE_BODY
+            pop_context(); // TABLE
             _column_indices.clear();
             return true;
         }
         if (in_context(xml_context::TABLE_HEADER_ROW)) {
-            pop_context(output_stream); // TABLE_HEADER_ROW
-            pop_context(output_stream); // TABLE_HEADER
-            push_context(output_stream, xml_context::TABLE_BODY);
+            pop_context(); // TABLE_HEADER_ROW
+            pop_context(); // TABLE_HEADER
+            push_context(xml_context::TABLE_BODY);
             return true;
         }
 
-        while (in_context(xml_context::TEXT) || in_context(xml_context::DEFINITION_LIST)) {
-            pop_context(output_stream);
+        while (in_any_context(xml_context::mask(xml_context::TEXT, xml_context::DEFINITION_LIST))) {
+            pop_context();
         }
 
         // We might already be in a TABLE context if we just processed a ".. table::" directive.
         // Otherwise, enter a TABLE context now.
         if (!in_context(xml_context::TABLE)) {
-            push_context(output_stream, xml_context::TABLE);
+            push_context(xml_context::TABLE);
         }
-        push_context(output_stream, xml_context::TABLE_HEADER);
-        push_context(output_stream, xml_context::TABLE_HEADER_ROW);
+        push_context(xml_context::TABLE_HEADER);
+        push_context(xml_context::TABLE_HEADER_ROW);
 
         // Find column indices.
         size_t index = current.find_first_of("=");
@@ -832,7 +1223,8 @@ rst2rfcxml::handle_table_line(string current, string next, ostream& output_strea
             size_t count = (column + 1 < _column_indices.size()) ? _column_indices[column + 1] - start : -1;
             if (current.length() > start) {
                 string value = handle_escapes_and_links(current.substr(start, count));
-                output_stream << fmt::format("{}<th>{}</th>", _spaces(_contexts.size()), value) << endl;
+                _output.indent(_contexts.size());
+                _output.format("<th>{}</th>\n", value);
             }
         }
         return true;
@@ -845,25 +1237,30 @@ rst2rfcxml::handle_table_line(string current, string next, ostream& output_strea
         size_t start_column = _column_indices[0];
         bool new_row = (current.length() > start_column) && !is_cell_blank(current, 0);
 
-        if (new_row && !_table_cell_rst.empty()) {
+        if (new_row && !_table_cells.empty()) {
             // Output previous row which is now complete.
-            output_table_row(output_stream);
+            output_table_row();
+        }
+        if (_table_cells.empty()) {
+            _table_cells.resize(_column_indices.size());
+        }
+
+        // Cells refer to the line rather than copying it, unless the line won't
+        // stay around until the row is output.
+        if (!_input_is_stable) {
+            current = _table_lines.emplace_back(current);
         }
 
         // Queue line segments to table cells.
         for (size_t column = 0; column < _column_indices.size(); column++) {
             size_t start = _column_indices[column];
             size_t count = (column + 1 < _column_indices.size()) ? _column_indices[column + 1] - start : -1;
-            string value;
+            string_view value;
             if (current.length() >= start) {
                 value = current.substr(start, count);
             }
 
-            if (new_row) {
-                _table_cell_rst.push_back(value);
-            } else {
-                _table_cell_rst[column] += "\n" + value;
-            }
+            _table_cells[column].push_back(value);
         }
         return true;
     }
@@ -874,22 +1271,25 @@ rst2rfcxml::handle_table_line(string current, string next, ostream& output_strea
 // Handle a section title.
 // Returns true if the current line was handled, false if not.
 bool
-rst2rfcxml::handle_section_title(int level, string marker, string current, string next, ostream& output_stream)
+rst2rfcxml::handle_section_title(
+    int level, char marker, string_view current, const line_info& current_info, const line_info& next_info)
 {
-    size_t current_indentation = current.find_first_not_of(" ");
-    if ((current_indentation != string::npos) && next.starts_with(marker) &&
-        next.find_first_not_of(marker, 0) == string::npos) {
+    size_t current_indentation = current_info.indentation;
+    if (!current_info.blank() && next_info.underline == marker) {
         // Current line is a section heading.
-        pop_contexts(BASE_SECTION_LEVEL + level - 1, output_stream);
+        if (_scan != nullptr && level == 1) {
+            _scan->section_started = true;
+        }
+        pop_contexts(BASE_SECTION_LEVEL + level - 1);
         if (in_context(xml_context::FRONT)) {
-            output_authors(output_stream);
+            output_authors();
             if (!_abstract.empty()) {
-                push_context(output_stream, xml_context::ABSTRACT, current_indentation);
-                push_context(output_stream, xml_context::TEXT, current_indentation);
-                output_stream << "    " << _abstract << endl;
+                push_context(xml_context::ABSTRACT, current_indentation);
+                push_context(xml_context::TEXT, current_indentation);
+                _output.format("    {}\n", _abstract);
             }
-            pop_contexts(1, output_stream);
-            push_context(output_stream, xml_context::MIDDLE);
+            pop_contexts(1);
+            push_context(xml_context::MIDDLE);
         }
         string title = handle_escapes_and_links(current);
         string anchor = define_anchor(title);
@@ -899,199 +1299,277 @@ rst2rfcxml::handle_section_title(int level, string marker, string current, strin
         } else {
             attributes = fmt::format("anchor=\"{}\" title=\"{}\"", anchor, title);
         }
-        push_context(output_stream, xml_context::SECTION, current_indentation, attributes);
+        push_context(xml_context::SECTION, current_indentation, attributes);
+        return true;
+    }
+    if (current_info.underline == marker && (marker != '=' || next_info.blank())) {
+        // Consume the line.
+        return true;
+    }
+
+    return false;
+}
+
+// Handle document and section titles.
+// Returns true if the current line was handled, false if not.
+bool
+rst2rfcxml::handle_title_line(string_view current, const line_info& current_info, const line_info& next_info)
+{
+    // Handle document title.
+    if (current_info.underline == '=') {
+        // Line is one continuous string of ======.
+
+        // If in front matter, this is the start of the title.
+        if (in_context(xml_context::FRONT)) {
+            push_context(xml_context::TITLE, 0, fmt::format("abbrev=\"{}\"", _abbreviated_title));
+            return true;
+        }
+
+        // If in title, this marks the end of the title.
+        if (in_context(xml_context::TITLE)) {
+            pop_context();
+            return true;
+        }
+    } else if (in_context(xml_context::TITLE)) {
+        output_inline_line(current);
+        return true;
+    }
+
+    // Handle section titles.
+    if (handle_section_title(1, '=', current, current_info, next_info) ||
+        handle_section_title(2, '-', current, current_info, next_info) ||
+        handle_section_title(3, '~', current, current_info, next_info)) {
         return true;
     }
-    if (current.starts_with(marker) && current.find_first_not_of(marker, 0) == string::npos &&
-        (marker != "=" || next.find_first_not_of(" ", 0) == string::npos)) {
-        // Consume the line.
-        return true;
+    return false;
+}
+
+// Handle a directive for something rfc2xml already does by default,
+// such as ".. contents::" or ".. sectnum::".
+// Returns true if the directive was handled, false if not.
+bool
+rst2rfcxml::handle_default_directive(string_view argument, size_t indentation, int&)
+{
+    return (indentation == 0) && argument.empty();
+}
+
+bool
+rst2rfcxml::handle_header_directive(string_view argument, size_t indentation, int&)
+{
+    if ((indentation != 0) || !argument.empty()) {
+        return false;
+    }
+    output_header();
+    return true;
+}
+
+bool
+rst2rfcxml::handle_code_block_directive(string_view argument, size_t indentation, int&)
+{
+    if ((indentation != 0) || (argument.find_first_not_of(" ") != string_view::npos)) {
+        return false;
+    }
+    if (in_context(xml_context::TEXT)) {
+        pop_context();
+    }
+    push_context(xml_context::SOURCE_CODE, indentation);
+    push_context(xml_context::CONSUME_BLANK_LINE);
+    return true;
+}
+
+bool
+rst2rfcxml::handle_glossary_directive(string_view argument, size_t indentation, int&)
+{
+    if ((indentation != 0) || !argument.empty()) {
+        return false;
+    }
+    push_context(xml_context::DEFINITION_LIST, indentation);
+    push_context(xml_context::CONSUME_BLANK_LINE);
+    return true;
+}
+
+bool
+rst2rfcxml::handle_admonition_directive(string_view argument, size_t indentation, int&)
+{
+    if ((indentation != 0) || !argument.starts_with(" ")) {
+        return false;
     }
 
-    return false;
+    // Pop contexts until SECTION.
+    pop_contexts_until(xml_context::SECTION);
+
+    push_context(xml_context::ASIDE, indentation + 1);
+    string name = handle_escapes_and_links(argument.substr(1));
+    _output.indent(_contexts.size());
+    _output.format("<t><strong>{}</strong></t>\n", name);
+    return true;
 }
 
-// Handle document and section titles.
-// Returns true if the current line was handled, false if not.
+// Unlike most directives, tables may be indented, e.g., within a definition list.
 bool
-rst2rfcxml::handle_title_line(string current, string next, ostream& output_stream)
+rst2rfcxml::handle_table_directive(string_view argument, size_t indentation, int&)
 {
-    // Handle document title.
-    if (current.starts_with("=") && current.find_first_not_of("=", 0) == string::npos) {
-        // Line is one continuous string of ======.
+    if (!argument.starts_with(" ")) {
+        return false;
+    }
+    push_context(xml_context::TABLE, indentation + 1);
+    string name = handle_escapes_and_links(argument.substr(1));
+    _output.indent(_contexts.size());
+    _output.format("<name>{}</name>\n", name);
+    push_context(xml_context::CONSUME_BLANK_LINE);
+    return true;
+}
 
-        // If in front matter, this is the start of the title.
-        if (in_context(xml_context::FRONT)) {
-            push_context(output_stream, xml_context::TITLE, 0, fmt::format("abbrev=\"{}\"", _abbreviated_title));
-            return true;
-        }
+bool
+rst2rfcxml::handle_include_directive(string_view argument, size_t indentation, int& error)
+{
+    if ((indentation != 0) || !argument.starts_with(" ")) {
+        return false;
+    }
+    string filename(argument.substr(1));
 
-        // If in title, this marks the end of the title.
-        if (in_context(xml_context::TITLE)) {
-            pop_context(output_stream);
-            return true;
-        }
-    } else if (in_context(xml_context::TITLE)) {
-        output_stream << handle_escapes_and_links(current) << endl;
+    // Check if filename contains path separators.
+    if (filename.find('/') != string::npos || filename.find('\\') != string::npos) {
+        *_diagnostics << fmt::format("ERROR: filename {} contains a path separator", filename) << endl;
+        error = 1;
         return true;
     }
 
-    // Handle section titles.
-    if (handle_section_title(1, "=", current, next, output_stream) ||
-        handle_section_title(2, "-", current, next, output_stream) ||
-        handle_section_title(3, "~", current, next, output_stream)) {
+    // Resolve the filename against the directory of the including file
+    // rather than the process's current directory, which other converters share.
+    filesystem::path input_filename = _base_directory / filename;
+    error_code ec;
+    if (!filesystem::exists(input_filename, ec)) {
+        *_diagnostics << fmt::format("ERROR: {} does not exist", filename) << endl;
+        error = 1;
         return true;
     }
-    return false;
+
+    // Recursively process filename.
+    _include_depth++;
+    error = process_file(input_filename);
+    _include_depth--;
+    return true;
+}
+
+bool
+rst2rfcxml::handle_comment_directive(string_view, size_t indentation, int&)
+{
+    if (indentation != 0) {
+        return false;
+    }
+    push_context(xml_context::COMMENT, indentation + 1);
+    return true;
 }
 
 // Process a new line of RST input.
 // Returns 0 on success, non-zero error code on failure.
 int
-rst2rfcxml::process_line(string current, string next, ostream& output_stream)
+rst2rfcxml::process_line(string_view current, string_view next)
+{
+    return process_line(current, next, classify_line(current), classify_line(next));
+}
+
+// Process a new line of RST input, given the lines' classifications.
+// Returns 0 on success, non-zero error code on failure.
+int
+rst2rfcxml::process_line(
+    string_view current, string_view next, const line_info& current_info, const line_info& next_info)
 {
-    size_t current_indentation = current.find_first_not_of(" ");
-    size_t next_indentation = next.find_first_not_of(" ");
+    size_t current_indentation = current_info.indentation;
+    size_t next_indentation = next_info.indentation;
 
     while (current_indentation < get_current_context_indentation()) {
-        pop_context(output_stream);
+        pop_context();
     }
     size_t context_indentation = get_current_context_indentation();
 
-    if (current == ".. contents::") {
-        // Include table of contents.
-        // This is already the default in rfc2xml.
-        return 0;
-    }
-    if (current == ".. sectnum::") {
-        // Number sections.
-        // This is already the default in rfc2xml.
-        return 0;
-    }
-    if (current == ".. header::") {
-        output_header(output_stream);
-        return 0;
-    }
-    if (current.starts_with(".. code-block::") && current.find_first_not_of(" ", 15) == std::string::npos) {
-        if (in_context(xml_context::TEXT)) {
-            pop_context(output_stream);
-        }
-        push_context(output_stream, xml_context::SOURCE_CODE, current_indentation);
-        push_context(output_stream, xml_context::CONSUME_BLANK_LINE);
-        return 0;
-    }
-    if (current == ".. glossary::") {
-        push_context(output_stream, xml_context::DEFINITION_LIST, current_indentation);
-        push_context(output_stream, xml_context::CONSUME_BLANK_LINE);
-        return 0;
-    }
-    if (current.starts_with(".. admonition:: ")) {
-        // Pop contexts until SECTION.
-        while ((_contexts.size() > 0) && (_contexts.top().value != xml_context::SECTION)) {
-            pop_context(output_stream);
-        }
-
-        push_context(output_stream, xml_context::ASIDE, current_indentation + 1);
-        string name = handle_escapes_and_links(current.substr(16));
-        output_stream << fmt::format("{}<t><strong>{}</strong></t>", _spaces(_contexts.size()), name) << endl;
-        return 0;
-    }
-    if (current.starts_with(".. table:: ")) {
-        push_context(output_stream, xml_context::TABLE, current_indentation + 1);
-        string name = handle_escapes_and_links(current.substr(11));
-        output_stream << fmt::format("{}<name>{}</name>", _spaces(_contexts.size()), name) << endl;
-        push_context(output_stream, xml_context::CONSUME_BLANK_LINE);
-        return 0;
-    }
-    if (current_indentation != string::npos) {
-        auto current_piece = current.substr(current_indentation);
-        if (current_piece.starts_with(".. table:: ")) {
-            push_context(output_stream, xml_context::TABLE, current_indentation + 1);
-            string name = handle_escapes_and_links(current_piece.substr(11));
-            output_stream << fmt::format("{}<name>{}</name>", _spaces(_contexts.size()), name) << endl;
-            push_context(output_stream, xml_context::CONSUME_BLANK_LINE);
-            return 0;
-        }
-    }
-    if (current.starts_with(".. include:: ")) {
-        string filename = current.substr(13);
-
-        // Check if filename contains path separators.
-        if (filename.find('/') != string::npos || filename.find('\\') != string::npos) {
-            std::cerr << fmt::format("ERROR: filename {} contains a path separator", filename) << endl;
-            return 1;
-        }
-
-        filesystem::path relative_path = filesystem::relative(filename);
-        if (relative_path.empty()) {
-            std::cerr << fmt::format("ERROR: {} does not exist", filename) << endl;
-            return 1;
+    // Handle directives.
+    if (current_info.directive != directive_kind::none) {
+        // Handlers for each kind of directive, indexed by directive_kind.
+        using directive_handler = bool (rst2rfcxml::*)(string_view argument, size_t indentation, int& error);
+        static constexpr auto directive_handlers = [] {
+            array<directive_handler, DIRECTIVE_KIND_COUNT> handlers{};
+            handlers[static_cast<size_t>(directive_kind::admonition)] = &rst2rfcxml::handle_admonition_directive;
+            handlers[static_cast<size_t>(directive_kind::code_block)] = &rst2rfcxml::handle_code_block_directive;
+            handlers[static_cast<size_t>(directive_kind::comment)] = &rst2rfcxml::handle_comment_directive;
+            handlers[static_cast<size_t>(directive_kind::contents)] = &rst2rfcxml::handle_default_directive;
+            handlers[static_cast<size_t>(directive_kind::glossary)] = &rst2rfcxml::handle_glossary_directive;
+            handlers[static_cast<size_t>(directive_kind::header)] = &rst2rfcxml::handle_header_directive;
+            handlers[static_cast<size_t>(directive_kind::include)] = &rst2rfcxml::handle_include_directive;
+            handlers[static_cast<size_t>(directive_kind::sectnum)] = &rst2rfcxml::handle_default_directive;
+            handlers[static_cast<size_t>(directive_kind::table)] = &rst2rfcxml::handle_table_directive;
+            return handlers;
+        }();
+        directive_handler handler = directive_handlers[static_cast<size_t>(current_info.directive)];
+        int error = 0;
+        if (handler != nullptr &&
+            (this->*handler)(current.substr(current_info.directive_argument), current_indentation, error)) {
+            return error;
         }
-        filesystem::path input_filename = filesystem::absolute(relative_path);
-
-        // Recursively process filename.
-        return process_file(input_filename, output_stream);
-    }
-    if (current.starts_with("..") && (current.substr(2).find_first_not_of(" ") == string::npos)) {
-        push_context(output_stream, xml_context::COMMENT, current_indentation + 1);
-        return 0;
     }
 
     // Close any contexts that end at an unindented line.
     if (!current.empty() && !isspace(current[0])) {
-        if (in_context(xml_context::SOURCE_CODE) || in_context(xml_context::ASIDE)) {
-            pop_context(output_stream);
+        if (context_has_property(xml_context::CLOSES_ON_UNINDENTED_LINE)) {
+            pop_context();
         }
     }
 
     // Close any contexts that end at a blank line.
-    if (current_indentation == string::npos) {
+    if (current_info.blank()) {
         if (in_context(xml_context::CONSUME_BLANK_LINE)) {
-            pop_context(output_stream);
+            pop_context();
             return 0;
         }
-        if (!next.empty() &&
-            (in_context(xml_context::ARTWORK) || in_context(xml_context::SOURCE_CODE))) {
-            pop_context(output_stream);
+        if (!next.empty() && context_has_property(xml_context::PRESERVES_WHITESPACE)) {
+            pop_context();
         }
     }
 
     // Title lines must be handled before table lines.
-    if (handle_title_line(current, next, output_stream)) {
+    if (handle_title_line(current, current_info, next_info)) {
         return 0;
     }
 
     // Handle tables first, where escapes must be dealt with per
     // cell, in order to preserve column locations.
-    if (handle_table_line(current, next, output_stream)) {
+    if (handle_table_line(current, current_info)) {
         return 0;
     }
 
-    if (handle_variable_initializations(current)) {
+    if (current_info.directive == directive_kind::variable_definition && handle_variable_initializations(current)) {
+        if (!_rendering) {
+            _scan->definitions.push_back({true, string(current)});
+        }
         return 0;
     }
 
     // Handle source code and artwork, which preserve literal indentation.
-    if (in_context(xml_context::ARTWORK) || in_context(xml_context::SOURCE_CODE)) {
-        // Push line into the block.
-        _block_rst += current + "\n";
+    if (context_has_property(xml_context::PRESERVES_WHITESPACE)) {
+        // Push line into the block, keeping track of the indentation common to all its lines.
+        if (!_input_is_stable) {
+            current = _block_line_storage.emplace_back(current);
+        }
+        _block_lines.push_back(current);
+        _block_indentation = min(_block_indentation, current_indentation);
         return 0;
     }
 
     // Handle definition lists.
-    if ((current_indentation != string::npos) && (next_indentation != string::npos) &&
-        (next_indentation > current_indentation) &&
-        (current.substr(current_indentation, 2) != "* ") &&
-        (current.substr(current_indentation, 3) != "#. ")) {
+    if (!current_info.blank() && !next_info.blank() && (next_indentation > current_indentation) &&
+        (current_info.list != list_marker::bullet) && (current_info.list != list_marker::auto_enumerated)) {
         if (!in_context(xml_context::DEFINITION_LIST)) {
-            push_context(output_stream, xml_context::DEFINITION_LIST, current_indentation);
+            push_context(xml_context::DEFINITION_LIST, current_indentation);
         }
-        string anchor = define_anchor("term-" + _trim(current));
+        _anchor_key.assign("term-");
+        _anchor_key.append(_trim_view(current));
+        string anchor = define_anchor(_anchor_key);
         if (anchor.empty()) {
-            push_context(output_stream, xml_context::DEFINITION_TERM, current_indentation);
+            push_context(xml_context::DEFINITION_TERM, current_indentation);
         } else {
             string attributes = fmt::format("anchor=\"{}\"", anchor);
-            push_context(output_stream, xml_context::DEFINITION_TERM, current_indentation, attributes);
+            push_context(xml_context::DEFINITION_TERM, current_indentation, attributes);
         }
     }
 
@@ -1112,148 +1590,703 @@ rst2rfcxml::process_line(string current, string next, ostream& output_stream)
             // each of which can contain ARTWORK.
             size_t context_level = _contexts.size();
 
-            string prefix = current.substr(0, length);
+            string_view prefix = current.substr(0, length);
             if (prefix.find_first_not_of(" ") != string::npos) {
-                int error = process_line(prefix, "::", output_stream);
+                int error = process_line(prefix, "::");
                 if (error) {
                     return error;
                 }
             }
-            pop_contexts(context_level, output_stream);
+            pop_contexts(context_level);
             if (in_context(xml_context::TEXT)) {
-                pop_context(output_stream);
+                pop_context();
             }
-            push_context(output_stream, xml_context::ARTWORK, current_indentation);
-            push_context(output_stream, xml_context::CONSUME_BLANK_LINE);
+            push_context(xml_context::ARTWORK, current_indentation);
+            push_context(xml_context::CONSUME_BLANK_LINE);
             return 0;
         }
     }
 
-    output_line(current, output_stream);
+    output_line(current, current_info);
 
     return 0;
 }
 
 // Return true if the current context is the one specified, false if not.
 bool
-rst2rfcxml::in_context(string context) const
+rst2rfcxml::in_context(xml_context::tag context) const
+{
+    return (!_contexts.empty() && _contexts.back().value == context);
+}
+
+// Return true if the current context is any of those in a mask, false if not.
+bool
+rst2rfcxml::in_any_context(uint32_t mask) const
+{
+    return (!_contexts.empty() && (xml_context::mask(_contexts.back().value) & mask) != 0);
+}
+
+// Return true if the current context has a given property, false if not.
+bool
+rst2rfcxml::context_has_property(xml_context::property property) const
 {
-    return (!_contexts.empty() && _contexts.top().value == context);
+    return (!_contexts.empty() && xml_context::has_property(_contexts.back().value, property));
 }
 
 // Get the number of spaces the current context is indented.
 size_t
 rst2rfcxml::get_current_context_indentation() const
 {
-    return _contexts.empty() ? 0 : _contexts.top().indentation;
+    return _contexts.empty() ? 0 : _contexts.back().indentation;
 }
 
 // Output the previous line.
 void
-rst2rfcxml::output_line(string indented_line, ostream& output_stream)
+rst2rfcxml::output_line(string_view indented_line, const line_info& info)
 {
     size_t context_indentation = get_current_context_indentation();
-    size_t current_indentation = indented_line.find_first_not_of(" ");
-    string line = (current_indentation == string::npos) ? indented_line : indented_line.substr(current_indentation);
+    size_t current_indentation = info.indentation;
+    string_view line = info.blank() ? indented_line : indented_line.substr(current_indentation);
 
-    cmatch match;
-    if (regex_search(line.c_str(), match, regex("^[\\d]+\\. ")) ||
-        regex_search(line.c_str(), match, regex("^#. "))) {
+    if (info.list == list_marker::enumerated || info.list == list_marker::auto_enumerated) {
         if (in_context(xml_context::LIST_ELEMENT) && (current_indentation == context_indentation)) {
-            pop_context(output_stream);
+            pop_context();
         }
         if (!in_context(xml_context::ORDERED_LIST)) {
-            push_context(output_stream, xml_context::ORDERED_LIST, current_indentation);
+            push_context(xml_context::ORDERED_LIST, current_indentation);
         }
-        push_context(output_stream, xml_context::LIST_ELEMENT, current_indentation + 1);
-        output_stream << fmt::format("{}{}", _spaces(_contexts.size()), handle_escapes_and_links(match.suffix()))
-                      << endl;
-    } else if (regex_search(line.c_str(), match, regex("^\\* "))) {
+        push_context(xml_context::LIST_ELEMENT, current_indentation + 1);
+        _output.indent(_contexts.size());
+        output_inline_line(line.substr(info.list_marker_length));
+    } else if (info.list == list_marker::bullet) {
         if (in_context(xml_context::LIST_ELEMENT) && (current_indentation == context_indentation)) {
-            pop_context(output_stream);
+            pop_context();
         }
         if (!in_context(xml_context::UNORDERED_LIST)) {
-            push_context(output_stream, xml_context::UNORDERED_LIST, current_indentation);
+            push_context(xml_context::UNORDERED_LIST, current_indentation);
         }
-        push_context(output_stream, xml_context::LIST_ELEMENT, current_indentation + 1);
-        output_stream << fmt::format("{}{}", _spaces(_contexts.size()), handle_escapes_and_links(line.substr(2)))
-                      << endl;
+        push_context(xml_context::LIST_ELEMENT, current_indentation + 1);
+        _output.indent(_contexts.size());
+        output_inline_line(line.substr(info.list_marker_length));
     } else if (in_context(xml_context::COMMENT)) {
-        output_stream << _spaces(_contexts.size()) << _handle_escapes(line) << endl;
+        _output.indent(_contexts.size());
+        output_inline_line(line, inline_markup::emphasis);
     } else if (line.starts_with("|")) {
         // Handle line blocks, preserving leading whitespace.
-        string value = (line.length() > 1) ? line.substr(2) : "";
+        string_view value = (line.length() > 1) ? line.substr(2) : string_view();
         size_t count = value.find_first_not_of(" ");
         if (count == std::string::npos) {
             count = 0;
         }
-        output_stream << _spaces(count) << handle_escapes_and_links(value) << "<br/>" << endl;
-    } else if ((current_indentation != string::npos)) {
+        _output.indent(count);
+        append_inline_line(_inline_scratch, _output.buffer(), value, inline_markup::all);
+        _output.write_line("<br/>");
+    } else if (!info.blank()) {
         if (current_indentation > context_indentation) {
             if (in_context(xml_context::DEFINITION_TERM)) {
-                pop_context(output_stream);
-                push_context(output_stream, xml_context::DEFINITION_DESCRIPTION, current_indentation);
+                pop_context();
+                push_context(xml_context::DEFINITION_DESCRIPTION, current_indentation);
             } else if (in_context(xml_context::TEXT)) {
-                pop_context(output_stream);
-                push_context(output_stream, xml_context::BLOCKQUOTE, current_indentation);
+                pop_context();
+                push_context(xml_context::BLOCKQUOTE, current_indentation);
             }
         }
-        if (!in_context(xml_context::BLOCKQUOTE) && !in_context(xml_context::CONSUME_BLANK_LINE) &&
-            !in_context(xml_context::DEFINITION_TERM) &&
-            !in_context(xml_context::LIST_ELEMENT) && !in_context(xml_context::SOURCE_CODE) &&
-            !in_context(xml_context::TEXT)) {
+        if (!context_has_property(xml_context::ACCEPTS_TEXT)) {
             if (in_context(xml_context::FRONT)) {
-                pop_contexts_until(xml_context::FRONT, output_stream);
-                handle_section_title(1, "=", "Introduction", "============", output_stream);
+                pop_contexts_until(xml_context::FRONT);
+                handle_section_title(1, '=', "Introduction", classify_line("Introduction"), classify_line("="));
             }
-            if (in_context(xml_context::DEFINITION_LIST) || in_context(xml_context::UNORDERED_LIST) ||
-                in_context(xml_context::ORDERED_LIST)) {
-                pop_context(output_stream);
+            if (context_has_property(xml_context::IS_LIST)) {
+                pop_context();
             }
             if ((current_indentation > get_current_context_indentation()) && !in_context(xml_context::ASIDE)) {
-                push_context(output_stream, xml_context::BLOCKQUOTE, current_indentation);
+                push_context(xml_context::BLOCKQUOTE, current_indentation);
             } else {
-                push_context(output_stream, xml_context::TEXT, current_indentation);
+                push_context(xml_context::TEXT, current_indentation);
             }
         }
-        output_stream << _spaces(_contexts.size()) << handle_escapes_and_links(line) << endl;
+        _output.indent(_contexts.size());
+        output_inline_line(line);
     } else {
         // End any contexts that end at a blank line.
-        if (in_context(xml_context::TEXT)) {
-            pop_context(output_stream);
+        if (context_has_property(xml_context::CLOSES_ON_BLANK_LINE)) {
+            pop_context();
+        }
+    }
+}
+
+// Get the next line from a line iterator, along with its classification,
+// which some iterators have already computed.
+template <typename T>
+static bool
+_next_classified_line(T& lines, string_view& line, line_info& info)
+{
+    if constexpr (requires { lines.next(line, info); }) {
+        return lines.next(line, info);
+    } else {
+        if (!lines.next(line)) {
+            return false;
+        }
+        info = classify_line(line);
+        return true;
+    }
+}
+
+// Process all lines from a line iterator.
+// Returns 0 on success, non-zero error code on failure.
+//
+// Lines can also be a range in the middle of an input, in which case the
+// first line is not preceded by the start of the input, and the last line is
+// followed by a given line from outside the range.
+template <typename T>
+int
+rst2rfcxml::process_lines(T& lines, bool starts_input, string_view following_line)
+{
+    // Some RST markup modifies the previous line, so we need to
+    // keep track of the previous line and process it only after
+    // we know whether the next one affects it.
+    string_view previous_line;
+    line_info previous_info;
+    bool has_previous = starts_input;
+    string_view line;
+    line_info info;
+    int error = 0;
+    // Each line is classified once, when it is first seen as the next line.
+    while (_next_classified_line(lines, line, info)) {
+        if (has_previous) {
+            error = process_line(previous_line, line, previous_info, info);
+            if (error) {
+                break;
+            }
+            if (!_deferred_lines.empty() && _output.full()) {
+                render_deferred_lines();
+            }
+        }
+        previous_line = line;
+        previous_info = info;
+        has_previous = true;
+    }
+    if (has_previous && !error) {
+        line_info following_info = following_line.empty() ? line_info{} : classify_line(following_line);
+        error = process_line(previous_line, following_line, previous_info, following_info);
+    }
+
+    // Deferred lines may refer to these lines, which may not outlive this call.
+    render_deferred_lines();
+    return error;
+}
+
+// Iterates over the lines of a stream, keeping the previous line alive
+// while the next one is read.
+class stream_line_iterator
+{
+  public:
+    explicit stream_line_iterator(istream& stream) : _stream(stream) {}
+
+    bool
+    next(string_view& line)
+    {
+        // Alternate between two buffers, since swapping strings would move
+        // short strings' characters out from under views of them.
+        _current ^= 1;
+        if (!getline(_stream, _lines[_current])) {
+            return false;
         }
+        line = _lines[_current];
+        return true;
     }
+
+  private:
+    istream& _stream;
+    string _lines[2];
+    size_t _current = 0;
+};
+
+// Process all lines of an input stream or buffer while another thread reads
+// and classifies lines ahead of this one, and a third writes output behind it.
+// Returns 0 on success, non-zero error code on failure.
+template <typename T>
+int
+rst2rfcxml::process_input_pipelined(T& input)
+{
+    line_pipeline lines(_pipeline_capacity);
+    lines.start(input);
+    size_t flush_count = _output.flush_count();
+    size_t stall_count = _output.background_stall_count();
+    _output.begin_background_flush();
+    int error = process_lines(lines);
+    _output.end_background_flush();
+    lines.stop(_pipeline_stats);
+    _pipeline_stats.output_buffers += _output.flush_count() - flush_count;
+    _pipeline_stats.output_stalls += _output.background_stall_count() - stall_count;
+    return error;
 }
 
 // Process all lines in an input stream.
 // Returns 0 on success, non-zero error code on failure.
+int
+rst2rfcxml::process_input_stream(istream& input_stream)
+{
+    // Lines from a stream only live until the line after next is read.
+    bool was_stable = exchange(_input_is_stable, false);
+    int error;
+    if (_pipeline_capacity > 0 && _include_depth == 0 && _scan == nullptr) {
+        error = process_input_pipelined(input_stream);
+    } else {
+        stream_line_iterator lines(input_stream);
+        error = process_lines(lines);
+    }
+    _input_is_stable = was_stable;
+    return error;
+}
+
 int
 rst2rfcxml::process_input_stream(istream& input_stream, ostream& output_stream)
 {
-    string line;
-    _previous_line.clear();
-    while (getline(input_stream, line)) {
-        int error = process_line(_previous_line, line, output_stream);
+    output_scope scope(_output, output_stream);
+    return process_input_stream(input_stream);
+}
+
+// Process all lines in an in-memory buffer, such as a mapped file,
+// without copying them.
+// Returns 0 on success, non-zero error code on failure.
+int
+rst2rfcxml::process_input_buffer(string_view input)
+{
+    bool by_section =
+        _section_cache != nullptr || (_section_threads > 1 && input.length() >= _section_parallel_minimum_size);
+    if (by_section && _include_depth == 0 && _scan == nullptr && _table_cells.empty() && _block_lines.empty()) {
+        return process_input_sections(input);
+    }
+
+    bool was_stable = exchange(_input_is_stable, true);
+    int error;
+    if (_pipeline_capacity > 0 && _include_depth == 0 && _scan == nullptr) {
+        error = process_input_pipelined(input);
+    } else {
+        line_iterator lines(input);
+        error = process_lines(lines);
+    }
+    _input_is_stable = was_stable;
+
+    // A table row or block still being collected may refer to lines in the buffer.
+    detach_input_lines();
+    return error;
+}
+
+int
+rst2rfcxml::process_input_buffer(string_view input, ostream& output_stream)
+{
+    output_scope scope(_output, output_stream);
+    return process_input_buffer(input);
+}
+
+// Copy the state that definitions in a document build up, such as variables,
+// authors, references and anchors, from another converter. References are
+// shared until either converter changes them.
+void
+rst2rfcxml::copy_document_state(const rst2rfcxml& other)
+{
+    _document_name = other._document_name;
+    _base_target_uri = other._base_target_uri;
+    _ipr = other._ipr;
+    _category = other._category;
+    _submission_type = other._submission_type;
+    _abbreviated_title = other._abbreviated_title;
+    _abstract = other._abstract;
+    _authors = other._authors;
+    _anchors = other._anchors;
+    _references = other._references;
+    _reference_use_counts = other._reference_use_counts;
+
+    _base_directory = other._base_directory;
+    _shared_inputs = other._shared_inputs;
+    _include_cache = other._include_cache;
+    _map_inputs = other._map_inputs;
+}
+
+int
+rst2rfcxml::create_snapshot(vector<string> input_filenames, shared_ptr<const rst2rfcxml_snapshot>& snapshot)
+{
+    auto result = make_shared<rst2rfcxml_snapshot>();
+    rst2rfcxml& state = result->_state;
+    state._base_directory = _base_directory;
+    state._shared_inputs = _shared_inputs;
+    state._include_cache = _include_cache;
+    state._map_inputs = _map_inputs;
+    state._diagnostics = _diagnostics;
+
+    // No stream is attached, so output accumulates in the buffer.
+    for (auto& input_filename : input_filenames) {
+        int error = state.process_file(input_filename);
+        if (error) {
+            return error;
+        }
+    }
+    if (!state._table_cells.empty() || !state._block_lines.empty()) {
+        *_diagnostics << fmt::format(
+                             "ERROR: can't snapshot {}, which ends in a table or literal block",
+                             input_filenames.back())
+                      << endl;
+        return 1;
+    }
+    for (auto& input_filename : input_filenames) {
+        result->_input_filenames.push_back(filesystem::absolute(input_filename).string());
+    }
+    state._shared_inputs = nullptr;
+    state._include_cache = nullptr;
+    state._diagnostics = &std::cerr;
+    snapshot = move(result);
+    return 0;
+}
+
+void
+rst2rfcxml::start_from(const rst2rfcxml_snapshot& snapshot)
+{
+    const rst2rfcxml& state = snapshot._state;
+    filesystem::path base_directory = move(_base_directory);
+    const map<string, string_view, less<>>* shared_inputs = _shared_inputs;
+    include_cache* cache = _include_cache;
+    bool map_inputs = _map_inputs;
+    copy_document_state(state);
+    _base_directory = move(base_directory);
+    _shared_inputs = shared_inputs;
+    _include_cache = cache;
+    _map_inputs = map_inputs;
+
+    _contexts = state._contexts;
+    _column_indices = state._column_indices;
+    _files_read = state._files_read;
+    _output.write(state._output.buffer());
+}
+
+// Convert an input up to its first top-level section, saving the state there
+// as the initial state for rendering the rest. Then scan the rest without
+// rendering any inline markup, recording where each top-level section starts
+// and the definitions made before it, and leaving the converter in the state
+// converting the input would.
+// Returns 0 on success, non-zero error code on failure.
+int
+rst2rfcxml::scan_sections(string_view input, rst2rfcxml& initial)
+{
+    section_scan& scan = *_scan;
+
+    // Lines are processed as usual apart from being rendered, so the scan
+    // finds the same sections and definitions conversion would.
+    output_writer discarded_output;
+    bool was_stable = exchange(_input_is_stable, true);
+    line_iterator lines(input);
+    string_view previous_line;
+    line_info previous_info;
+    string_view line;
+    int error = 0;
+    while (lines.next(line)) {
+        line_info info = classify_line(line);
+        scan.section_started = false;
+        error = process_line(previous_line, line, previous_info, info);
+        if (error) {
+            break;
+        }
+
+        // Rendering can start over after a section title, if nothing before
+        // it is still waiting to be output.
+        if (scan.section_started && _table_cells.empty() && _block_lines.empty()) {
+            if (scan.sections.empty()) {
+                initial.copy_document_state(*this);
+                swap(_output, discarded_output);
+                _rendering = false;
+            }
+            scan.sections.push_back(
+                {size_t(line.data() - input.data()), _contexts, _column_indices, scan.definitions.size()});
+        }
+        if (!_rendering) {
+            _output.buffer().clear();
+        }
+        previous_line = line;
+        previous_info = info;
+    }
+    if (!error) {
+        error = process_line(previous_line, {}, previous_info, {});
+    }
+    _input_is_stable = was_stable;
+    if (!_rendering) {
+        swap(_output, discarded_output);
+        _rendering = true;
+    }
+    return error;
+}
+
+// Get the first line of a buffer, or an empty line if there's none.
+static string_view
+_first_line(string_view input)
+{
+    string_view line;
+    line_iterator lines(input);
+    lines.next(line);
+    return line;
+}
+
+// Render the sections [first, end) found by a scan, starting from the initial
+// state plus the definitions the scan found before the first of them.
+// Output is left in the output buffer, or if rendered is given, the output of
+// each section is moved to an element of it, along with its reference use counts.
+// Returns 0 on success, non-zero error code on failure.
+int
+rst2rfcxml::render_sections(
+    const rst2rfcxml& initial,
+    const section_scan& scan,
+    string_view input,
+    size_t first,
+    size_t end,
+    cached_section* rendered)
+{
+    copy_document_state(initial);
+    const section_scan::section_start& start = scan.sections[first];
+    for (size_t i = scan.sections[0].definition_count; i < start.definition_count; i++) {
+        const section_scan::definition& definition = scan.definitions[i];
+        if (definition.is_variable) {
+            handle_variable_initializations(definition.text);
+        } else {
+            define_anchor(definition.text);
+        }
+    }
+    _reference_use_counts.clear();
+    _contexts = start.contexts;
+    _column_indices = start.column_indices;
+
+    // The scan already reported any errors, such as missing include files.
+    ostream discarded_diagnostics(nullptr);
+    _diagnostics = &discarded_diagnostics;
+
+    bool was_stable = exchange(_input_is_stable, true);
+    int error = 0;
+    if (rendered == nullptr) {
+        size_t end_offset = (end < scan.sections.size()) ? scan.sections[end].offset : input.length();
+        line_iterator lines(input.substr(start.offset, end_offset - start.offset));
+        error = process_lines(lines, false, _first_line(input.substr(end_offset)));
+    }
+    for (size_t i = first; rendered != nullptr && i < end && !error; i++) {
+        // Rendering sections one at a time processes the same lines in the same
+        // order as rendering them all at once, so each one's output is the same.
+        size_t section_offset = scan.sections[i].offset;
+        size_t end_offset = (i + 1 < scan.sections.size()) ? scan.sections[i + 1].offset : input.length();
+        line_iterator lines(input.substr(section_offset, end_offset - section_offset));
+        error = process_lines(lines, false, _first_line(input.substr(end_offset)));
+
+        cached_section& section = rendered[i - first];
+        section.output = _output.buffer();
+        _output.buffer().clear();
+        section.reference_use_counts.clear();
+        _reference_use_counts.for_each([&section](string_view anchor, uint32_t use_count) {
+            section.reference_use_counts.emplace_back(anchor, use_count);
+        });
+        sort(section.reference_use_counts.begin(), section.reference_use_counts.end());
+        _reference_use_counts.clear();
+    }
+    _input_is_stable = was_stable;
+    _diagnostics = initial._diagnostics;
+    return error;
+}
+
+// Process an input buffer by converting it up to its first top-level section,
+// scanning the rest, and then rendering runs of sections in parallel.
+// Returns 0 on success, non-zero error code on failure.
+int
+rst2rfcxml::process_input_sections(string_view input)
+{
+    rst2rfcxml initial;
+    initial._diagnostics = _diagnostics;
+    section_scan scan;
+    _scan = &scan;
+    int error = scan_sections(input, initial);
+    _scan = nullptr;
+    if (error || scan.sections.empty()) {
+        detach_input_lines();
+        return error;
+    }
+    if (_section_cache != nullptr) {
+        error = render_cached_sections(initial, scan, input);
+        detach_input_lines();
+        return error;
+    }
+
+    // Group sections into runs of similar size, twice as many as there are
+    // threads so that threads finishing early can take on another run.
+    size_t run_count = _section_threads * 2;
+    size_t scanned_length = input.length() - scan.sections[0].offset;
+    vector<size_t> run_starts{0};
+    for (size_t i = 1; i < scan.sections.size(); i++) {
+        if ((scan.sections[i].offset - scan.sections[0].offset) * run_count >= scanned_length * run_starts.size()) {
+            run_starts.push_back(i);
+        }
+    }
+    vector<rst2rfcxml> renderers(run_starts.size());
+    vector<int> errors(run_starts.size());
+    work_stealing_pool pool(_section_threads);
+    pool.run(run_starts.size(), [&](size_t run) {
+        size_t end = (run + 1 < run_starts.size()) ? run_starts[run + 1] : scan.sections.size();
+        errors[run] = renderers[run].render_sections(initial, scan, input, run_starts[run], end);
+    });
+
+    for (size_t run = 0; run < renderers.size(); run++) {
+        if (errors[run]) {
+            return errors[run];
+        }
+        _output.write(renderers[run]._output.buffer());
+        renderers[run]._reference_use_counts.for_each(
+            [this](string_view anchor, uint32_t use_count) { _reference_use_counts[anchor] += use_count; });
+    }
+
+    // A table row or block still being collected may refer to lines in the buffer.
+    detach_input_lines();
+    return 0;
+}
+
+// Hash the state that definitions build up, which rendering a section starts
+// from. Authors aren't included, since they only appear in the front matter.
+// Tables are hashed independently of the order of their entries, which depends
+// on how they grew rather than on what they hold.
+uint64_t
+rst2rfcxml::hash_document_state() const
+{
+    content_hasher hasher;
+    for (string rst2rfcxml::*member : rst2rfcxml_snapshot::_document_members) {
+        hasher.add(this->*member);
+    }
+    uint64_t anchors = 0;
+    _anchors.for_each([&anchors](string_view text, const anchor_definition& definition) {
+        anchors += content_hasher().add(text).add(definition.anchor).value();
+    });
+    hasher.add(anchors);
+    for (auto& [anchor, reference] : _references->by_anchor) {
+        hasher.add(anchor).add(reference.definitions);
+    }
+    uint64_t targets = 0;
+    _references->by_target.for_each([&targets](string_view target, const lazy_reference* reference) {
+        targets += content_hasher().add(target).add(reference->anchor).value();
+    });
+    return hasher.add(targets).value();
+}
+
+// Render the sections found by a scan, using the cached output of those whose
+// key is in the section cache. A section's key is a hash of the state at the
+// first section, the definitions scanned since, the contexts open at the
+// section's start, its text and the line after it, and the files it includes.
+// Returns 0 on success, non-zero error code on failure.
+int
+rst2rfcxml::render_cached_sections(const rst2rfcxml& initial, const section_scan& scan, string_view input)
+{
+    section_cache& cache = *_section_cache;
+    size_t section_count = scan.sections.size();
+    vector<uint64_t> keys(section_count);
+    content_hasher state;
+    state.add(cache.salt()).add(initial.hash_document_state());
+    size_t definition_index = scan.sections[0].definition_count;
+    for (size_t i = 0; i < section_count; i++) {
+        const section_scan::section_start& start = scan.sections[i];
+        for (; definition_index < start.definition_count; definition_index++) {
+            const section_scan::definition& definition = scan.definitions[definition_index];
+            state.add(uint64_t(definition.is_variable)).add(definition.text);
+        }
+        content_hasher key = state;
+        key.add(uint64_t(start.contexts.size()));
+        for (size_t j = 0; j < start.contexts.size(); j++) {
+            key.add(uint64_t(start.contexts[j].value)).add(uint64_t(start.contexts[j].indentation));
+        }
+        key.add(uint64_t(start.column_indices.size()));
+        for (size_t column : start.column_indices) {
+            key.add(uint64_t(column));
+        }
+        size_t end_offset = (i + 1 < section_count) ? scan.sections[i + 1].offset : input.length();
+        key.add(input.substr(start.offset, end_offset - start.offset)).add(_first_line(input.substr(end_offset)));
+        keys[i] = key.add(start.included_hash).value();
+    }
+
+    size_t thread_count = max<size_t>(_section_threads, 1);
+    work_stealing_pool pool(thread_count);
+    vector<cached_section> sections(section_count);
+    vector<uint8_t> cached(section_count);
+    pool.run(section_count, [&](size_t i) {
+        if (scan.sections[i].cacheable) {
+            cached[i] = cache.load(keys[i], sections[i]);
+        } else {
+            cache.record_uncacheable();
+        }
+    });
+
+    // Render the sections that weren't cached, or all of them when verifying,
+    // in runs of consecutive sections of similar size, and cache their output.
+    size_t run_length = max<size_t>((input.length() - scan.sections[0].offset) / (thread_count * 2), 1);
+    vector<pair<size_t, size_t>> runs;
+    for (size_t i = 0; i < section_count; i++) {
+        if (cached[i] && !cache.verifying()) {
+            continue;
+        }
+        if (!runs.empty() && runs.back().second == i &&
+            scan.sections[i].offset - scan.sections[runs.back().first].offset < run_length) {
+            runs.back().second++;
+        } else {
+            runs.push_back({i, i + 1});
+        }
+    }
+    vector<cached_section> rendered(section_count);
+    vector<uint8_t> mismatched(section_count);
+    vector<int> errors(runs.size());
+    pool.run(runs.size(), [&](size_t run) {
+        auto [first, end] = runs[run];
+        rst2rfcxml renderer;
+        errors[run] = renderer.render_sections(initial, scan, input, first, end, &rendered[first]);
+        for (size_t i = first; i < end && !errors[run]; i++) {
+            if (cached[i] && rendered[i] == sections[i]) {
+                continue;
+            }
+            mismatched[i] = cached[i];
+            if (scan.sections[i].cacheable) {
+                cache.store(keys[i], rendered[i]);
+            }
+            sections[i] = move(rendered[i]);
+        }
+    });
+    for (int error : errors) {
         if (error) {
             return error;
         }
-        _previous_line = line;
     }
-    return process_line(_previous_line, {}, output_stream);
+
+    for (size_t i = 0; i < section_count; i++) {
+        if (mismatched[i]) {
+            cache.record_mismatch();
+            size_t line_number = count(input.begin(), input.begin() + scan.sections[i].offset, '\n') + 1;
+            *_diagnostics << fmt::format(
+                                 "WARNING: cached output of the section at line {} differed from rendering it",
+                                 line_number)
+                          << endl;
+        }
+        _output.write(sections[i].output);
+        for (auto& [anchor, use_count] : sections[i].reference_use_counts) {
+            _reference_use_counts[anchor] += use_count;
+        }
+    }
+    return 0;
 }
 
 // Generate references section in XML.
 void
-rst2rfcxml::output_references(ostream& output_stream, string type, string title)
+rst2rfcxml::output_references(string type, string title)
 {
     bool found = false;
 
-    for (auto& [_, reference] : _xml_references) {
-        if (reference.use_count == 0 || reference.type != type) {
+    for (auto& [anchor, definitions] : _references->by_anchor) {
+        const uint32_t* use_count = _reference_use_counts.find(anchor);
+        if (use_count == nullptr || *use_count == 0) {
+            continue;
+        }
+        reference reference = definitions.materialize();
+        if (reference.type != type) {
             continue;
         }
         if (!found) {
-            output_stream << fmt::format(" <references><name>{}</name>", title) << endl;
+            _output.format(" <references><name>{}</name>\n", title);
             found = true;
         }
 
@@ -1268,102 +2301,155 @@ rst2rfcxml::output_references(ostream& output_stream, string type, string title)
 
         if (reference.seriesinfos.empty()) {
             // Let the seriesInfo override the target URI in the RST.
-            output_stream << fmt::format("  <reference anchor=\"{}\" target=\"{}\">", reference.anchor, target_uri)
-                          << endl;
+            _output.format("  <reference anchor=\"{}\" target=\"{}\">\n", reference.anchor, target_uri);
         } else {
-            output_stream << fmt::format("  <reference anchor=\"{}\">", reference.anchor) << endl;
+            _output.format("  <reference anchor=\"{}\">\n", reference.anchor);
         }
-        output_stream << "   <front>" << endl;
-        output_stream << "    <title>" << reference.title << "</title>" << endl;
+        _output.write_line("   <front>");
+        _output.format("    <title>{}</title>\n", reference.title);
         if (reference.authors.empty()) {
-            output_stream << "    <author/>" << endl;
+            _output.write_line("    <author/>");
         } else {
             for (auto& [anchor, author] : reference.authors) {
-                output_stream << "    <author";
+                _output.write("    <author");
                 if (!author.fullname.empty()) {
-                    output_stream << " fullname=\"" << author.fullname << "\"";
+                    _output.format(" fullname=\"{}\"", author.fullname);
                 }
                 if (!author.initials.empty()) {
-                    output_stream << " initials=\"" << author.initials << "\"";
+                    _output.format(" initials=\"{}\"", author.initials);
                 }
                 if (!author.surname.empty()) {
-                    output_stream << " surname=\"" << author.surname << "\"";
+                    _output.format(" surname=\"{}\"", author.surname);
                 }
-                output_stream << "/>" << endl;   
+                _output.write_line("/>");
             }
         }
         if (!reference.date.year.empty()) {
-            output_stream << "    <date";
+            _output.write("    <date");
             if (!reference.date.month.empty()) {
                 if (!reference.date.day.empty()) {
-                    output_stream << " day=\"" << reference.date.day << "\"";
+                    _output.format(" day=\"{}\"", reference.date.day);
                 }
-                output_stream << " month=\"" << reference.date.month << "\"";
+                _output.format(" month=\"{}\"", reference.date.month);
             }
-            output_stream << " year=\"" << reference.date.year << "\"/>" << endl;
+            _output.format(" year=\"{}\"/>\n", reference.date.year);
         }
-        output_stream << "   </front>" << endl;
+        _output.write_line("   </front>");
         for (auto& seriesInfo : reference.seriesinfos) {
             if (!seriesInfo.name.empty() && !seriesInfo.value.empty()) {
-                output_stream << fmt::format(
-                                     "   <seriesInfo name='{}' value='{}'/>",
-                                     seriesInfo.name,
-                                     seriesInfo.value)
-                              << endl;
+                _output.format("   <seriesInfo name='{}' value='{}'/>\n", seriesInfo.name, seriesInfo.value);
             }
         }
-        output_stream << "  </reference>" << endl;
+        _output.write_line("  </reference>");
     }
     if (found) {
-        output_stream << " </references>" << endl;
+        _output.write_line(" </references>");
     }
-    pop_contexts_until(xml_context::BACK, output_stream);
+    pop_contexts_until(xml_context::BACK);
 }
 
 // Generate XML back matter.
 void
-rst2rfcxml::output_back(ostream& output_stream)
+rst2rfcxml::output_back()
 {
-    push_context(output_stream, xml_context::BACK);
-    output_references(output_stream, "normative", "Normative References");
-    output_references(output_stream, "informative", "Informative References");
+    push_context(xml_context::BACK);
+    output_references("normative", "Normative References");
+    output_references("informative", "Informative References");
 }
 
 // Process an input file that contributes to an output file.
 // Returns 0 on success, non-zero error code on failure.
 int
-rst2rfcxml::process_file(filesystem::path input_filename, ostream& output_stream)
+rst2rfcxml::process_file(filesystem::path input_filename)
 {
-    ifstream input_file(input_filename);
-    if (!input_file.good()) {
-        std::cerr << fmt::format(
-                         "ERROR: can't read {} (cwd: {})", input_filename.string(), filesystem::current_path().string())
-                  << endl;
-        return 1;
+    string name = input_filename.string();
+    if (find(_files_read.begin(), _files_read.end(), name) == _files_read.end()) {
+        _files_read.push_back(name);
+    }
+
+    // When caching sections, a section's output also depends on the files it includes.
+    auto hash_included_file = [this](const string_view* contents) {
+        if (_scan == nullptr || _section_cache == nullptr || _scan->sections.empty()) {
+            return;
+        }
+        section_scan::section_start& section = _scan->sections.back();
+        if (contents == nullptr) {
+            section.cacheable = false;
+        } else {
+            section.included_hash = content_hasher().add(section.included_hash).add(*contents).value();
+        }
+    };
+
+    // Read the input from the shared inputs, or the include cache if it's an
+    // included file or inputs aren't mapped, or else map a regular file into
+    // memory, and fall back to reading a stream for anything else, such as a pipe.
+    string_view contents;
+    shared_ptr<const string> cached_contents;
+    mapped_file mapped_input;
+    ifstream input_file;
+    const string_view* shared_contents = nullptr;
+    if (_shared_inputs != nullptr) {
+        auto shared_input = _shared_inputs->find(name);
+        if (shared_input != _shared_inputs->end()) {
+            shared_contents = &shared_input->second;
+        }
+    }
+    if (shared_contents == nullptr && _include_cache != nullptr && (_include_depth > 0 || !_map_inputs)) {
+        cached_contents = _include_cache->get(input_filename);
+    }
+    if (shared_contents != nullptr) {
+        contents = *shared_contents;
+    } else if (cached_contents != nullptr) {
+        contents = *cached_contents;
+    } else if (_map_inputs && mapped_input.open(input_filename)) {
+        contents = mapped_input.contents();
+    } else {
+        input_file.open(input_filename);
+        if (!input_file.good()) {
+            *_diagnostics << fmt::format(
+                                 "ERROR: can't read {} (cwd: {})",
+                                 input_filename.string(),
+                                 filesystem::current_path().string())
+                          << endl;
+            return 1;
+        }
     }
-    filesystem::path parent_path = input_filename.parent_path();
-    filesystem::path original_path = filesystem::current_path();
-    if (!parent_path.empty()) {
-        filesystem::current_path(parent_path);
+    bool buffered = !input_file.is_open();
+    hash_included_file(buffered ? &contents : nullptr);
+
+    // The cache reads ahead the files included by the files it returns, so do
+    // the same for the files included by any other input.
+    if (_include_cache != nullptr && buffered && cached_contents == nullptr) {
+        _include_cache->prefetch_includes(input_filename.parent_path(), contents);
     }
-    int error = process_input_stream(input_file, output_stream);
-    filesystem::current_path(original_path);
+
+    filesystem::path original_base_directory = exchange(_base_directory, input_filename.parent_path());
+    int error = buffered ? process_input_buffer(contents) : process_input_stream(input_file);
+    _base_directory = move(original_base_directory);
     return error;
 }
 
+int
+rst2rfcxml::process_file(filesystem::path input_filename, ostream& output_stream)
+{
+    output_scope scope(_output, output_stream);
+    return process_file(input_filename);
+}
+
 // Process multiple input files that contribute to an output file.
 // Returns 0 on success, non-zero error code on failure.
 int
 rst2rfcxml::process_files(vector<string> input_filenames, ostream& output_stream)
 {
+    output_scope scope(_output, output_stream);
     for (auto& input_filename : input_filenames) {
-        int error = process_file(input_filename, output_stream);
+        int error = process_file(input_filename);
         if (error) {
             return error;
         }
     }
-    pop_contexts(1, output_stream);
-    output_back(output_stream);
-    pop_contexts(0, output_stream);
+    pop_contexts(1);
+    output_back();
+    pop_contexts(0);
     return 0;
 }
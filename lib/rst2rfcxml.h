@@ -2,44 +2,143 @@
 // SPDX-License-Identifier: MIT
 #pragma once
 
+#include "include_cache.h"
+#include "line_classifier.h"
+#include "line_pipeline.h"
+#include "output_writer.h"
+#include "section_cache.h"
+#include "small_vector.h"
+#include "string_index.h"
+
 #include <filesystem>
 #include <iostream>
+#include <cstdint>
+#include <deque>
 #include <map>
-#include <stack>
+#include <memory>
+#include <string_view>
 
 class xml_context
 {
   public:
-    xml_context(std::string input_value, size_t input_indentation = 0) : value(input_value), indentation(input_indentation) {}
-    static const std::string ABSTRACT;
-    static const std::string ARTWORK;
-    static const std::string ASIDE;
-    static const std::string BACK;
-    static const std::string BLOCKQUOTE;
-    static const std::string COMMENT;
-    static const std::string CONSUME_BLANK_LINE; // Pseudo XML context that maps to nothing.
-    static const std::string DEFINITION_LIST;
-    static const std::string DEFINITION_TERM;
-    static const std::string DEFINITION_DESCRIPTION;
-    static const std::string FRONT;
-    static const std::string LIST_ELEMENT;
-    static const std::string MIDDLE;
-    static const std::string NAME;
-    static const std::string ORDERED_LIST;
-    static const std::string RFC;
-    static const std::string SECTION;
-    static const std::string SOURCE_CODE;
-    static const std::string TABLE;
-    static const std::string TABLE_BODY;
-    static const std::string TABLE_BODY_ROW;
-    static const std::string TABLE_CELL;
-    static const std::string TABLE_HEADER;
-    static const std::string TABLE_HEADER_ROW;
-    static const std::string TEXT;
-    static const std::string TITLE;
-    static const std::string UNORDERED_LIST;
-    std::string value;
-    size_t indentation;
+    enum tag : uint8_t
+    {
+        ABSTRACT,
+        ARTWORK,
+        ASIDE,
+        BACK,
+        BLOCKQUOTE,
+        COMMENT,
+        CONSUME_BLANK_LINE, // Pseudo XML context that maps to nothing.
+        DEFINITION_LIST,
+        DEFINITION_TERM,
+        DEFINITION_DESCRIPTION,
+        FRONT,
+        LIST_ELEMENT,
+        MIDDLE,
+        NAME,
+        ORDERED_LIST,
+        RFC,
+        SECTION,
+        SOURCE_CODE,
+        TABLE,
+        TABLE_BODY,
+        TABLE_BODY_ROW,
+        TABLE_CELL,
+        TABLE_HEADER,
+        TABLE_HEADER_ROW,
+        TEXT,
+        TITLE,
+        UNORDERED_LIST,
+        TAG_COUNT
+    };
+
+    // Properties that a kind of context may have.
+    enum property : uint8_t
+    {
+        EMITS_ELEMENT = 0x01,             // Opening and closing the context writes an XML element.
+        PRESERVES_WHITESPACE = 0x02,      // Lines are collected verbatim, as in artwork.
+        CLOSES_ON_BLANK_LINE = 0x04,      // A blank line ends the context.
+        CLOSES_ON_UNINDENTED_LINE = 0x08, // An unindented line ends the context.
+        ACCEPTS_TEXT = 0x10,              // Text can be written without opening a new paragraph.
+        IS_LIST = 0x20,                   // A list that text following it doesn't belong to.
+    };
+
+    constexpr xml_context() = default;
+    constexpr xml_context(tag input_value, size_t input_indentation = 0)
+        : value(input_value), indentation(static_cast<uint32_t>(input_indentation))
+    {
+    }
+
+    // Get the XML element name for a kind of context.
+    static constexpr std::string_view
+    name(tag value)
+    {
+        return _properties[value].name;
+    }
+
+    static constexpr bool
+    has_property(tag value, property property)
+    {
+        return (_properties[value].flags & property) != 0;
+    }
+
+    // Get a bitmask with one bit per kind of context, for testing against several at once.
+    template <typename... T>
+    static constexpr uint32_t
+    mask(T... values)
+    {
+        return ((1u << values) | ...);
+    }
+
+    tag value = RFC;
+    uint32_t indentation = 0;
+
+  private:
+    struct properties
+    {
+        std::string_view name;
+        uint8_t flags;
+    };
+
+    // Properties of each kind of context, indexed by tag.
+    static constexpr properties _properties[TAG_COUNT] = {
+        {"abstract", EMITS_ELEMENT},
+        {"artwork", EMITS_ELEMENT | PRESERVES_WHITESPACE},
+        {"aside", EMITS_ELEMENT | CLOSES_ON_UNINDENTED_LINE},
+        {"back", EMITS_ELEMENT},
+        {"blockquote", EMITS_ELEMENT | ACCEPTS_TEXT},
+        {"comment", 0},
+        {"", ACCEPTS_TEXT},
+        {"dl", EMITS_ELEMENT | IS_LIST},
+        {"dt", EMITS_ELEMENT | ACCEPTS_TEXT},
+        {"dd", EMITS_ELEMENT},
+        {"front", EMITS_ELEMENT},
+        {"li", EMITS_ELEMENT | ACCEPTS_TEXT},
+        {"middle", EMITS_ELEMENT},
+        {"name", EMITS_ELEMENT},
+        {"ol", EMITS_ELEMENT | IS_LIST},
+        {"rfc", EMITS_ELEMENT},
+        {"section", EMITS_ELEMENT},
+        {"sourcecode", EMITS_ELEMENT | PRESERVES_WHITESPACE | CLOSES_ON_UNINDENTED_LINE | ACCEPTS_TEXT},
+        {"table", EMITS_ELEMENT},
+        {"tbody", EMITS_ELEMENT},
+        {"tr", EMITS_ELEMENT},
+        {"td", EMITS_ELEMENT},
+        {"thead", EMITS_ELEMENT},
+        {"tr", EMITS_ELEMENT},
+        {"t", EMITS_ELEMENT | CLOSES_ON_BLANK_LINE | ACCEPTS_TEXT},
+        {"title", EMITS_ELEMENT},
+        {"ul", EMITS_ELEMENT | IS_LIST},
+    };
+};
+
+// Which kinds of RST inline markup to recognize in a piece of text.
+enum class inline_markup
+{
+    literal,  // Only escapes, as in ``literal`` text.
+    emphasis, // Escapes plus ``literal``, **strong**, and *emphasis* markup.
+    all,      // Everything, including links and `interpreted text`.
 };
 
 struct author
@@ -85,96 +184,505 @@ struct reference
     std::string target;
     std::string type;
     reference_date date;
-    int use_count = 0;
 };
 
+// A reference as defined so far, whose fields are only parsed when it is output,
+// since a shared bibliography typically defines many more references than a
+// document cites.
+struct lazy_reference
+{
+    std::string anchor;
+
+    // The reference's field definitions in the order they appeared, as a name
+    // after "ref[anchor]." and a value, each followed by a newline.
+    std::string definitions;
+
+    reference
+    materialize() const;
+};
+
+// References defined so far, indexed by anchor and by target URI.
+struct reference_table
+{
+    reference_table() = default;
+    reference_table(const reference_table& other);
+    reference_table&
+    operator=(const reference_table& other) = delete;
+
+    std::map<std::string, lazy_reference> by_anchor;
+
+    // References in by_anchor, which are never removed, so pointers stay valid.
+    string_index<lazy_reference*> by_target;
+};
+
+class rst2rfcxml_snapshot;
+
 class rst2rfcxml
 {
   public:
+    // Inputs smaller than this are converted sequentially even when section threads are set,
+    // since scanning them first would cost more than rendering in parallel saves.
+    static constexpr size_t DEFAULT_SECTION_PARALLEL_SIZE = 256 * 1024;
+
     int
     process_files(std::vector<std::string> input_filenames, std::ostream& output_stream);
     int
     process_file(std::filesystem::path input_filename, std::ostream& output_stream);
     int
     process_input_stream(std::istream& input_stream, std::ostream& output_stream);
+    int
+    process_input_buffer(std::string_view input, std::ostream& output_stream);
     void
     pop_contexts(size_t level, std::ostream& output_stream);
     void
-    push_context(std::ostream& output_stream, std::string context, size_t indentation = 0, std::string attributes = "");
+    push_context(
+        std::ostream& output_stream, xml_context::tag context, size_t indentation = 0, std::string_view attributes = {});
+
+    // Process input files, such as a prologue that many documents start with,
+    // into a snapshot that converters can start from instead of processing the
+    // files again. The files are processed with this converter's base directory,
+    // shared inputs, and diagnostics. The snapshot includes the output so far.
+    // Returns 0 on success, non-zero error code on failure.
+    int
+    create_snapshot(std::vector<std::string> input_filenames, std::shared_ptr<const rst2rfcxml_snapshot>& snapshot);
+
+    // Start from a snapshot, as if the input files it was created from had just
+    // been processed. The snapshot's output is written before any other output.
+    void
+    start_from(const rst2rfcxml_snapshot& snapshot);
+
+    // Input files processed so far, including included files and those of any
+    // snapshot this converter started from, in the order they were first read.
+    const std::vector<std::string>&
+    files_read() const
+    {
+        return _files_read;
+    }
+
+    // Buffered output, including counters of bytes written and flushes.
+    const output_writer&
+    output() const
+    {
+        return _output;
+    }
+
+    // Set the directory that included files are resolved against when
+    // processing input that isn't itself a file. Defaults to the current directory.
+    void
+    set_base_directory(std::filesystem::path base_directory)
+    {
+        _base_directory = std::move(base_directory);
+    }
+
+    // Set contents of input files that have already been loaded, e.g., because
+    // several converters share them. Files not in the map are read as usual.
+    void
+    set_shared_inputs(const std::map<std::string, std::string_view, std::less<>>* inputs)
+    {
+        _shared_inputs = inputs;
+    }
+
+    // Read included files through a cache, which keeps their contents between
+    // conversions and reads ahead the files that they and the input files include.
+    // Shared inputs are still used first.
+    void
+    set_include_cache(include_cache* cache)
+    {
+        _include_cache = cache;
+    }
+
+    // Read input files through a memory mapping, rather than copying them. This
+    // is faster, but another process truncating a file while it's mapped, as an
+    // editor saving in place does, raises SIGBUS. Long-running processes should
+    // turn it off, so that files are read through the include cache if there is
+    // one, or else as streams. Defaults to true.
+    void
+    set_map_inputs(bool map_inputs)
+    {
+        _map_inputs = map_inputs;
+    }
+
+    // Set the stream that error messages are written to. Defaults to std::cerr.
+    void
+    set_diagnostics(std::ostream& diagnostics)
+    {
+        _diagnostics = &diagnostics;
+    }
+
+    // Convert input files of at least minimum_input_size bytes in two phases:
+    // a sequential scan that splits the input at top-level section titles and
+    // collects the definitions each section depends on, then rendering of the
+    // sections on a pool of threads. A thread count of 0 or 1 converts sequentially.
+    void
+    set_section_threads(size_t thread_count, size_t minimum_input_size = DEFAULT_SECTION_PARALLEL_SIZE)
+    {
+        _section_threads = thread_count;
+        _section_parallel_minimum_size = minimum_input_size;
+    }
+
+    // Render the inline markup of text lines, such as paragraphs and list items,
+    // on a pool of threads. The lines are rendered in batches of those output
+    // while anchors and references stay the same, and spliced into the output
+    // in order. A thread count of 0 or 1 renders each line as it's processed.
+    void
+    set_inline_threads(size_t thread_count)
+    {
+        _inline_threads = thread_count;
+    }
+
+    // Convert each input file in a pipeline of three threads: one reads the input,
+    // splitting and classifying its lines into a ring of up to ring_capacity lines,
+    // one converts them, and one writes full output buffers to the output stream.
+    // A capacity of 0 converts on a single thread. Inputs converted section by
+    // section aren't pipelined.
+    void
+    set_pipelined(size_t ring_capacity = line_pipeline::DEFAULT_CAPACITY)
+    {
+        _pipeline_capacity = ring_capacity;
+    }
+
+    // Reuse the rendered output of top-level sections from a cache, rendering
+    // and caching only those whose text, included files, or the definitions
+    // before them have changed. Input files are then converted section by
+    // section regardless of their size, on the section threads if any.
+    // Input read from a stream isn't cached.
+    void
+    set_section_cache(section_cache* cache)
+    {
+        _section_cache = cache;
+    }
+
+    // How the stages of pipelined conversions kept up with each other, summed over all inputs.
+    const pipeline_stats&
+    pipeline_statistics() const
+    {
+        return _pipeline_stats;
+    }
 
   private:
+    friend class rst2rfcxml_snapshot;
+
+    int
+    process_file(std::filesystem::path input_filename);
+    int
+    process_input_stream(std::istream& input_stream);
+    int
+    process_input_buffer(std::string_view input);
+    template <typename T>
+    int
+    process_lines(T& lines, bool starts_input = true, std::string_view following_line = {});
+    template <typename T>
+    int
+    process_input_pipelined(T& input);
+    struct section_scan;
+    int
+    process_input_sections(std::string_view input);
+    int
+    scan_sections(std::string_view input, rst2rfcxml& initial);
+    int
+    render_sections(
+        const rst2rfcxml& initial,
+        const section_scan& scan,
+        std::string_view input,
+        size_t first,
+        size_t end,
+        cached_section* rendered = nullptr);
+    int
+    render_cached_sections(const rst2rfcxml& initial, const section_scan& scan, std::string_view input);
+    uint64_t
+    hash_document_state() const;
+    void
+    copy_document_state(const rst2rfcxml& other);
+    void
+    pop_contexts(size_t level);
+    void
+    push_context(xml_context::tag context, size_t indentation = 0, std::string_view attributes = {});
     author&
     get_author_by_anchor(std::map<std::string, author>& map, std::string anchor);
-    reference&
+    reference_table&
+    mutable_references();
+    lazy_reference&
     get_reference_by_anchor(std::string anchor);
-    reference*
-    get_reference_by_target(std::string target);
+    const lazy_reference*
+    get_reference_by_target(std::string_view target);
+    void
+    output_line(std::string_view line, const line_info& info);
     void
-    output_line(std::string line, std::ostream& output_stream);
+    output_inline_line(std::string_view line, inline_markup markup = inline_markup::all);
     void
-    output_header(std::ostream& output_stream);
+    output_header();
     void
-    output_back(std::ostream& output_stream);
+    output_back();
     void
-    output_references(std::ostream& output_stream, std::string type, std::string title);
+    output_references(std::string type, std::string title);
     void
-    output_authors(std::ostream& output_stream) const;
+    output_authors();
     void
-    pop_context(std::ostream& output_stream);
+    pop_context();
     void
-    pop_contexts_until(std::string end, std::ostream& output_stream);
+    pop_contexts_until(xml_context::tag end);
     int
-    process_line(std::string current, std::string next, std::ostream& output_stream);
+    process_line(std::string_view current, std::string_view next);
+    int
+    process_line(
+        std::string_view current,
+        std::string_view next,
+        const line_info& current_info,
+        const line_info& next_info);
+    bool
+    in_context(xml_context::tag context) const;
     bool
-    in_context(std::string context) const;
+    in_any_context(uint32_t mask) const;
+    bool
+    context_has_property(xml_context::property property) const;
     size_t
     get_current_context_indentation() const;
     bool
-    handle_variable_initializations(std::string line);
+    handle_variable_initializations(std::string_view line);
+    bool
+    handle_admonition_directive(std::string_view argument, size_t indentation, int& error);
+    bool
+    handle_code_block_directive(std::string_view argument, size_t indentation, int& error);
+    bool
+    handle_comment_directive(std::string_view argument, size_t indentation, int& error);
+    bool
+    handle_default_directive(std::string_view argument, size_t indentation, int& error);
+    bool
+    handle_glossary_directive(std::string_view argument, size_t indentation, int& error);
+    bool
+    handle_header_directive(std::string_view argument, size_t indentation, int& error);
     bool
-    is_cell_blank(std::string current, int column);
+    handle_include_directive(std::string_view argument, size_t indentation, int& error);
     bool
-    handle_table_line(std::string current, std::string next, std::ostream& output_stream);
+    handle_table_directive(std::string_view argument, size_t indentation, int& error);
     bool
-    handle_title_line(std::string current, std::string next, std::ostream& output_stream);
+    is_cell_blank(std::string_view current, size_t column);
+    bool
+    handle_table_line(std::string_view current, const line_info& current_info);
+    bool
+    handle_title_line(std::string_view current, const line_info& current_info, const line_info& next_info);
     bool
     handle_section_title(
-        int level, std::string marker, std::string current, std::string next, std::ostream& output_stream);
-    std::string
-    replace_reference_links(std::string line);
-    std::string
-    replace_term_links(std::string line);
+        int level, char marker, std::string_view current, const line_info& current_info, const line_info& next_info);
+    struct inline_scratch;
+    void
+    append_inline_markup(inline_scratch& scratch, std::string& output, std::string_view line, inline_markup markup);
+    void
+    append_inline_element(
+        inline_scratch& scratch,
+        std::string& output,
+        std::string_view tag,
+        std::string_view content,
+        inline_markup markup);
+    void
+    append_inline_line(inline_scratch& scratch, std::string& output, std::string_view line, inline_markup markup);
+    void
+    append_reference_link(inline_scratch& scratch, std::string& output, std::string_view content);
+    void
+    append_term_link(inline_scratch& scratch, std::string& output, std::string_view content);
+    void
+    render_deferred_lines();
     std::string
-    define_anchor(std::string term);
+    define_anchor(std::string_view value);
+    void
+    append_anchor(std::string& output, std::string_view value);
     std::string
-    lookup_anchor(std::string term);
+    handle_escapes(std::string_view line);
     std::string
-    handle_escapes_and_links(std::string line);
+    handle_escapes_and_links(std::string_view line);
+    void
+    output_table_row();
     void
-    output_table_row(std::ostream& output_stream);
+    detach_input_lines();
 
+    output_writer _output;
+    std::ostream* _diagnostics = &std::cerr;
+
+    // Directory of the file being processed, which included files are relative to.
+    std::filesystem::path _base_directory;
+    const std::map<std::string, std::string_view, std::less<>>* _shared_inputs = nullptr;
+    include_cache* _include_cache = nullptr;
+    bool _map_inputs = true;
+    std::vector<std::string> _files_read;
     std::string _document_name;
     std::string _base_target_uri;
     std::string _ipr;
     std::string _category;
     std::vector<size_t> _column_indices;
-    std::map<std::string, std::string> _anchors;
+
+    // Anchors defined so far, keyed by the text they were defined for.
+    struct anchor_definition
+    {
+        std::string anchor;
+    };
+    string_index<anchor_definition> _anchors;
+
+    // Scratch space for building "term-" anchor keys without allocating per lookup.
+    std::string _anchor_key;
+
     std::map<std::string, author> _authors;
     std::string _submission_type;
     std::string _abbreviated_title;
     std::string _abstract;
-    std::stack<xml_context> _contexts;
-    std::map<std::string, std::string> _rst_references;
-    std::map<std::string, reference> _xml_references;
 
-    // Collected multi-line RST content of a table cell.
-    std::vector<std::string> _table_cell_rst;
+    // Stack of open contexts, which only allocates when nesting is unusually deep.
+    small_vector<xml_context, 32> _contexts;
+    // References, which converters copied from one another share until one
+    // of them changes them, and the number of times each has been cited, by anchor.
+    std::shared_ptr<reference_table> _references = std::make_shared<reference_table>();
+    string_index<uint32_t> _reference_use_counts;
+
+    // Scratch space for rendering inline markup, which each thread rendering
+    // it needs its own of, along with where it counts citations of references.
+    struct inline_scratch
+    {
+        std::string anchor_key; // "term-" anchor key.
+        std::string link_label; // Label of an internal link.
+
+        // Counts of citations, if not counted in the converter's _reference_use_counts.
+        string_index<uint32_t>* reference_use_counts = nullptr;
+    };
+    inline_scratch _inline_scratch;
+
+    // Collected multi-line RST content of each cell in a table row, as views of
+    // the lines of each cell. Empty if no row is being collected.
+    std::vector<std::vector<std::string_view>> _table_cells;
+
+    // Copies of input lines that table cells refer to, when the input itself
+    // won't last until the row is output.
+    std::deque<std::string> _table_lines;
+
+    // Whether the lines being processed stay valid until processing returns,
+    // as opposed to only until the next line is read.
+    bool _input_is_stable = false;
+
+    // Collected lines of a block of artwork or sourcecode, and the number of
+    // leading spaces common to all of its non-blank lines.
+    std::vector<std::string_view> _block_lines;
+    size_t _block_indentation = SIZE_MAX;
+
+    // Copies of input lines that the block refers to, when the input itself
+    // won't last until the block is output.
+    std::deque<std::string> _block_line_storage;
+
+    // What the scan of an input to be converted section by section found.
+    struct section_scan
+    {
+        // A definition that later lines can depend on: either a variable
+        // definition line, or text that an anchor was defined for.
+        struct definition
+        {
+            bool is_variable;
+            std::string text;
+        };
+
+        // A point just after a top-level section title, with the state
+        // needed to start converting from there.
+        struct section_start
+        {
+            size_t offset;
+            small_vector<xml_context, 32> contexts;
+            std::vector<size_t> column_indices;
+            size_t definition_count; // Number of definitions made before this point while scanning.
+
+            // Hash of the contents of the files the section includes, and whether
+            // they could all be hashed, for caching the section's output.
+            uint64_t included_hash = 0;
+            bool cacheable = true;
+        };
+
+        // Definitions made while scanning, in input order, including those in included files.
+        std::vector<definition> definitions;
+        std::vector<section_start> sections;
+
+        // Set when a line turns out to be a top-level section title.
+        bool section_started = false;
+    };
+
+    // Scan in progress, if any, and whether inline markup is being rendered,
+    // which it isn't while scanning the sections that are rendered in parallel.
+    section_scan* _scan = nullptr;
+    bool _rendering = true;
+    size_t _section_threads = 0;
+    size_t _section_parallel_minimum_size = DEFAULT_SECTION_PARALLEL_SIZE;
+    section_cache* _section_cache = nullptr;
+
+    // Number of include directives being processed.
+    size_t _include_depth = 0;
+
+    size_t _pipeline_capacity = 0;
+    pipeline_stats _pipeline_stats;
+
+    // Text lines whose inline markup is yet to be rendered, each into the output
+    // buffer at a given offset, which is where the line would have gone.
+    struct deferred_line
+    {
+        size_t offset;
+        std::string_view line;
+        inline_markup markup;
+    };
+    std::vector<deferred_line> _deferred_lines;
+
+    // Copies of deferred lines, when the input itself won't last until they're rendered.
+    std::deque<std::string> _deferred_line_storage;
+
+    // Buffer the output is reassembled in after rendering deferred lines.
+    std::string _reassembled_output;
+    size_t _inline_threads = 0;
+};
+
+// State of a converter after processing some input, such as a prologue, that
+// converters can start from. A snapshot never changes once created, so any
+// number of converters on any number of threads can start from it, as can
+// converters in child processes forked after it was created. References are
+// shared with each converter that starts from the snapshot until that converter
+// changes them.
+class rst2rfcxml_snapshot
+{
+  public:
+    // Version of the precompiled prologue file format, which changes whenever
+    // the state a snapshot holds does.
+    static constexpr uint32_t PRECOMPILED_FORMAT_VERSION = 4;
+
+    // Input files the snapshot was created from.
+    const std::vector<std::string>&
+    input_filenames() const
+    {
+        return _input_filenames;
+    }
+
+    // Files read while creating the snapshot, including included files.
+    const std::vector<std::string>&
+    files_read() const
+    {
+        return _state.files_read();
+    }
+
+    // Write the snapshot to a precompiled prologue file, along with the size and
+    // a hash of the contents of each input file it was created from.
+    // Returns 0 on success, non-zero error code on failure.
+    int
+    save(const std::filesystem::path& filename, std::ostream& diagnostics) const;
+
+    // Load a snapshot from a precompiled prologue file, which is mapped into memory
+    // and read without parsing any RST. Fails if the file was written by another
+    // version or is corrupt, or if any of the input files it was created from has
+    // changed since. Whenever the names of those input files can be read,
+    // input_filenames gets them, so that they can be precompiled again.
+    // Returns 0 on success, non-zero error code on failure.
+    static int
+    load(
+        const std::filesystem::path& filename,
+        std::shared_ptr<const rst2rfcxml_snapshot>& snapshot,
+        std::vector<std::string>& input_filenames,
+        std::ostream& diagnostics);
+
+  private:
+    friend class rst2rfcxml;
 
-    // Collected multi-line RST content of a block of artwork or sourcecode.
-    std::string _block_rst;
+    // Members of the converter holding document settings, in the order they're saved.
+    static std::string rst2rfcxml::*const _document_members[7];
 
-    // Some RST markup modifies the previous line, so we need to
-    // keep track of the previous line and process it only after
-    // we know whether the next one affects it.
-    std::string _previous_line;
+    rst2rfcxml _state;
+    std::vector<std::string> _input_filenames; // Absolute paths.
 };
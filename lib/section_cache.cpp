@@ -0,0 +1,117 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "binary_io.h"
+#include "section_cache.h"
+
+#include <atomic>
+#include <chrono>
+#include <fmt/format.h>
+#include <fstream>
+#include <thread>
+
+using namespace std;
+
+static constexpr string_view SECTION_CACHE_MAGIC = "rst2rfcxml-section";
+
+section_cache::section_cache(filesystem::path directory, string_view version) : _directory(move(directory))
+{
+    error_code ec;
+    filesystem::create_directories(_directory, ec);
+    _salt = content_hasher().add(SECTION_CACHE_MAGIC).add(FORMAT_VERSION).add(version).value();
+}
+
+filesystem::path
+section_cache::entry_path(uint64_t key) const
+{
+    return _directory / fmt::format("{:016x}", key);
+}
+
+bool
+section_cache::load(uint64_t key, cached_section& section)
+{
+    ifstream entry_file(entry_path(key), ios::binary);
+    string contents;
+    if (entry_file.good()) {
+        contents.assign(istreambuf_iterator<char>(entry_file), istreambuf_iterator<char>());
+    }
+
+    // The key is stored too, in case a file was renamed or copied.
+    binary_reader reader(contents);
+    bool found = entry_file.good() && reader.read_string() == SECTION_CACHE_MAGIC &&
+                 reader.read_uint32() == FORMAT_VERSION && reader.read_uint64() == key;
+    if (found) {
+        section.output = reader.read_string();
+        section.reference_use_counts.clear();
+        for (uint64_t count = reader.read_count(sizeof(uint64_t) + sizeof(uint32_t)); count > 0; count--) {
+            string anchor(reader.read_string());
+            section.reference_use_counts.emplace_back(move(anchor), reader.read_uint32());
+        }
+        found = !reader.failed() && reader.at_end();
+    }
+
+    lock_guard<mutex> lock(_mutex);
+    (found ? _stats.hits : _stats.misses)++;
+    return found;
+}
+
+void
+section_cache::store(uint64_t key, const cached_section& section)
+{
+    binary_writer writer;
+    writer.write(SECTION_CACHE_MAGIC);
+    writer.write(FORMAT_VERSION);
+    writer.write(key);
+    writer.write(section.output);
+    writer.write(static_cast<uint64_t>(section.reference_use_counts.size()));
+    for (auto& [anchor, use_count] : section.reference_use_counts) {
+        writer.write(anchor);
+        writer.write(use_count);
+    }
+
+    // Write a file of this thread's own and rename it into place, so that a
+    // reader in another thread or process never sees a partly written entry.
+    static atomic<uint64_t> temporary_count = 0;
+    filesystem::path path = entry_path(key);
+    filesystem::path temporary_path = path;
+    temporary_path += fmt::format(
+        ".{:x}.{:x}.tmp",
+        hash<thread::id>()(this_thread::get_id()) ^ chrono::steady_clock::now().time_since_epoch().count(),
+        temporary_count++);
+    {
+        ofstream entry_file(temporary_path, ios::binary);
+        entry_file.write(writer.buffer().data(), writer.buffer().size());
+        if (!entry_file.good()) {
+            entry_file.close();
+            error_code ec;
+            filesystem::remove(temporary_path, ec);
+            return;
+        }
+    }
+    error_code ec;
+    filesystem::rename(temporary_path, path, ec);
+    if (ec) {
+        filesystem::remove(temporary_path, ec);
+    }
+}
+
+void
+section_cache::record_mismatch()
+{
+    lock_guard<mutex> lock(_mutex);
+    _stats.mismatches++;
+}
+
+void
+section_cache::record_uncacheable()
+{
+    lock_guard<mutex> lock(_mutex);
+    _stats.uncacheable++;
+}
+
+section_cache_stats
+section_cache::statistics() const
+{
+    lock_guard<mutex> lock(_mutex);
+    return _stats;
+}
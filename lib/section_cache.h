@@ -0,0 +1,134 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Hashes a sequence of values into a 64-bit FNV-1a hash. Each string is
+// preceded by its length, so that different sequences hash different bytes.
+class content_hasher
+{
+  public:
+    content_hasher&
+    add(std::string_view value)
+    {
+        add(static_cast<uint64_t>(value.length()));
+        add_bytes(value.data(), value.length());
+        return *this;
+    }
+    content_hasher&
+    add(uint64_t value)
+    {
+        add_bytes(&value, sizeof(value));
+        return *this;
+    }
+
+    uint64_t
+    value() const
+    {
+        return _hash;
+    }
+
+  private:
+    void
+    add_bytes(const void* data, size_t length)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < length; i++) {
+            _hash = (_hash ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+
+    uint64_t _hash = 14695981039346656037ull;
+};
+
+// Rendered output of a top-level section, along with the number of times it
+// cited each reference, which decides the references that are output at the end.
+struct cached_section
+{
+    std::string output;
+    std::vector<std::pair<std::string, uint32_t>> reference_use_counts;
+
+    bool
+    operator==(const cached_section& other) const = default;
+};
+
+struct section_cache_stats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+
+    // Sections whose cached output differed from rendering them again, when verifying.
+    size_t mismatches = 0;
+
+    // Sections that couldn't be cached, e.g., because they include a file that isn't a regular file.
+    size_t uncacheable = 0;
+};
+
+// On-disk cache of the rendered output of top-level sections, each in a file
+// named after a hash of everything its rendering depends on: the section's
+// text, the files it includes, and the state of the converter at its start.
+// Any number of converters and processes can share a cache directory.
+class section_cache
+{
+  public:
+    static constexpr uint32_t FORMAT_VERSION = 1;
+
+    // Use a directory, which is created if needed. Keys are salted with the
+    // version of the converter, so entries written by another version are never used.
+    section_cache(std::filesystem::path directory, std::string_view version);
+
+    // Render sections even when their output is cached, counting those whose
+    // cached output differs, and replacing it.
+    void
+    set_verify(bool verify)
+    {
+        _verify = verify;
+    }
+    bool
+    verifying() const
+    {
+        return _verify;
+    }
+
+    // Start of the hash of every key.
+    uint64_t
+    salt() const
+    {
+        return _salt;
+    }
+
+    // Get the output cached under a key, counting a hit or a miss.
+    // Returns false if there's none, or it can't be read.
+    bool
+    load(uint64_t key, cached_section& section);
+
+    // Cache a section's output under a key, replacing any already there.
+    void
+    store(uint64_t key, const cached_section& section);
+
+    void
+    record_mismatch();
+    void
+    record_uncacheable();
+
+    section_cache_stats
+    statistics() const;
+
+  private:
+    std::filesystem::path
+    entry_path(uint64_t key) const;
+
+    std::filesystem::path _directory;
+    uint64_t _salt;
+    bool _verify = false;
+
+    mutable std::mutex _mutex;
+    section_cache_stats _stats;
+};
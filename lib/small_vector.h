@@ -0,0 +1,106 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+
+// Vector of trivially copyable elements that keeps up to N of them inline,
+// so it only allocates once it grows past N elements.
+template <typename T, size_t N> class small_vector
+{
+    static_assert(std::is_trivially_copyable_v<T>, "small_vector only holds trivially copyable types");
+
+  public:
+    small_vector() = default;
+    small_vector(const small_vector& other) { *this = other; }
+    small_vector&
+    operator=(const small_vector& other)
+    {
+        if (this != &other) {
+            _size = 0;
+            reserve(other._size);
+            std::copy_n(other.data(), other._size, data());
+            _size = other._size;
+        }
+        return *this;
+    }
+
+    void
+    push_back(const T& value)
+    {
+        if (_size == _capacity) {
+            reserve(_capacity * 2);
+        }
+        data()[_size++] = value;
+    }
+    void
+    pop_back()
+    {
+        _size--;
+    }
+    T&
+    back()
+    {
+        return data()[_size - 1];
+    }
+    const T&
+    back() const
+    {
+        return data()[_size - 1];
+    }
+    T&
+    operator[](size_t index)
+    {
+        return data()[index];
+    }
+    const T&
+    operator[](size_t index) const
+    {
+        return data()[index];
+    }
+    size_t
+    size() const
+    {
+        return _size;
+    }
+    bool
+    empty() const
+    {
+        return _size == 0;
+    }
+    void
+    clear()
+    {
+        _size = 0;
+    }
+    T*
+    data()
+    {
+        return _heap ? _heap.get() : _inline;
+    }
+    const T*
+    data() const
+    {
+        return _heap ? _heap.get() : _inline;
+    }
+
+    void
+    reserve(size_t capacity)
+    {
+        if (capacity <= _capacity) {
+            return;
+        }
+        std::unique_ptr<T[]> heap(new T[capacity]);
+        std::copy_n(data(), _size, heap.get());
+        _heap = std::move(heap);
+        _capacity = capacity;
+    }
+
+  private:
+    T _inline[N];
+    std::unique_ptr<T[]> _heap;
+    size_t _size = 0;
+    size_t _capacity = N;
+};
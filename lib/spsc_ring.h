@@ -0,0 +1,109 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Bounded lock-free queue between exactly one producer thread and one consumer
+// thread. Elements are filled and emptied in place, so a slot's resources,
+// such as a string's capacity, are reused each time around the ring.
+template <typename T> class spsc_ring
+{
+  public:
+    // The capacity is rounded up to a power of two.
+    explicit spsc_ring(size_t capacity) : _slots(_round_up(capacity)), _mask(_slots.size() - 1) {}
+
+    size_t
+    capacity() const
+    {
+        return _slots.size();
+    }
+
+    // Number of filled elements. Only exact when called from one of the two threads
+    // while the other is idle; otherwise it's a snapshot that may already be stale.
+    size_t
+    size() const
+    {
+        return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+    }
+
+    // Producer: get the next slot to fill, or nullptr if the ring is full.
+    // The slot is only visible to the consumer after end_push().
+    T*
+    begin_push()
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) == _slots.size()) {
+            return nullptr;
+        }
+        return &_slots[tail & _mask];
+    }
+    void
+    end_push()
+    {
+        _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: get the oldest filled slot, or nullptr if the ring is empty.
+    // The slot is only handed back to the producer after end_pop().
+    T*
+    begin_pop()
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &_slots[head & _mask];
+    }
+    void
+    end_pop()
+    {
+        _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+  private:
+    static size_t
+    _round_up(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        return size;
+    }
+
+    std::vector<T> _slots;
+    size_t _mask;
+
+    // Each index is written by only one thread, so keep them on separate cache lines.
+    alignas(64) std::atomic<size_t> _head{0}; // Next slot to pop.
+    alignas(64) std::atomic<size_t> _tail{0}; // Next slot to push.
+};
+
+// Waits for the other end of a ring to make progress: first by yielding, then
+// by sleeping, so that a thread kept waiting for long, e.g., on input from a
+// pipe, doesn't keep a CPU busy.
+class spsc_backoff
+{
+  public:
+    void
+    wait()
+    {
+        if (++_spins < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+    void
+    reset()
+    {
+        _spins = 0;
+    }
+
+  private:
+    size_t _spins = 0;
+};
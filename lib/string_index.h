@@ -0,0 +1,139 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Hash table keyed by strings, using open addressing with linear probing so
+// that a lookup touches one contiguous run of slots. Lookups take a
+// string_view, so callers never need to build a std::string just to search.
+template <typename T> class string_index
+{
+  public:
+    // Find the value for a key, or nullptr if there is none.
+    // Pointers are invalidated by any later insertion.
+    T*
+    find(std::string_view key)
+    {
+        if (_size == 0) {
+            return nullptr;
+        }
+        uint64_t hash = hash_key(key);
+        for (size_t i = hash & (_slots.size() - 1);; i = (i + 1) & (_slots.size() - 1)) {
+            slot& slot = _slots[i];
+            if (!slot.occupied) {
+                return nullptr;
+            }
+            if (slot.hash == hash && slot.key == key) {
+                return &slot.value;
+            }
+        }
+    }
+    const T*
+    find(std::string_view key) const
+    {
+        return const_cast<string_index*>(this)->find(key);
+    }
+
+    // Get the value for a key, inserting a default-constructed one if there is none.
+    // Returns the value and whether it was inserted.
+    std::pair<T*, bool>
+    try_emplace(std::string_view key)
+    {
+        if ((_size + 1) * 4 > _slots.size() * 3) {
+            rehash(_slots.empty() ? 16 : _slots.size() * 2);
+        }
+        uint64_t hash = hash_key(key);
+        size_t i = hash & (_slots.size() - 1);
+        for (; _slots[i].occupied; i = (i + 1) & (_slots.size() - 1)) {
+            if (_slots[i].hash == hash && _slots[i].key == key) {
+                return {&_slots[i].value, false};
+            }
+        }
+        slot& slot = _slots[i];
+        slot.key = key;
+        slot.hash = hash;
+        slot.occupied = true;
+        _size++;
+        return {&slot.value, true};
+    }
+
+    T&
+    operator[](std::string_view key)
+    {
+        return *try_emplace(key).first;
+    }
+
+    size_t
+    size() const
+    {
+        return _size;
+    }
+    bool
+    empty() const
+    {
+        return _size == 0;
+    }
+    void
+    clear()
+    {
+        _slots.clear();
+        _size = 0;
+    }
+
+    // Call visit(key, value) for each entry, in no particular order.
+    template <typename F>
+    void
+    for_each(F visit) const
+    {
+        for (const slot& slot : _slots) {
+            if (slot.occupied) {
+                visit(std::string_view(slot.key), slot.value);
+            }
+        }
+    }
+
+    // 64-bit FNV-1a hash.
+    static uint64_t
+    hash_key(std::string_view key)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : key) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+  private:
+    struct slot
+    {
+        std::string key;
+        T value{};
+        uint64_t hash = 0;
+        bool occupied = false;
+    };
+
+    void
+    rehash(size_t capacity)
+    {
+        std::vector<slot> old_slots(capacity);
+        old_slots.swap(_slots);
+        for (slot& old_slot : old_slots) {
+            if (!old_slot.occupied) {
+                continue;
+            }
+            size_t i = old_slot.hash & (_slots.size() - 1);
+            while (_slots[i].occupied) {
+                i = (i + 1) & (_slots.size() - 1);
+            }
+            _slots[i] = std::move(old_slot);
+        }
+    }
+
+    std::vector<slot> _slots; // Size is always zero or a power of two.
+    size_t _size = 0;
+};
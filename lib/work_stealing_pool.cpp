@@ -0,0 +1,69 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+
+#include "work_stealing_pool.h"
+
+#include <thread>
+
+using namespace std;
+
+work_stealing_pool::work_stealing_pool(size_t thread_count)
+    : _queues(thread_count ? thread_count : max<size_t>(thread::hardware_concurrency(), 1))
+{
+}
+
+// Get the next task for a worker: from the front of its own queue, or
+// else from the back of the first other queue that still has work.
+bool
+work_stealing_pool::take(size_t worker, size_t& index)
+{
+    for (size_t i = 0; i < _queues.size(); i++) {
+        task_queue& queue = _queues[(worker + i) % _queues.size()];
+        lock_guard<mutex> lock(queue.mutex);
+        if (queue.indices.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            index = queue.indices.front();
+            queue.indices.pop_front();
+        } else {
+            index = queue.indices.back();
+            queue.indices.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void
+work_stealing_pool::run(size_t count, const function<void(size_t)>& task)
+{
+    // Deal out contiguous runs of tasks, so each worker starts on its own part of the list.
+    size_t workers = min(_queues.size(), count);
+    for (size_t worker = 0; worker < workers; worker++) {
+        size_t begin = count * worker / workers;
+        size_t end = count * (worker + 1) / workers;
+        for (size_t index = begin; index < end; index++) {
+            _queues[worker].indices.push_back(index);
+        }
+    }
+
+    auto work = [&](size_t worker) {
+        size_t index;
+        while (take(worker, index)) {
+            task(index);
+        }
+    };
+    if (workers <= 1) {
+        work(0);
+        return;
+    }
+    vector<thread> threads;
+    for (size_t worker = 1; worker < workers; worker++) {
+        threads.emplace_back(work, worker);
+    }
+    work(0);
+    for (thread& thread : threads) {
+        thread.join();
+    }
+}
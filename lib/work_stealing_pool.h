@@ -0,0 +1,42 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Runs independent tasks on a fixed number of threads. Tasks are dealt out
+// to per-thread queues up front; a thread that runs out of work steals from
+// the other end of another thread's queue, so a few slow tasks don't leave
+// the remaining threads idle.
+class work_stealing_pool
+{
+  public:
+    // A thread count of 0 means one thread per hardware thread.
+    explicit work_stealing_pool(size_t thread_count = 0);
+
+    size_t
+    thread_count() const
+    {
+        return _queues.size();
+    }
+
+    // Call task(index) for each index in [0, count), returning once all calls are done.
+    // Tasks must not throw.
+    void
+    run(size_t count, const std::function<void(size_t)>& task);
+
+  private:
+    struct task_queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> indices;
+    };
+
+    bool
+    take(size_t worker, size_t& index);
+
+    std::vector<task_queue> _queues;
+};
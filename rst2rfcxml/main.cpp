@@ -2,32 +2,405 @@
 // SPDX-License-Identifier: MIT
 
 #include "CLI11.hpp"
+#include "batch.h"
+#include "conversion_server.h"
+#include "dependency_file.h"
+#include "document_watcher.h"
 #include "rst2rfcxml.h"
 
+#include <csignal>
+
 #define VERSION "rst2rfcxml 1.6.0"
 
 using namespace std;
 
+// Read the jobs listed in a manifest, with a dependency file for each one if asked for.
+static int
+read_manifest_jobs(const string& manifest_filename, bool write_dependencies, vector<batch_job>& jobs)
+{
+    ifstream manifest(manifest_filename);
+    if (!manifest.good()) {
+        std::cerr << "ERROR: can't read " << manifest_filename << endl;
+        return 1;
+    }
+    if (read_batch_manifest(manifest, jobs, std::cerr)) {
+        return 1;
+    }
+    if (write_dependencies) {
+        for (batch_job& job : jobs) {
+            job.dependency_filename = default_dependency_filename(job.output_filename).string();
+        }
+    }
+    return 0;
+}
+
+// Convert every job listed in a manifest, reporting how long each one took.
+static int
+run_batch_manifest(const string& manifest_filename, size_t thread_count, bool write_dependencies)
+{
+    vector<batch_job> jobs;
+    if (read_manifest_jobs(manifest_filename, write_dependencies, jobs)) {
+        return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<batch_result> results;
+    int error = run_batch(jobs, thread_count, results);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    size_t bytes_written = 0;
+    size_t failures = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const batch_result& result = results[i];
+        std::cerr << result.diagnostics;
+        cout << fmt::format(
+            "{}: {} ({:.1f} ms)\n",
+            jobs[i].output_filename,
+            result.error ? "FAILED" : "ok",
+            result.elapsed.count() * 1000);
+        bytes_written += result.bytes_written;
+        failures += (result.error != 0);
+    }
+    cout << fmt::format(
+        "{} jobs, {} failed, in {:.3f} s ({:.1f} jobs/s, {:.1f} MB/s)\n",
+        jobs.size(),
+        failures,
+        elapsed.count(),
+        jobs.size() / elapsed.count(),
+        bytes_written / elapsed.count() / 1e6);
+    return error;
+}
+
+static document_watcher* _watcher = nullptr;
+
+// Keep the outputs of a manifest's jobs, or of the inputs, up to date until interrupted.
+static int
+run_watch(
+    const string& manifest_filename,
+    const vector<string>& input_filenames,
+    const string& output_filename,
+    bool write_dependencies,
+    const string& dependency_filename,
+    const string& section_cache_directory,
+    size_t thread_count,
+    chrono::milliseconds debounce)
+{
+    vector<batch_job> jobs;
+    if (!manifest_filename.empty()) {
+        if (read_manifest_jobs(manifest_filename, write_dependencies, jobs)) {
+            return 1;
+        }
+    } else if (input_filenames.empty() || output_filename.empty()) {
+        std::cerr << "ERROR: --watch needs input files and an output file" << endl;
+        return 1;
+    } else {
+        string job_dependency_filename = dependency_filename;
+        if (write_dependencies && job_dependency_filename.empty()) {
+            job_dependency_filename = default_dependency_filename(output_filename).string();
+        }
+        jobs.push_back({input_filenames, output_filename, job_dependency_filename});
+    }
+
+    document_watcher watcher(move(jobs), thread_count);
+    watcher.set_debounce(debounce);
+    unique_ptr<section_cache> cache;
+    if (!section_cache_directory.empty()) {
+        cache = make_unique<section_cache>(section_cache_directory, VERSION);
+        watcher.set_section_cache(cache.get());
+    }
+
+    // Finish the conversions in progress when interrupted, rather than leave a temporary file behind.
+    _watcher = &watcher;
+    signal(SIGINT, [](int) { _watcher->stop(); });
+    signal(SIGTERM, [](int) { _watcher->stop(); });
+    int error = watcher.watch(cout, std::cerr);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    _watcher = nullptr;
+    return error;
+}
+
+// Start a converter from a precompiled prologue, first precompiling it again
+// if any of the files it was precompiled from has changed.
+static int
+start_from_precompiled(rst2rfcxml& converter, const string& precompiled_filename)
+{
+    shared_ptr<const rst2rfcxml_snapshot> snapshot;
+    vector<string> prologue_filenames;
+    ostringstream diagnostics;
+    if (rst2rfcxml_snapshot::load(precompiled_filename, snapshot, prologue_filenames, diagnostics)) {
+        if (prologue_filenames.empty()) {
+            std::cerr << diagnostics.str();
+            return 1;
+        }
+        if (converter.create_snapshot(prologue_filenames, snapshot) ||
+            snapshot->save(precompiled_filename, std::cerr)) {
+            return 1;
+        }
+    }
+    converter.start_from(*snapshot);
+    return 0;
+}
+
+// Convert using a server started with --serve, as if converting in this process.
+// An input of "-" is read from stdin.
+static int
+run_client(
+    const string& socket_path, const vector<string>& input_filenames, const string& output_filename, bool shutdown)
+{
+    conversion_request request;
+    request.shutdown = shutdown;
+    request.directory = filesystem::current_path().string();
+    for (const string& input_filename : input_filenames) {
+        if (input_filename == "-") {
+            request.inputs.push_back({true, string(istreambuf_iterator<char>(cin), istreambuf_iterator<char>())});
+        } else {
+            request.inputs.push_back({false, filesystem::absolute(input_filename).string()});
+        }
+    }
+    if (!output_filename.empty()) {
+        request.output_filename = filesystem::absolute(output_filename).string();
+    }
+    conversion_response response;
+    int error = send_conversion_request(socket_path, request, response, std::cerr);
+    std::cerr << response.diagnostics;
+    cout << response.output;
+    return error;
+}
+
+// Report which stage of pipelined conversion held the others back.
+static void
+print_pipeline_stats(const pipeline_stats& stats)
+{
+    std::cerr << fmt::format(
+        "{} lines; line ring: {:.1f} of {} lines in use on average, {} at most; "
+        "reader waited {} times, converter {} times\n"
+        "{} output buffers; converter waited {} times for output to be written\n",
+        stats.lines,
+        stats.average_occupancy(),
+        stats.ring_capacity,
+        stats.max_occupancy,
+        stats.reader_stalls,
+        stats.converter_stalls,
+        stats.output_buffers,
+        stats.output_stalls);
+}
+
+// Report how much of the conversion the section cache saved.
+static void
+print_section_cache_stats(const section_cache_stats& stats)
+{
+    size_t lookups = stats.hits + stats.misses;
+    std::cerr << fmt::format(
+        "section cache: {} hits, {} misses ({:.1f}% hit rate), {} uncacheable",
+        stats.hits,
+        stats.misses,
+        lookups ? 100.0 * stats.hits / lookups : 0.0,
+        stats.uncacheable);
+    std::cerr << (stats.mismatches ? fmt::format(", {} stale\n", stats.mismatches) : "\n");
+}
+
 int
 main(int argc, char** argv)
 {
     CLI::App app{"A reStructured Text to xml2rfc Version 3 converter"};
     app.set_version_flag("--version", std::string(VERSION));
     string output_filename;
-    app.add_option("-o", output_filename, "Output filename");
+    auto output_option = app.add_option("-o", output_filename, "Output filename");
     vector<string> input_filenames;
-    app.add_option("-i,input", input_filenames, "Input filenames")->mandatory(true);
-    CLI11_PARSE(app, argc, argv);
+    auto input_option = app.add_option("-i,input", input_filenames, "Input filenames");
+    string manifest_filename;
+    auto batch_option =
+        app.add_option("--batch", manifest_filename, "Manifest of jobs to convert, one \"output: input...\" per line");
+    size_t thread_count = 0;
+    app.add_option(
+        "-j,--jobs",
+        thread_count,
+        "Number of threads for --batch (default: one per CPU), or for converting the sections of a large input "
+        "and rendering inline markup");
+    bool pipelined = false;
+    auto pipeline_option = app.add_flag(
+        "--pipeline", pipelined, "Read, convert, and write each input on separate threads, and report how they kept up");
+    string precompile_filename;
+    auto precompile_option = app.add_option(
+        "--precompile",
+        precompile_filename,
+        "Precompile the inputs, such as a prologue, into a file to start converting from with --precompiled");
+    string precompiled_filename;
+    auto precompiled_option = app.add_option(
+        "--precompiled",
+        precompiled_filename,
+        "Precompiled prologue to start from, which is precompiled again if its inputs have changed");
+    string section_cache_directory;
+    auto section_cache_option = app.add_option(
+        "--section-cache",
+        section_cache_directory,
+        "Directory to cache the output of top-level sections in, so that converting again only renders "
+        "changed sections");
+    bool verify_section_cache = false;
+    app.add_flag(
+           "--verify-section-cache",
+           verify_section_cache,
+           "Render cached sections anyway, and report and replace cached output that differs")
+        ->needs(section_cache_option);
+    bool serve = false;
+    auto serve_option = app.add_flag(
+        "--serve",
+        serve,
+        "Serve requests from the client subcommand on a Unix domain socket, keeping input files and "
+        "prologues in memory between them, with -j threads");
+    bool write_dependencies = false;
+    auto dependencies_option = app.add_flag(
+        "--MD",
+        write_dependencies,
+        "Also write a dependency file in Makefile syntax listing every file read, named after the output file "
+        "with a .d extension");
+    string dependency_filename;
+    auto dependency_file_option = app.add_option(
+        "--MF", dependency_filename, "Write the dependency file to this file instead, which implies --MD");
+    bool watch = false;
+    auto watch_option = app.add_flag(
+        "--watch",
+        watch,
+        "Convert the inputs, or the jobs of --batch, and convert them again whenever a file they were converted "
+        "from changes, until interrupted");
+    size_t debounce_milliseconds = document_watcher::DEFAULT_DEBOUNCE.count();
+    app.add_option(
+           "--debounce",
+           debounce_milliseconds,
+           "Milliseconds to wait after a change for more changes, before converting again")
+        ->capture_default_str()
+        ->needs(watch_option);
+    string socket_path = conversion_server::default_socket_path().string();
+    app.add_option("--socket", socket_path, "Socket for --serve and the client subcommand")->capture_default_str();
+    batch_option->excludes(input_option)->excludes(output_option)->excludes(pipeline_option);
+    batch_option->excludes(precompile_option)->excludes(precompiled_option)->excludes(section_cache_option);
+    precompile_option->excludes(output_option)->excludes(precompiled_option)->excludes(section_cache_option);
+    serve_option->excludes(input_option)->excludes(output_option)->excludes(batch_option);
+    serve_option->excludes(pipeline_option)->excludes(precompile_option)->excludes(precompiled_option);
+    serve_option->excludes(section_cache_option)->excludes(dependencies_option)->excludes(dependency_file_option);
+    batch_option->excludes(dependency_file_option);
+    watch_option->excludes(serve_option)->excludes(pipeline_option)->excludes(precompile_option);
+    watch_option->excludes(precompiled_option);
+
+    // The client takes the same inputs and output as converting directly.
+    auto client = app.add_subcommand("client", "Convert the inputs using a server started with --serve");
+    client->fallthrough();
+    bool shutdown = false;
+    client->add_flag("--shutdown", shutdown, "Stop the server instead of converting anything");
+
+    // Accept the spellings of a C compiler's dependency options too, since CLI11
+    // only allows one-letter options after a single dash.
+    vector<string> arguments(argv, argv + argc);
+    vector<char*> argument_pointers;
+    for (string& argument : arguments) {
+        if (argument == "-MD" || argument == "-MF") {
+            argument.insert(0, "-");
+        }
+        argument_pointers.push_back(argument.data());
+    }
+    CLI11_PARSE(app, argc, argument_pointers.data());
+    write_dependencies = write_dependencies || !dependency_filename.empty();
+
+    if (serve) {
+        conversion_server server(thread_count);
+        return server.serve(socket_path, std::cerr);
+    }
+    if (*client) {
+        if (input_filenames.empty() && !shutdown) {
+            std::cerr << "ERROR: no input files" << endl;
+            return 1;
+        }
+        if (write_dependencies || watch) {
+            std::cerr << "ERROR: the client can't write a dependency file or watch for changes" << endl;
+            return 1;
+        }
+        return run_client(socket_path, input_filenames, output_filename, shutdown);
+    }
 
+    if (watch) {
+        return run_watch(
+            manifest_filename,
+            input_filenames,
+            output_filename,
+            write_dependencies,
+            dependency_filename,
+            section_cache_directory,
+            thread_count,
+            chrono::milliseconds(debounce_milliseconds));
+    }
+    if (!manifest_filename.empty()) {
+        return run_batch_manifest(manifest_filename, thread_count, write_dependencies);
+    }
+    if (input_filenames.empty()) {
+        std::cerr << "ERROR: no input files" << endl;
+        return 1;
+    }
+
+    // The target of a dependency file is the file written, which must be named.
+    string target = precompile_filename.empty() ? output_filename : precompile_filename;
+    if (write_dependencies && target.empty()) {
+        std::cerr << "ERROR: a dependency file needs an output file" << endl;
+        return 1;
+    }
+    if (dependency_filename.empty()) {
+        dependency_filename = default_dependency_filename(target).string();
+    }
+
+    // Included files are read ahead on an I/O thread while the files including them are converted.
+    include_cache included_files;
     rst2rfcxml rst2rfcxml;
+    rst2rfcxml.set_include_cache(&included_files);
+    if (!precompile_filename.empty()) {
+        shared_ptr<const rst2rfcxml_snapshot> snapshot;
+        if (rst2rfcxml.create_snapshot(input_filenames, snapshot)) {
+            return 1;
+        }
+        if (snapshot->save(precompile_filename, std::cerr)) {
+            return 1;
+        }
+        return write_dependencies
+                   ? write_dependency_file(dependency_filename, target, snapshot->files_read(), std::cerr)
+                   : 0;
+    }
+    if (!precompiled_filename.empty() && start_from_precompiled(rst2rfcxml, precompiled_filename)) {
+        return 1;
+    }
+    rst2rfcxml.set_section_threads(thread_count);
+    rst2rfcxml.set_inline_threads(thread_count);
+    if (pipelined) {
+        rst2rfcxml.set_pipelined();
+    }
+    unique_ptr<section_cache> cache;
+    if (!section_cache_directory.empty()) {
+        cache = make_unique<section_cache>(section_cache_directory, VERSION);
+        cache->set_verify(verify_section_cache);
+        rst2rfcxml.set_section_cache(cache.get());
+    }
+    int error;
     if (output_filename.empty()) {
-        return rst2rfcxml.process_files(input_filenames, cout);
+        error = rst2rfcxml.process_files(input_filenames, cout);
     } else {
         ofstream outfile(output_filename);
         if (!outfile.good()) {
             std::cerr << "ERROR: can't write " << output_filename << endl;
             return 1;
         }
-        return rst2rfcxml.process_files(input_filenames, outfile);
+        error = rst2rfcxml.process_files(input_filenames, outfile);
+    }
+    if (pipelined) {
+        print_pipeline_stats(rst2rfcxml.pipeline_statistics());
+    }
+    if (cache) {
+        print_section_cache_stats(cache->statistics());
+    }
+    if (!error && write_dependencies) {
+        // Files read include those a precompiled prologue was created from, and the files they included.
+        vector<string> dependencies = rst2rfcxml.files_read();
+        if (!precompiled_filename.empty()) {
+            dependencies.push_back(precompiled_filename);
+        }
+        error = write_dependency_file(dependency_filename, target, dependencies, std::cerr);
     }
+    return error;
 }
@@ -0,0 +1,95 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#include "catch.hpp"
+#include "rst2rfcxml.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+// Count every heap allocation made by the test process.
+static atomic<size_t> _allocation_count = 0;
+
+void*
+operator new(size_t size)
+{
+    _allocation_count++;
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void
+operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+// Stream buffer that discards all output, so writing to it doesn't allocate.
+class discarding_buffer : public streambuf
+{
+  protected:
+    streamsize
+    xsputn(const char*, streamsize count) override
+    {
+        return count;
+    }
+    int_type
+    overflow(int_type c) override
+    {
+        return traits_type::not_eof(c);
+    }
+};
+
+TEST_CASE("plain paragraph line", "[allocation]")
+{
+    rst2rfcxml rst2rfcxml;
+    discarding_buffer buffer;
+    ostream os(&buffer);
+
+    // Warm up, so that any one-time setup isn't counted.
+    REQUIRE(rst2rfcxml.process_input_buffer("Paragraph one.\n\nParagraph two.\n", os) == 0);
+
+    size_t before = _allocation_count;
+    int error = rst2rfcxml.process_input_buffer("Plain paragraph text, with no markup in it.\n", os);
+    size_t allocations = _allocation_count - before;
+
+    REQUIRE(error == 0);
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("reference link line", "[allocation]")
+{
+    rst2rfcxml rst2rfcxml;
+    discarding_buffer buffer;
+    ostream os(&buffer);
+
+    // Define a reference, and warm up by linking to it.
+    REQUIRE(
+        rst2rfcxml.process_input_buffer(
+            ".. |ref[SAMPLE-REFERENCE].title| replace:: Sample reference with a long title\n"
+            ".. |ref[SAMPLE-REFERENCE].target| replace:: https://example.com/sample/reference\n"
+            "\n"
+            "See `the sample <https://example.com/sample/reference>`_.\n",
+            os) == 0);
+
+    size_t before = _allocation_count;
+    int error = rst2rfcxml.process_input_buffer(
+        "Text linking to `the sample reference document <https://example.com/sample/reference>`_ twice, "
+        "`the sample reference document <https://example.com/sample/reference>`_.\n",
+        os);
+    size_t allocations = _allocation_count - before;
+
+    REQUIRE(error == 0);
+    REQUIRE(allocations == 0);
+}
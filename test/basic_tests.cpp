@@ -1,6 +1,8 @@
-// Copyright (c) Dave Thaler
+﻿// Copyright (c) Dave Thaler
 // SPDX-License-Identifier: MIT
 #include "catch.hpp"
+#include "dependency_file.h"
+#include "include_cache.h"
 #include "rst2rfcxml.h"
 
 #include <filesystem>
@@ -56,6 +58,27 @@ TEST_CASE("escapes", "[basic]")
     test_rst2rfcxml("\\*\\*foo\\*\\*", "<t>\n **foo**\n</t>\n");
     test_rst2rfcxml("**foo**", "<t>\n <strong>foo</strong>\n</t>\n");
     test_rst2rfcxml("**foo\\*\\*bar**", "<t>\n <strong>foo**bar</strong>\n</t>\n");
+    test_rst2rfcxml("\\* *foo* \\*", "<t>\n * <em>foo</em> *\n</t>\n");
+    test_rst2rfcxml("``*foo* <bar>``", "<t>\n <tt>*foo* &lt;bar&gt;</tt>\n</t>\n");
+    test_rst2rfcxml("**foo** ``bar`` *baz*", "<t>\n <strong>foo</strong> <tt>bar</tt> <em>baz</em>\n</t>\n");
+    test_rst2rfcxml("Compute 2 * 3 which is **six**.", "<t>\n Compute 2 * 3 which is <strong>six</strong>.\n</t>\n");
+    test_rst2rfcxml("* \\* **strong**", "<ul>\n <li>\n  * <strong>strong</strong>\n </li>\n</ul>\n");
+    test_rst2rfcxml("Use * \\* **strong**", "<t>\n Use * * <strong>strong</strong>\n</t>\n");
+    test_rst2rfcxml("*foo *bar* baz*", "<t>\n <em>foo *bar</em> baz*\n</t>\n");
+}
+
+TEST_CASE("unmatched emphasis", "[basic]")
+{
+    // A long line of emphasis that never ends is left as is, without searching
+    // the rest of the line again for each start.
+    for (std::string start : {"*", "**"}) {
+        std::string line;
+        for (size_t i = 0; i < 100000; i++) {
+            line += start + "a ";
+        }
+        line.pop_back();
+        test_rst2rfcxml(line.c_str(), ("<t>\n " + line + "\n</t>\n").c_str());
+    }
 }
 
 TEST_CASE("references", "[basic]")
@@ -86,6 +109,20 @@ TEST_CASE("references", "[basic]")
 `Sample reference <https://example.com/target#fragment>`_
 )",
         "<t>\n <xref target=\"SAMPLE\" section=\"fragment\" relative=\"#fragment\">Sample reference</xref>\n</t>\n");
+
+    // Multiple citations on the same line.
+    test_rst2rfcxml(
+        R"(
+.. |ref[ONE].target| replace:: https://example.com/one
+.. |ref[TWO].target| replace:: https://example.com/two
+See `One <https://example.com/one>`_, `Two <https://example.com/two>`_, and `Foo`_.
+)",
+        "<t>\n See <xref target=\"ONE\">One</xref>, <xref target=\"TWO\">Two</xref>, and <xref "
+        "target=\"foo\">Foo</xref>.\n</t>\n");
+
+    // Citation of an unknown reference.
+    test_rst2rfcxml(
+        "`Unknown <https://example.com/unknown>`_", "<t>\n <em>Unknown &lt;https://example.com/unknown&gt;</em>_\n</t>\n");
 }
 
 TEST_CASE("rfc references", "[basic]")
@@ -112,6 +149,119 @@ See `Section 4 of RFC 8126 <https://www.rfc-editor.org/rfc/rfc8126.html#section-
         "<t>\n See <xref target=\"RFC8126\" section=\"4\"/> for details.\n</t>\n");
 }
 
+TEST_CASE("reference definitions", "[basic]")
+{
+    // Only cited references are output, with their fields as last defined, even after the citation.
+    filesystem::path input_filename = filesystem::temp_directory_path() / "rst2rfcxml-references.rst";
+    {
+        ofstream input_file(input_filename, ios::binary);
+        input_file << R"(.. |ref[CITED].title| replace:: Old Title
+.. |ref[CITED].target| replace:: https://example.com/cited
+.. |ref[CITED].type| replace:: normative
+.. |ref[UNCITED].title| replace:: Uncited
+.. |ref[UNCITED].target| replace:: https://example.com/uncited
+.. |ref[UNCITED].type| replace:: normative
+.. header::
+
+Title
+=====
+
+See `Cited <https://example.com/cited>`_.
+
+.. |ref[CITED].title| replace:: New Title
+.. |ref[CITED].author[0].fullname| replace:: John Doe
+.. |ref[CITED].seriesInfo.name| replace:: RFC
+.. |ref[CITED].seriesInfo.value| replace:: 1
+.. |ref[CITED].seriesInfo.name| replace:: DOI
+.. |ref[CITED].seriesInfo.value| replace:: 10.0/1
+.. |ref[CITED].date.year| replace:: 2024
+)";
+    }
+    rst2rfcxml rst2rfcxml;
+    ostringstream output;
+    REQUIRE(rst2rfcxml.process_files({input_filename.string()}, output) == 0);
+    filesystem::remove(input_filename);
+    REQUIRE(output.str().find("UNCITED") == string::npos);
+    REQUIRE(
+        output.str().find(R"(  <reference anchor="CITED">
+   <front>
+    <title>New Title</title>
+    <author fullname="John Doe"/>
+    <date year="2024"/>
+   </front>
+   <seriesInfo name='RFC' value='1'/>
+   <seriesInfo name='DOI' value='10.0/1'/>
+  </reference>
+)") != string::npos);
+}
+
+TEST_CASE("line classification", "[basic]")
+{
+    // Use lines longer than a vector register as well as short ones.
+    line_info info = classify_line("");
+    REQUIRE(info.blank());
+    REQUIRE(classify_line("                                        ").blank());
+
+    info = classify_line("                      Indented text");
+    REQUIRE(info.indentation == 22);
+    REQUIRE(info.underline == 0);
+
+    REQUIRE(classify_line("~~~").underline == '~');
+    REQUIRE(classify_line("----------------------------------------").underline == '-');
+    REQUIRE(classify_line("---------------------------------------x").underline == 0);
+    REQUIRE(classify_line(" ---").underline == 0);
+
+    info = classify_line("  ======================  ======================");
+    REQUIRE(info.table_border);
+    REQUIRE(info.underline == 0);
+    REQUIRE(classify_line("========================================").table_border);
+    REQUIRE(!classify_line("  ======================  =====================x").table_border);
+
+    REQUIRE(classify_line("* item").list == list_marker::bullet);
+    REQUIRE(classify_line("#. item").list == list_marker::auto_enumerated);
+    info = classify_line("   12. item");
+    REQUIRE(info.list == list_marker::enumerated);
+    REQUIRE(info.list_marker_length == 4);
+    REQUIRE(classify_line("12.item").list == list_marker::none);
+
+    REQUIRE(classify_line("..").directive == directive_kind::comment);
+    REQUIRE(classify_line(".. |title| replace:: Title").directive == directive_kind::variable_definition);
+    REQUIRE(classify_line(".. admonition:: Note").directive == directive_kind::admonition);
+    REQUIRE(classify_line(".. code-block::").directive == directive_kind::code_block);
+    REQUIRE(classify_line(".. contents::").directive == directive_kind::contents);
+    REQUIRE(classify_line(".. glossary::").directive == directive_kind::glossary);
+    REQUIRE(classify_line(".. header::").directive == directive_kind::header);
+    REQUIRE(classify_line(".. include:: file.rst").directive == directive_kind::include);
+    REQUIRE(classify_line(".. sectnum::").directive == directive_kind::sectnum);
+    REQUIRE(classify_line(".. tables::").directive == directive_kind::unknown);
+    REQUIRE(classify_line(".. hxxxxx::").directive == directive_kind::unknown);
+    REQUIRE(classify_line(".. unknown:: value").directive == directive_kind::unknown);
+    REQUIRE(classify_line(".. not a directive").directive == directive_kind::none);
+    info = classify_line("   .. table:: Caption");
+    REQUIRE(info.directive == directive_kind::table);
+    REQUIRE(info.directive_argument == 13);
+}
+
+TEST_CASE("string index", "[basic]")
+{
+    string_index<int> index;
+    REQUIRE(index.find("missing") == nullptr);
+    for (int i = 0; i < 1000; i++) {
+        *index.try_emplace("key" + to_string(i)).first = i;
+    }
+    REQUIRE(index.size() == 1000);
+    int found = 0;
+    for (int i = 0; i < 1000; i++) {
+        const int* value = index.find("key" + to_string(i));
+        if (value != nullptr && *value == i) {
+            found++;
+        }
+    }
+    REQUIRE(found == 1000);
+    REQUIRE(!index.try_emplace("key7").second);
+    REQUIRE(index.find("key1000") == nullptr);
+}
+
 TEST_CASE("titles", "[basic]")
 {
     test_rst2rfcxml("Foo\n===\n", "<section anchor=\"foo\" title=\"Foo\">\n</section>\n");
@@ -192,6 +342,17 @@ z = (2 * x &lt; y) + (3 * (a &amp; b) &gt; c)
 )");
 }
 
+TEST_CASE("blank lines after directives", "[basic]")
+{
+    // A blank line consumed after a directive doesn't also end the paragraph or list around it.
+    test_rst2rfcxml(
+        ".. code-block::\n.. code-block::\n\n\na & b",
+        "<sourcecode>\n  <sourcecode>\n  </sourcecode>\n  a &amp; b\n</sourcecode>\n");
+    test_rst2rfcxml(
+        ".. glossary::\nLiteral::\n\n\n1. item",
+        "<dl>\n  Literal:\n  <artwork>\n  </artwork>\n  <ol>\n   <li>\n    item\n   </li>\n  </ol>\n</dl>\n");
+}
+
 TEST_CASE("comment", "[basic]")
 {
     test_rst2rfcxml(
@@ -730,6 +891,68 @@ Bar   Another example
 )");
 }
 
+TEST_CASE("table row across buffers", "[basic]")
+{
+    // A row that is still being collected when its input buffer goes away
+    // must not refer to that buffer.
+    rst2rfcxml rst2rfcxml;
+    ostringstream os;
+    string input =
+        "====  ===============\nName  Description\n====  ===============\nBar   Another example\n      Second line\n";
+    REQUIRE(rst2rfcxml.process_input_buffer(input, os) == 0);
+    input.assign(input.length(), 'x');
+    input = "====  ===============\n";
+    REQUIRE(rst2rfcxml.process_input_buffer(input, os) == 0);
+    rst2rfcxml.pop_contexts(0, os);
+    REQUIRE(os.str() == R"(<table>
+ <thead>
+  <tr>
+   <th>Name</th>
+   <th>Description</th>
+  </tr>
+ </thead>
+ <tbody>
+  <tr>
+   <td>
+    <t>
+     Bar
+    </t>
+   </td>
+   <td>
+    <t>
+     Another example
+     Second line
+    </t>
+   </td>
+  </tr>
+ </tbody>
+</table>
+)");
+}
+
+TEST_CASE("artwork across buffers", "[basic]")
+{
+    // A block that is still being collected when its input buffer goes away
+    // must not refer to that buffer.
+    rst2rfcxml rst2rfcxml;
+    ostringstream os;
+    string input = "::\n\n    first <line>\n      second & line\n";
+    REQUIRE(rst2rfcxml.process_input_buffer(input, os) == 0);
+    input.assign(input.length(), 'x');
+    input = "\ndone\n";
+    REQUIRE(rst2rfcxml.process_input_buffer(input, os) == 0);
+    rst2rfcxml.pop_contexts(0, os);
+    REQUIRE(os.str() == R"(<artwork>
+first &lt;line&gt;
+  second &amp; line
+
+</artwork>
+<t>
+ done
+</t>
+)");
+}
+
 TEST_CASE("table centered", "[basic]")
 {
     test_rst2rfcxml(
@@ -1105,6 +1328,25 @@ TEST_CASE("unordered list extended", "[basic]")
 )");
 }
 
+TEST_CASE("deeply nested list", "[basic]")
+{
+    // Nest deeper than the context stack holds inline.
+    constexpr size_t DEPTH = 40;
+    string input;
+    string expected_output;
+    for (size_t level = 0; level < DEPTH; level++) {
+        input += string(level * 2, ' ') + "* item\n";
+        expected_output += string(level * 2, ' ') + "<ul>\n";
+        expected_output += string(level * 2 + 1, ' ') + "<li>\n";
+        expected_output += string(level * 2 + 2, ' ') + "item\n";
+    }
+    for (size_t level = DEPTH; level > 0; level--) {
+        expected_output += string(level * 2 - 1, ' ') + "</li>\n";
+        expected_output += string(level * 2 - 2, ' ') + "</ul>\n";
+    }
+    test_rst2rfcxml(input.c_str(), expected_output.c_str());
+}
+
 TEST_CASE("ordered list", "[basic]")
 {
     test_rst2rfcxml(
@@ -1177,6 +1419,52 @@ Paragraph two.
 )");
 }
 
+TEST_CASE("unknown variable definitions", "[basic]")
+{
+    // Definitions that don't match a known field are treated as text.
+    test_rst2rfcxml(
+        R"(
+.. |ref[SAMPLE].title| replace:: Sample
+.. |ref[SAMPLE].unknown| replace:: Unknown
+.. |ref[SAMPLE] replace:: Malformed
+.. |author[0].seriesInfo.name| replace:: RFC
+Text.
+)",
+        R"(<t>
+ .. |ref[SAMPLE].unknown| replace:: Unknown
+ .. |ref[SAMPLE] replace:: Malformed
+ .. |author[0].seriesInfo.name| replace:: RFC
+ Text.
+</t>
+)");
+}
+
+TEST_CASE("buffered output", "[basic]")
+{
+    rst2rfcxml rst2rfcxml;
+    istringstream is("Paragraph one.\n\nParagraph two.\n");
+    ostringstream os;
+    REQUIRE(rst2rfcxml.process_input_stream(is, os) == 0);
+    rst2rfcxml.pop_contexts(0, os);
+    REQUIRE(os.str() == "<t>\n Paragraph one.\n</t>\n<t>\n Paragraph two.\n</t>\n");
+
+    // A small document should be written to the stream in one piece per call.
+    REQUIRE(rst2rfcxml.output().flush_count() == 2);
+    REQUIRE(rst2rfcxml.output().bytes_written() == os.str().length());
+
+    // Large documents are flushed whenever the buffer fills up.
+    output_writer writer(1024);
+    ostringstream large_output;
+    {
+        output_scope scope(writer, large_output);
+        for (int i = 0; i < 10000; i++) {
+            writer.format("<t>{}</t>\n", i);
+        }
+    }
+    REQUIRE(writer.bytes_written() == large_output.str().length());
+    REQUIRE(writer.flush_count() > 1);
+}
+
 TEST_CASE("empty header", "[basic]")
 {
     string expected_output = BASIC_PREAMBLE;
@@ -1522,6 +1810,159 @@ TEST_CASE("sample with skeleton", "[basic]")
     REQUIRE(actual_output == expected_output);
 }
 
+TEST_CASE("sample with precompiled prologue", "[basic]")
+{
+    // Find path to sample.rst.
+    constexpr int MAX_DEPTH = 4;
+    filesystem::path path = ".";
+    int depth;
+    for (depth = 0; (depth <= MAX_DEPTH) && !filesystem::exists(path.string() + "/sample/sample.rst"); depth++) {
+        path /= "..";
+    }
+    REQUIRE(depth <= MAX_DEPTH);
+    path += "/sample/";
+
+    // Precompile a copy of the prologue, so it can be changed afterwards.
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-precompiled";
+    filesystem::create_directories(directory);
+    filesystem::path prologue = directory / "prologue.rst";
+    filesystem::copy_file(
+        path.string() + "sample-prologue.rst", prologue, filesystem::copy_options::overwrite_existing);
+    filesystem::path precompiled = directory / "prologue.pch";
+    {
+        rst2rfcxml rst2rfcxml;
+        shared_ptr<const rst2rfcxml_snapshot> snapshot;
+        REQUIRE(rst2rfcxml.create_snapshot({prologue.string()}, snapshot) == 0);
+        ostringstream diagnostics;
+        REQUIRE(snapshot->save(precompiled, diagnostics) == 0);
+        REQUIRE(diagnostics.str().empty());
+    }
+
+    // Load it and convert the rest of the sample.
+    shared_ptr<const rst2rfcxml_snapshot> snapshot;
+    vector<string> prologue_filenames;
+    ostringstream diagnostics;
+    REQUIRE(rst2rfcxml_snapshot::load(precompiled, snapshot, prologue_filenames, diagnostics) == 0);
+    REQUIRE(prologue_filenames == vector<string>{filesystem::absolute(prologue).string()});
+    rst2rfcxml rst2rfcxml;
+    rst2rfcxml.start_from(*snapshot);
+    ostringstream os;
+    REQUIRE(rst2rfcxml.process_files({path.string() + "sample.rst"}, os) == 0);
+    rst2rfcxml.pop_contexts(0, os);
+
+    ifstream expected_output_file(path.string() + "sample.xml");
+    std::string expected_output(
+        (std::istreambuf_iterator<char>(expected_output_file)), std::istreambuf_iterator<char>());
+    REQUIRE(os.str() == expected_output);
+
+    // Changing the prologue makes the precompiled file out of date.
+    {
+        ofstream prologue_file(prologue, ios::binary | ios::app);
+        prologue_file << ".. |ref[NEW].target| replace:: https://example.com/new\n";
+    }
+    snapshot.reset();
+    REQUIRE(rst2rfcxml_snapshot::load(precompiled, snapshot, prologue_filenames, diagnostics) == 1);
+    REQUIRE(snapshot == nullptr);
+    REQUIRE(prologue_filenames == vector<string>{filesystem::absolute(prologue).string()});
+    REQUIRE(diagnostics.str() == "ERROR: " + precompiled.string() + " is out of date\n");
+
+    // A file truncated part way through its header is rejected, without any prologue to precompile again.
+    filesystem::resize_file(precompiled, 48);
+    ostringstream corrupt_diagnostics;
+    REQUIRE(rst2rfcxml_snapshot::load(precompiled, snapshot, prologue_filenames, corrupt_diagnostics) == 1);
+    REQUIRE(prologue_filenames.empty());
+    REQUIRE(corrupt_diagnostics.str() == "ERROR: " + precompiled.string() + " is corrupt\n");
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("precompiled prologue with include", "[basic]")
+{
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-precompiled-include";
+    filesystem::create_directories(directory);
+    filesystem::path prologue = directory / "prologue.rst";
+    filesystem::path included = directory / "references.rst";
+    {
+        ofstream prologue_file(prologue, ios::binary);
+        prologue_file << ".. include:: references.rst\n";
+        ofstream included_file(included, ios::binary);
+        included_file << ".. |ref[OLD].target| replace:: https://example.com/old\n";
+    }
+    filesystem::path precompiled = directory / "prologue.pch";
+    {
+        rst2rfcxml rst2rfcxml;
+        shared_ptr<const rst2rfcxml_snapshot> snapshot;
+        REQUIRE(rst2rfcxml.create_snapshot({prologue.string()}, snapshot) == 0);
+        ostringstream diagnostics;
+        REQUIRE(snapshot->save(precompiled, diagnostics) == 0);
+        REQUIRE(diagnostics.str().empty());
+    }
+
+    // Loading it restores every file read, not just the prologue itself.
+    shared_ptr<const rst2rfcxml_snapshot> snapshot;
+    vector<string> prologue_filenames;
+    ostringstream diagnostics;
+    REQUIRE(rst2rfcxml_snapshot::load(precompiled, snapshot, prologue_filenames, diagnostics) == 0);
+    REQUIRE(prologue_filenames == vector<string>{filesystem::absolute(prologue).string()});
+    REQUIRE(snapshot->files_read() == vector<string>{prologue.string(), included.string()});
+
+    // Changing the included file makes the precompiled file out of date.
+    {
+        ofstream included_file(included, ios::binary | ios::app);
+        included_file << ".. |ref[NEW].target| replace:: https://example.com/new\n";
+    }
+    snapshot.reset();
+    REQUIRE(rst2rfcxml_snapshot::load(precompiled, snapshot, prologue_filenames, diagnostics) == 1);
+    REQUIRE(snapshot == nullptr);
+    REQUIRE(prologue_filenames == vector<string>{filesystem::absolute(prologue).string()});
+    REQUIRE(diagnostics.str() == "ERROR: " + precompiled.string() + " is out of date\n");
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("mapped input", "[basic]")
+{
+    // A file that is memory mapped should produce the same output as a stream,
+    // including when the last line has no newline.
+    const char* input = "Paragraph one.\n\n* item\n\nParagraph two.";
+    filesystem::path input_filename = filesystem::temp_directory_path() / "rst2rfcxml-mapped-input.rst";
+    {
+        ofstream input_file(input_filename, ios::binary);
+        input_file << input;
+    }
+
+    rst2rfcxml mapped;
+    ostringstream mapped_output;
+    REQUIRE(mapped.process_file(input_filename, mapped_output) == 0);
+    mapped.pop_contexts(0, mapped_output);
+
+    // So should one read as a stream, or through an include cache, when inputs aren't mapped.
+    rst2rfcxml unmapped;
+    unmapped.set_map_inputs(false);
+    ostringstream unmapped_output;
+    REQUIRE(unmapped.process_file(input_filename, unmapped_output) == 0);
+    unmapped.pop_contexts(0, unmapped_output);
+    REQUIRE(unmapped_output.str() == mapped_output.str());
+
+    include_cache cache;
+    rst2rfcxml cached;
+    cached.set_map_inputs(false);
+    cached.set_include_cache(&cache);
+    ostringstream cached_output;
+    REQUIRE(cached.process_file(input_filename, cached_output) == 0);
+    cached.pop_contexts(0, cached_output);
+    REQUIRE(cached_output.str() == mapped_output.str());
+    REQUIRE(cache.statistics().misses == 1);
+    filesystem::remove(input_filename);
+
+    rst2rfcxml streamed;
+    istringstream is(input);
+    ostringstream streamed_output;
+    REQUIRE(streamed.process_input_stream(is, streamed_output) == 0);
+    streamed.pop_contexts(0, streamed_output);
+
+    REQUIRE(mapped_output.str() == streamed_output.str());
+    REQUIRE(mapped_output.str().find("Paragraph two.") != string::npos);
+}
+
 TEST_CASE("include out of directory", "[include]")
 {
     string expected_output = BASIC_PREAMBLE;
@@ -1542,3 +1983,87 @@ TEST_CASE("include non-existent", "[include]")
         "",
         1);
 }
+
+TEST_CASE("dependency file", "[basic]")
+{
+    // Every file read is a dependency, including files included by included files, each listed once.
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-dependencies";
+    filesystem::create_directories(directory);
+    string input = (directory / "main.rst").string();
+    {
+        ofstream input_file(input, ios::binary);
+        input_file << "Main\n====\n\n.. include:: outer.rst\n\n.. include:: inner.rst\n";
+        ofstream outer_file(directory / "outer.rst", ios::binary);
+        outer_file << "Outer text.\n\n.. include:: inner.rst\n";
+        ofstream inner_file(directory / "inner.rst", ios::binary);
+        inner_file << "Inner text.\n";
+    }
+    rst2rfcxml rst2rfcxml;
+    ostringstream output;
+    REQUIRE(rst2rfcxml.process_files({input}, output) == 0);
+    vector<string> dependencies = rst2rfcxml.files_read();
+    dependencies.push_back("my $file #1.pch");
+    dependencies.push_back(input);
+
+    filesystem::path dependency_filename = default_dependency_filename(directory / "my draft.xml");
+    REQUIRE(dependency_filename == directory / "my draft.d");
+    ostringstream diagnostics;
+    REQUIRE(write_dependency_file(dependency_filename, "my draft.xml", dependencies, diagnostics) == 0);
+    ifstream dependency_file(dependency_filename, ios::binary);
+    string contents(istreambuf_iterator<char>(dependency_file), {});
+    REQUIRE(
+        contents == "my\\ draft.xml: \\\n  " + input + " \\\n  " + (directory / "outer.rst").string() + " \\\n  " +
+                        (directory / "inner.rst").string() + " \\\n  my\\ $$file\\ \\#1.pch\n");
+    dependency_file.close();
+
+    REQUIRE(write_dependency_file(directory / "missing" / "x.d", "x.xml", dependencies, diagnostics) == 1);
+    REQUIRE(diagnostics.str().starts_with("ERROR: can't write"));
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("dependency file with precompiled prologue", "[basic]")
+{
+    // A document started from a precompiled prologue depends on the files the prologue included too.
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-precompiled-dependencies";
+    filesystem::create_directories(directory);
+    string prologue = (directory / "prologue.rst").string();
+    string included = (directory / "references.rst").string();
+    string input = (directory / "main.rst").string();
+    {
+        ofstream prologue_file(prologue, ios::binary);
+        prologue_file << ".. include:: references.rst\n";
+        ofstream included_file(included, ios::binary);
+        included_file << ".. |ref[OLD].target| replace:: https://example.com/old\n";
+        ofstream input_file(input, ios::binary);
+        input_file << "Main\n====\n\nMain text.\n";
+    }
+    string precompiled = (directory / "prologue.pch").string();
+    ostringstream diagnostics;
+    {
+        rst2rfcxml rst2rfcxml;
+        shared_ptr<const rst2rfcxml_snapshot> snapshot;
+        REQUIRE(rst2rfcxml.create_snapshot({prologue}, snapshot) == 0);
+        REQUIRE(snapshot->save(precompiled, diagnostics) == 0);
+    }
+
+    shared_ptr<const rst2rfcxml_snapshot> snapshot;
+    vector<string> prologue_filenames;
+    REQUIRE(rst2rfcxml_snapshot::load(precompiled, snapshot, prologue_filenames, diagnostics) == 0);
+    rst2rfcxml rst2rfcxml;
+    rst2rfcxml.start_from(*snapshot);
+    ostringstream output;
+    REQUIRE(rst2rfcxml.process_files({input}, output) == 0);
+    vector<string> dependencies = rst2rfcxml.files_read();
+    dependencies.push_back(precompiled);
+
+    filesystem::path dependency_filename = directory / "main.d";
+    REQUIRE(write_dependency_file(dependency_filename, "main.xml", dependencies, diagnostics) == 0);
+    REQUIRE(diagnostics.str().empty());
+    ifstream dependency_file(dependency_filename, ios::binary);
+    string contents(istreambuf_iterator<char>(dependency_file), {});
+    REQUIRE(
+        contents == "main.xml: \\\n  " + prologue + " \\\n  " + included + " \\\n  " + input + " \\\n  " +
+                        precompiled + "\n");
+    dependency_file.close();
+    filesystem::remove_all(directory);
+}
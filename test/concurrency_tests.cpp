@@ -0,0 +1,936 @@
+﻿// Copyright (c) Dave Thaler
+// SPDX-License-Identifier: MIT
+#include "batch.h"
+#include "catch.hpp"
+#include "conversion_server.h"
+#include "document_watcher.h"
+#include "rst2rfcxml.h"
+#include "spsc_ring.h"
+#include "work_stealing_pool.h"
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+constexpr size_t CONVERTER_COUNT = 8;
+constexpr size_t ITERATIONS = 20;
+
+// Each converter gets its own directory with a main file that includes another
+// file by a name that's the same in every directory, so any converter resolving
+// includes against the wrong directory produces the wrong output.
+static filesystem::path
+_create_input_directory(size_t index)
+{
+    filesystem::path directory =
+        filesystem::temp_directory_path() / ("rst2rfcxml-concurrency-" + to_string(index));
+    filesystem::create_directories(directory);
+    {
+        ofstream main_file(directory / "main.rst", ios::binary);
+        main_file << "Document " << index << "\n"
+                  << "==========\n\n"
+                  << ".. include:: part.rst\n\n"
+                  << "See `link " << index << " <https://example.com/" << index << ">`_.\n";
+    }
+    {
+        ofstream part_file(directory / "part.rst", ios::binary);
+        for (size_t i = 0; i <= index; i++) {
+            part_file << "* item " << index << "." << i << "\n";
+        }
+        part_file << "\n::\n\n  artwork " << index << " & more\n\n";
+    }
+    return directory;
+}
+
+static string
+_convert(const filesystem::path& filename, string& diagnostics)
+{
+    rst2rfcxml converter;
+    ostringstream error_stream;
+    converter.set_diagnostics(error_stream);
+    ostringstream os;
+    int error = converter.process_file(filename, os);
+    converter.pop_contexts(0, os);
+    diagnostics = error_stream.str();
+    return error ? "" : os.str();
+}
+
+TEST_CASE("concurrent converters", "[concurrency]")
+{
+    vector<filesystem::path> directories;
+    vector<string> expected;
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        directories.push_back(_create_input_directory(i));
+        string diagnostics;
+        expected.push_back(_convert(directories[i] / "main.rst", diagnostics));
+        REQUIRE(diagnostics.empty());
+        REQUIRE(expected[i].find("item " + to_string(i) + "." + to_string(i)) != string::npos);
+    }
+
+    vector<string> actual(CONVERTER_COUNT);
+    vector<size_t> mismatches(CONVERTER_COUNT);
+    {
+        vector<thread> threads;
+        for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+            threads.emplace_back([&, i] {
+                for (size_t iteration = 0; iteration < ITERATIONS; iteration++) {
+                    string diagnostics;
+                    actual[i] = _convert(directories[i] / "main.rst", diagnostics);
+                    if (actual[i] != expected[i] || !diagnostics.empty()) {
+                        mismatches[i]++;
+                    }
+                }
+            });
+        }
+        for (thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        REQUIRE(mismatches[i] == 0);
+        REQUIRE(actual[i] == expected[i]);
+        filesystem::remove_all(directories[i]);
+    }
+}
+
+TEST_CASE("diagnostics sink", "[concurrency]")
+{
+    rst2rfcxml converter;
+    ostringstream diagnostics;
+    converter.set_diagnostics(diagnostics);
+    converter.set_base_directory(filesystem::temp_directory_path());
+    istringstream is(".. include:: rst2rfcxml-non-existent.rst\n");
+    ostringstream os;
+    REQUIRE(converter.process_input_stream(is, os) == 1);
+    REQUIRE(diagnostics.str() == "ERROR: rst2rfcxml-non-existent.rst does not exist\n");
+}
+
+TEST_CASE("work stealing pool", "[concurrency]")
+{
+    work_stealing_pool pool(4);
+    REQUIRE(pool.thread_count() == 4);
+
+    // Make the first worker's tasks slow so the others have to steal them.
+    vector<atomic<int>> calls(100);
+    pool.run(calls.size(), [&](size_t index) {
+        if (index < 25) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        calls[index]++;
+    });
+    for (atomic<int>& count : calls) {
+        REQUIRE(count == 1);
+    }
+
+    // The pool can be reused, including with fewer tasks than threads.
+    vector<atomic<int>> few_calls(2);
+    pool.run(few_calls.size(), [&](size_t index) { few_calls[index]++; });
+    REQUIRE(few_calls[0] == 1);
+    REQUIRE(few_calls[1] == 1);
+    pool.run(0, [&](size_t) { FAIL("no tasks to run"); });
+}
+
+TEST_CASE("batch manifest", "[concurrency]")
+{
+    istringstream manifest("# comment\n\nout1.xml: prologue.rst one.rst\n  C:\\out2.xml: prologue.rst\ttwo.rst \n");
+    vector<batch_job> jobs;
+    ostringstream diagnostics;
+    REQUIRE(read_batch_manifest(manifest, jobs, diagnostics) == 0);
+    REQUIRE(jobs.size() == 2);
+    REQUIRE(jobs[0].output_filename == "out1.xml");
+    REQUIRE(jobs[0].input_filenames == vector<string>{"prologue.rst", "one.rst"});
+    REQUIRE(jobs[1].output_filename == "C:\\out2.xml");
+    REQUIRE(jobs[1].input_filenames == vector<string>{"prologue.rst", "two.rst"});
+    REQUIRE(diagnostics.str().empty());
+
+    istringstream missing_inputs("out.xml:\n");
+    REQUIRE(read_batch_manifest(missing_inputs, jobs, diagnostics) == 1);
+    REQUIRE(diagnostics.str() == "ERROR: manifest line 1 needs an output and at least one input\n");
+}
+
+TEST_CASE("batch conversion", "[concurrency]")
+{
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-batch";
+    filesystem::create_directories(directory);
+    string prologue = (directory / "prologue.rst").string();
+    {
+        ofstream prologue_file(prologue, ios::binary);
+        prologue_file << "Shared prologue.\n\n";
+    }
+    vector<batch_job> jobs;
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        string input = (directory / ("doc" + to_string(i) + ".rst")).string();
+        ofstream input_file(input, ios::binary);
+        input_file << "Section " << i << "\n==========\n\nText " << i << ".\n";
+        jobs.push_back(
+            {{prologue, input},
+             (directory / ("doc" + to_string(i) + ".xml")).string(),
+             (directory / ("doc" + to_string(i) + ".d")).string()});
+    }
+    jobs.push_back({{prologue, (directory / "missing.rst").string()}, (directory / "missing.xml").string(), ""});
+
+    vector<batch_result> results;
+    REQUIRE(run_batch(jobs, 3, results) == 1);
+    REQUIRE(results.size() == jobs.size());
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        rst2rfcxml converter;
+        ostringstream expected;
+        REQUIRE(converter.process_files(jobs[i].input_filenames, expected) == 0);
+        ifstream output_file(jobs[i].output_filename, ios::binary);
+        string actual((istreambuf_iterator<char>(output_file)), istreambuf_iterator<char>());
+        REQUIRE(results[i].error == 0);
+        REQUIRE(results[i].diagnostics.empty());
+        REQUIRE(results[i].bytes_written == actual.length());
+        REQUIRE(actual == expected.str());
+        REQUIRE(actual.find("Shared prologue.") != string::npos);
+
+        // Jobs that start from a snapshot of the prologue still depend on it.
+        ifstream dependency_file(jobs[i].dependency_filename, ios::binary);
+        string dependencies((istreambuf_iterator<char>(dependency_file)), istreambuf_iterator<char>());
+        REQUIRE(
+            dependencies ==
+            jobs[i].output_filename + ": \\\n  " + prologue + " \\\n  " + jobs[i].input_filenames[1] + "\n");
+    }
+    REQUIRE(results.back().error == 1);
+    REQUIRE(results.back().diagnostics.starts_with("ERROR: can't read"));
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("section parallel conversion", "[concurrency]")
+{
+    // Sections depend on each other through anchors, including duplicate
+    // titles and forward links, and through references defined part way through.
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-sections";
+    filesystem::create_directories(directory);
+    {
+        ofstream part_file(directory / "part.rst", ios::binary);
+        part_file << "Included\n--------\n\nSee `Details`_ and :term:`Widget`.\n\n";
+    }
+    filesystem::path input_filename = directory / "main.rst";
+    {
+        ofstream input_file(input_filename, ios::binary);
+        input_file << ".. |docName| replace:: draft-sections-00\n"
+                   << ".. |ref[EARLY].target| replace:: https://example.com/early\n"
+                   << ".. |ref[EARLY].type| replace:: normative\n\n"
+                   << ".. header::\n\nTitle\n=====\n\nFront text with `early <https://example.com/early>`_.\n\n";
+        for (size_t i = 0; i < 12; i++) {
+            input_file << "Section " << i % 5 << "\n=========\n\n"
+                       << "Text linking `Section " << (i + 3) % 5 << "`_ and `Details`_.\n\n"
+                       << "Details\n-------\n\n"
+                       << "Widget " << i << "\n  A thing *" << i << "*.\n\n"
+                       << "Cite `late <https://example.com/late>`_ and `early <https://example.com/early>`_.\n\n";
+            if (i == 4) {
+                input_file << ".. |ref[LATE].target| replace:: https://example.com/late\n"
+                           << ".. |ref[LATE].type| replace:: informative\n\n"
+                           << ".. include:: part.rst\n\n";
+            }
+            if (i % 3 == 0) {
+                input_file << "===  ===\nA    B\n===  ===\n1    2\n===  ===\n\n";
+            } else {
+                input_file << "::\n\n  artwork " << i << "\n\n";
+            }
+        }
+    }
+
+    rst2rfcxml sequential;
+    ostringstream expected;
+    REQUIRE(sequential.process_files({input_filename.string()}, expected) == 0);
+
+    for (size_t thread_count : {2, 3, 8}) {
+        rst2rfcxml parallel;
+        parallel.set_section_threads(thread_count, 0);
+        ostringstream actual;
+        REQUIRE(parallel.process_files({input_filename.string()}, actual) == 0);
+        REQUIRE(actual.str() == expected.str());
+    }
+    REQUIRE(expected.str().find("anchor=\"section-0--\"") != string::npos);
+    REQUIRE(expected.str().find("<reference anchor=\"LATE\"") != string::npos);
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("spsc ring", "[concurrency]")
+{
+    spsc_ring<size_t> ring(5);
+    REQUIRE(ring.capacity() == 8);
+
+    constexpr size_t COUNT = 100000;
+    thread producer([&] {
+        spsc_backoff backoff;
+        for (size_t i = 0; i < COUNT; i++) {
+            size_t* slot;
+            while ((slot = ring.begin_push()) == nullptr) {
+                backoff.wait();
+            }
+            *slot = i;
+            ring.end_push();
+        }
+    });
+    size_t mismatches = 0;
+    spsc_backoff backoff;
+    for (size_t i = 0; i < COUNT; i++) {
+        size_t* slot;
+        while ((slot = ring.begin_pop()) == nullptr) {
+            backoff.wait();
+        }
+        mismatches += (*slot != i);
+        ring.end_pop();
+    }
+    producer.join();
+    REQUIRE(mismatches == 0);
+    REQUIRE(ring.size() == 0);
+    REQUIRE(ring.begin_pop() == nullptr);
+}
+
+TEST_CASE("pipelined conversion", "[concurrency]")
+{
+    // Enough output to fill several output buffers, with tables and artwork
+    // whose lines must outlive the ring slots they were read into.
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-pipeline";
+    filesystem::create_directories(directory);
+    filesystem::path input_filename = directory / "main.rst";
+    size_t line_count = 0;
+    {
+        ofstream input_file(input_filename, ios::binary);
+        for (size_t i = 0; i < 400; i++) {
+            input_file << "Section " << i << "\n==========\n\n"
+                       << "Text with *emphasis* and a `link <https://example.com/" << i << ">`_.\n\n"
+                       << "===  ===\nA    B\n===  ===\n1    " << i << "\n===  ===\n\n"
+                       << "::\n\n  artwork " << i << "\n    indented & more\n\n"
+                       << "* item\n* another item " << i << "\n\n";
+            line_count += 19;
+        }
+    }
+    ifstream input_file(input_filename, ios::binary);
+    string input((istreambuf_iterator<char>(input_file)), istreambuf_iterator<char>());
+
+    rst2rfcxml sequential;
+    ostringstream expected;
+    REQUIRE(sequential.process_files({input_filename.string()}, expected) == 0);
+    REQUIRE(expected.str().length() > 2 * output_writer::DEFAULT_CAPACITY);
+    rst2rfcxml sequential_stream;
+    istringstream expected_stream_input(input);
+    ostringstream expected_stream;
+    REQUIRE(sequential_stream.process_input_stream(expected_stream_input, expected_stream) == 0);
+
+    for (size_t capacity : {1, 4, 1024}) {
+        rst2rfcxml pipelined;
+        pipelined.set_pipelined(capacity);
+        ostringstream actual;
+        REQUIRE(pipelined.process_files({input_filename.string()}, actual) == 0);
+        REQUIRE(actual.str() == expected.str());
+
+        const pipeline_stats& stats = pipelined.pipeline_statistics();
+        REQUIRE(stats.lines == line_count);
+        REQUIRE(stats.ring_capacity == capacity);
+        REQUIRE(stats.max_occupancy <= capacity);
+        REQUIRE(stats.output_buffers >= 2);
+
+        // Streams are copied line by line, unlike mapped files.
+        rst2rfcxml pipelined_stream;
+        pipelined_stream.set_pipelined(capacity);
+        istringstream stream_input(input);
+        ostringstream stream_output;
+        REQUIRE(pipelined_stream.process_input_stream(stream_input, stream_output) == 0);
+        REQUIRE(stream_output.str() == expected_stream.str());
+        REQUIRE(pipelined_stream.pipeline_statistics().lines == line_count);
+    }
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("parallel inline rendering", "[concurrency]")
+{
+    // Long sections of paragraphs and list items, so lines are rendered in parallel
+    // batches, linking to anchors and references that are defined part way through.
+    ostringstream input;
+    input << ".. |ref[EARLY].target| replace:: https://example.com/early\n"
+          << ".. |ref[EARLY].type| replace:: normative\n\n";
+    for (size_t i = 0; i < 30; i++) {
+        input << "Section " << i % 4 << "\n=========\n\n";
+        for (size_t j = 0; j < 40; j++) {
+            input << "Line " << j << " of *section* " << i << " cites `early <https://example.com/early>`_, "
+                  << "`late <https://example.com/late>`_, `Section " << (i + 1) % 4 << "`_ and :term:`Widget`.\n";
+        }
+        input << "\n* item ``" << i << "``\n* `Section 2`_ item\n\n"
+              << "Widget\n  A **thing** " << i << ".\n\n";
+        if (i == 20) {
+            input << ".. |ref[LATE].target| replace:: https://example.com/late\n"
+                  << ".. |ref[LATE].type| replace:: informative\n\n";
+        }
+    }
+
+    // Whether references appear in the back matter depends on the merged counts of citations.
+    filesystem::path input_filename = filesystem::temp_directory_path() / "rst2rfcxml-inline.rst";
+    {
+        ofstream input_file(input_filename, ios::binary);
+        input_file << input.str();
+    }
+    auto convert = [&](size_t thread_count, bool from_stream) {
+        rst2rfcxml converter;
+        converter.set_inline_threads(thread_count);
+        ostringstream output;
+        int error;
+        if (from_stream) {
+            istringstream stream(input.str());
+            error = converter.process_input_stream(stream, output);
+        } else {
+            error = converter.process_files({input_filename.string()}, output);
+        }
+        return error ? "" : output.str();
+    };
+    string expected = convert(0, false);
+    string expected_from_stream = convert(0, true);
+    REQUIRE(expected.length() > 2 * output_writer::DEFAULT_CAPACITY);
+    REQUIRE(expected.find("<xref target=\"LATE\">late</xref>") != string::npos);
+    REQUIRE(expected.find("<xref target=\"section-1--\">") != string::npos);
+    REQUIRE(expected.find("<reference anchor=\"EARLY\"") != string::npos);
+    REQUIRE(expected.find("<reference anchor=\"LATE\"") != string::npos);
+    for (size_t thread_count : {2, 3, 8}) {
+        REQUIRE(convert(thread_count, false) == expected);
+        REQUIRE(convert(thread_count, true) == expected_from_stream);
+    }
+    filesystem::remove(input_filename);
+}
+
+TEST_CASE("prologue snapshot", "[concurrency]")
+{
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-snapshot";
+    filesystem::create_directories(directory);
+    string prologue = (directory / "prologue.rst").string();
+    {
+        ofstream prologue_file(prologue, ios::binary);
+        prologue_file << ".. |docName| replace:: draft-snapshot-00\n"
+                      << ".. |ipr| replace:: trust200902\n"
+                      << ".. |category| replace:: info\n"
+                      << ".. |author[0].fullname| replace:: Jane Doe\n"
+                      << ".. |ref[SHARED].title| replace:: Shared Reference\n"
+                      << ".. |ref[SHARED].target| replace:: https://example.com/shared\n"
+                      << ".. |ref[SHARED].type| replace:: normative\n"
+                      << ".. header::\n\n"
+                      << "Introduction\n============\n\nShared text.\n\n";
+    }
+
+    // Each document cites the shared reference, and one also defines a reference
+    // of its own, which mustn't leak into the others.
+    vector<string> inputs;
+    vector<string> expected;
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        string input = (directory / ("doc" + to_string(i) + ".rst")).string();
+        {
+            ofstream input_file(input, ios::binary);
+            if (i == 0) {
+                input_file << ".. |ref[OWN].target| replace:: https://example.com/own\n"
+                           << ".. |ref[OWN].type| replace:: informative\n\n";
+            }
+            input_file << "Section " << i << "\n=========\n\n"
+                       << "See `shared <https://example.com/shared>`_, `own <https://example.com/own>`_ "
+                       << "and `Introduction`_.\n";
+        }
+        inputs.push_back(input);
+        rst2rfcxml converter;
+        ostringstream output;
+        REQUIRE(converter.process_files({prologue, input}, output) == 0);
+        expected.push_back(output.str());
+    }
+    REQUIRE(expected[0].find("<reference anchor=\"OWN\"") != string::npos);
+    REQUIRE(expected[1].find("<reference anchor=\"OWN\"") == string::npos);
+    REQUIRE(expected[1].find("<reference anchor=\"SHARED\"") != string::npos);
+
+    rst2rfcxml prologue_converter;
+    shared_ptr<const rst2rfcxml_snapshot> snapshot;
+    REQUIRE(prologue_converter.create_snapshot({prologue}, snapshot) == 0);
+
+    vector<string> actual(CONVERTER_COUNT);
+    vector<int> errors(CONVERTER_COUNT);
+    {
+        vector<thread> threads;
+        for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+            threads.emplace_back([&, i] {
+                rst2rfcxml converter;
+                converter.start_from(*snapshot);
+                ostringstream output;
+                errors[i] = converter.process_files({inputs[i]}, output);
+                actual[i] = output.str();
+            });
+        }
+        for (thread& thread : threads) {
+            thread.join();
+        }
+    }
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        REQUIRE(errors[i] == 0);
+        REQUIRE(actual[i] == expected[i]);
+    }
+
+    // A prologue that ends part way through a table row can't be snapshotted.
+    {
+        ofstream prologue_file(prologue, ios::binary);
+        prologue_file << "===  ===\nA    B\n===  ===\n1    2\n";
+    }
+    ostringstream diagnostics;
+    prologue_converter.set_diagnostics(diagnostics);
+    REQUIRE(prologue_converter.create_snapshot({prologue}, snapshot) == 1);
+    REQUIRE(diagnostics.str().starts_with("ERROR: can't snapshot"));
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("conversion server", "[concurrency]")
+{
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-server";
+    filesystem::create_directories(directory);
+    string prologue = (directory / "prologue.rst").string();
+    string bibliography = (directory / "bibliography.rst").string();
+    string input = (directory / "doc.rst").string();
+    {
+        ofstream prologue_file(prologue, ios::binary);
+        prologue_file << ".. |docName| replace:: draft-server-00\n"
+                      << ".. include:: bibliography.rst\n\n"
+                      << ".. header::\n\n"
+                      << "Introduction\n============\n\nShared text.\n\n";
+        ofstream bibliography_file(bibliography, ios::binary);
+        bibliography_file << ".. |ref[SHARED].target| replace:: https://example.com/shared\n"
+                          << ".. |ref[SHARED].type| replace:: normative\n\n";
+        ofstream input_file(input, ios::binary);
+        input_file << "Details\n=======\n\nSee `shared <https://example.com/shared>`_.\n";
+    }
+    auto convert_directly = [&]() {
+        rst2rfcxml converter;
+        ostringstream output;
+        REQUIRE(converter.process_files({prologue, input}, output) == 0);
+        return output.str();
+    };
+    string expected = convert_directly();
+    REQUIRE(expected.find("<reference anchor=\"SHARED\"") != string::npos);
+
+    // Later requests reuse the contents of every file read, and the prologue
+    // once it has been converted with every file it reads stamped beforehand.
+    conversion_server server(2);
+    conversion_request request;
+    request.inputs = {{false, prologue}, {false, input}};
+    for (size_t i = 0; i < 3; i++) {
+        conversion_response response;
+        REQUIRE(server.convert(request, response) == 0);
+        REQUIRE(response.output == expected);
+        REQUIRE(response.diagnostics.empty());
+    }
+    server_stats stats = server.statistics();
+    REQUIRE(stats.requests == 3);
+    REQUIRE(stats.prologue_misses == 2);
+    REQUIRE(stats.prologue_hits == 1);
+    REQUIRE(stats.file_hits == 6);
+
+    // Changing a file included by the prologue means converting the prologue again.
+    {
+        ofstream bibliography_file(bibliography, ios::binary);
+        bibliography_file << ".. |ref[SHARED].target| replace:: https://example.com/shared\n"
+                          << ".. |ref[SHARED].title| replace:: Shared Reference\n"
+                          << ".. |ref[SHARED].type| replace:: normative\n\n";
+    }
+    expected = convert_directly();
+    REQUIRE(expected.find("<title>Shared Reference</title>") != string::npos);
+    conversion_response response;
+    REQUIRE(server.convert(request, response) == 0);
+    REQUIRE(response.output == expected);
+    REQUIRE(server.statistics().prologue_misses == 3);
+
+    // So does changing it without changing its size, and the snapshot of the
+    // changed prologue is kept since every file it read was stamped beforehand.
+    {
+        ofstream bibliography_file(bibliography, ios::binary);
+        bibliography_file << ".. |ref[SHARED].target| replace:: https://example.com/shared\n"
+                          << ".. |ref[SHARED].title| replace:: Shared Referenc2\n"
+                          << ".. |ref[SHARED].type| replace:: normative\n\n";
+    }
+    filesystem::last_write_time(bibliography, filesystem::last_write_time(bibliography) + chrono::seconds(1));
+    expected = convert_directly();
+    REQUIRE(expected.find("<title>Shared Referenc2</title>") != string::npos);
+    for (size_t i = 0; i < 2; i++) {
+        REQUIRE(server.convert(request, response) == 0);
+        REQUIRE(response.output == expected);
+    }
+    REQUIRE(server.statistics().prologue_misses == 4);
+    REQUIRE(server.statistics().prologue_hits == 2);
+
+    // Inline input resolves included files against the request's directory.
+    conversion_request inline_request;
+    inline_request.directory = directory.string();
+    inline_request.inputs = {{true, ".. include:: doc.rst\n"}};
+    REQUIRE(server.convert(inline_request, response) == 0);
+    REQUIRE(response.diagnostics.empty());
+    REQUIRE(response.output.find("title=\"Details\"") != string::npos);
+
+#ifndef _WIN32
+    // Clients converting at the same time over the socket get the same output.
+    filesystem::path socket_path = directory / "server.sock";
+    int serve_error = -1;
+    server.set_idle_timeout(chrono::milliseconds(200));
+    thread serving([&] { serve_error = server.serve(socket_path, std::cerr); });
+    while (!filesystem::is_socket(socket_path)) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    // Clients that go idle, or stall part way through a frame, are disconnected
+    // rather than keeping both of the server's threads from serving anyone else.
+    auto connect_and_stall = [&](string_view sent) {
+        int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        socket_path.string().copy(address.sun_path, sizeof(address.sun_path) - 1);
+        bool connected = connect(connection, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+        REQUIRE(connected);
+        REQUIRE(send(connection, sent.data(), sent.size(), 0) == static_cast<ssize_t>(sent.size()));
+        return connection;
+    };
+    int idle_connection = connect_and_stall({});
+    int stalled_connection = connect_and_stall(string_view("d\0\0", 3));
+    REQUIRE(send_conversion_request(socket_path, request, response, std::cerr) == 0);
+    REQUIRE(response.output == expected);
+    char byte;
+    REQUIRE(recv(idle_connection, &byte, 1, 0) == 0);
+    REQUIRE(recv(stalled_connection, &byte, 1, 0) == 0);
+    close(idle_connection);
+    close(stalled_connection);
+
+    // A frame longer than any draft is rejected as soon as its header arrives.
+    int oversized_connection = connect_and_stall("t\xff\xff\xff\xff");
+    REQUIRE(recv(oversized_connection, &byte, 1, 0) == 0);
+    close(oversized_connection);
+    vector<conversion_response> responses(CONVERTER_COUNT);
+    vector<int> errors(CONVERTER_COUNT);
+    {
+        vector<thread> clients;
+        for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+            clients.emplace_back([&, i] {
+                ostringstream diagnostics;
+                errors[i] = send_conversion_request(socket_path, request, responses[i], diagnostics);
+            });
+        }
+        for (thread& client : clients) {
+            client.join();
+        }
+    }
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        REQUIRE(errors[i] == 0);
+        REQUIRE(responses[i].output == expected);
+    }
+
+    // Output can also be written by the server, and errors are reported back.
+    conversion_request file_request = request;
+    file_request.output_filename = (directory / "doc.xml").string();
+    REQUIRE(send_conversion_request(socket_path, file_request, response, std::cerr) == 0);
+    REQUIRE(response.output.empty());
+    {
+        ifstream output_file(file_request.output_filename, ios::binary);
+        REQUIRE(string(istreambuf_iterator<char>(output_file), istreambuf_iterator<char>()) == expected);
+    }
+    conversion_request missing_request;
+    missing_request.inputs = {{false, (directory / "missing.rst").string()}};
+    REQUIRE(send_conversion_request(socket_path, missing_request, response, std::cerr) == 1);
+    REQUIRE(response.diagnostics.starts_with("ERROR: can't read"));
+
+    conversion_request shutdown_request;
+    shutdown_request.shutdown = true;
+    REQUIRE(send_conversion_request(socket_path, shutdown_request, response, std::cerr) == 0);
+    serving.join();
+    REQUIRE(serve_error == 0);
+    REQUIRE(!filesystem::exists(socket_path));
+    ostringstream diagnostics;
+    REQUIRE(send_conversion_request(socket_path, request, response, diagnostics) == 1);
+    REQUIRE(diagnostics.str().starts_with("ERROR: can't connect"));
+#endif
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("section cache", "[concurrency]")
+{
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-section-cache";
+    filesystem::path cache_directory = directory / "cache";
+    filesystem::remove_all(directory);
+    filesystem::create_directories(directory);
+    string input = (directory / "doc.rst").string();
+    string part = (directory / "part.rst").string();
+    auto write_files = [&](const string& second_paragraph, const string& part_text) {
+        ofstream input_file(input, ios::binary);
+        input_file << ".. |ref[CACHED].target| replace:: https://example.com/cached\n\n";
+        for (size_t i = 0; i < 4; i++) {
+            input_file << "Section " << i << "\n=========\n\n";
+            if (i == 1) {
+                input_file << second_paragraph << "\n\n";
+            } else if (i == 2) {
+                input_file << ".. include:: part.rst\n\n";
+            } else {
+                input_file << "Text of section " << i << " citing `cached <https://example.com/cached>`_.\n\n";
+            }
+        }
+        ofstream part_file(part, ios::binary);
+        part_file << part_text;
+    };
+    auto convert = [&](section_cache* cache, string& diagnostics) {
+        rst2rfcxml converter;
+        ostringstream diagnostics_stream;
+        converter.set_diagnostics(diagnostics_stream);
+        converter.set_section_cache(cache);
+        ostringstream output;
+        REQUIRE(converter.process_files({input}, output) == 0);
+        diagnostics = diagnostics_stream.str();
+        return output.str();
+    };
+    auto check = [&](section_cache& cache, size_t hits, size_t misses) {
+        string diagnostics;
+        REQUIRE(convert(&cache, diagnostics) == convert(nullptr, diagnostics));
+        section_cache_stats stats = cache.statistics();
+        REQUIRE(stats.hits == hits);
+        REQUIRE(stats.misses == misses);
+        REQUIRE(stats.mismatches == 0);
+    };
+
+    // A cold cache misses every section, and a warm one hits every section.
+    write_files("Some *emphasized* text.", "* included item\n");
+    {
+        section_cache cache(cache_directory, "test");
+        check(cache, 0, 4);
+    }
+    {
+        section_cache cache(cache_directory, "test");
+        check(cache, 4, 0);
+    }
+
+    // Editing a section misses only that section.
+    write_files("Some **strong** text.", "* included item\n");
+    {
+        section_cache cache(cache_directory, "test");
+        check(cache, 3, 1);
+    }
+
+    // So does editing a file that a section includes.
+    write_files("Some **strong** text.", "* changed item\n");
+    {
+        section_cache cache(cache_directory, "test");
+        check(cache, 3, 1);
+    }
+
+    // Another version of the converter doesn't use the entries.
+    {
+        section_cache cache(cache_directory, "other");
+        check(cache, 0, 4);
+    }
+
+    // Verifying finds an entry that no longer matches rendering its section, and replaces it.
+    string expected;
+    {
+        string diagnostics;
+        expected = convert(nullptr, diagnostics);
+    }
+    for (auto& entry : filesystem::directory_iterator(cache_directory)) {
+        string contents;
+        {
+            ifstream entry_file(entry.path(), ios::binary);
+            contents.assign(istreambuf_iterator<char>(entry_file), istreambuf_iterator<char>());
+        }
+        size_t position = contents.find("Section 1");
+        if (position != string::npos) {
+            contents.replace(position, 9, "Tampered!");
+            ofstream entry_file(entry.path(), ios::binary);
+            entry_file << contents;
+        }
+    }
+    {
+        section_cache cache(cache_directory, "test");
+        cache.set_verify(true);
+        string diagnostics;
+        REQUIRE(convert(&cache, diagnostics) == expected);
+        REQUIRE(cache.statistics().mismatches == 1);
+        REQUIRE(diagnostics.find("WARNING: cached output of the section at line") != string::npos);
+    }
+    {
+        section_cache cache(cache_directory, "test");
+        check(cache, 4, 0);
+    }
+
+    filesystem::remove_all(directory);
+}
+
+TEST_CASE("include cache", "[concurrency]")
+{
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-include-cache";
+    filesystem::remove_all(directory);
+    filesystem::create_directories(directory);
+    string input = (directory / "main.rst").string();
+    {
+        ofstream input_file(input, ios::binary);
+        input_file << "Main\n====\n\n.. include:: outer.rst\n\nMain text.\n";
+        ofstream outer_file(directory / "outer.rst", ios::binary);
+        outer_file << "Outer text.\n\n.. include:: inner.rst\n";
+        ofstream inner_file(directory / "inner.rst", ios::binary);
+        inner_file << "* inner item\n";
+    }
+    auto convert = [&](include_cache* cache) {
+        rst2rfcxml converter;
+        converter.set_include_cache(cache);
+        ostringstream output;
+        REQUIRE(converter.process_files({input}, output) == 0);
+        return output.str();
+    };
+
+    // Included files are read ahead, along with the files they include.
+    {
+        include_cache cache;
+        cache.prefetch_includes(directory, ".. include:: outer.rst\n.. include:: sub/skipped.rst\n");
+        cache.wait_for_prefetches();
+        REQUIRE(cache.statistics().prefetched == 2);
+        REQUIRE(cache.get(directory / "inner.rst") != nullptr);
+        REQUIRE(cache.get(directory / "missing.rst") == nullptr);
+        REQUIRE(cache.get(directory) == nullptr);
+        include_cache_stats stats = cache.statistics();
+        REQUIRE(stats.hits == 1);
+        REQUIRE(stats.misses == 0);
+    }
+
+    // Converting again reads nothing, until an included file changes.
+    include_cache cache;
+    string expected = convert(nullptr);
+    REQUIRE(convert(&cache) == expected);
+    cache.wait_for_prefetches();
+    include_cache_stats first = cache.statistics();
+    REQUIRE(first.hits + first.misses == 2);
+    REQUIRE(first.misses + first.prefetched == 2);
+
+    REQUIRE(convert(&cache) == expected);
+    cache.wait_for_prefetches();
+    include_cache_stats second = cache.statistics();
+    REQUIRE(second.hits == first.hits + 2);
+    REQUIRE(second.misses == first.misses);
+    REQUIRE(second.prefetched == first.prefetched);
+
+    {
+        ofstream inner_file(directory / "inner.rst", ios::binary);
+        inner_file << "* changed inner item\n";
+    }
+    expected = convert(nullptr);
+    REQUIRE(expected.find("changed inner item") != string::npos);
+    REQUIRE(convert(&cache) == expected);
+    cache.wait_for_prefetches();
+    include_cache_stats third = cache.statistics();
+    REQUIRE(third.misses + third.prefetched == second.misses + second.prefetched + 1);
+
+    // Converters on several threads can share a cache.
+    vector<string> outputs(CONVERTER_COUNT);
+    vector<int> errors(CONVERTER_COUNT);
+    {
+        vector<thread> threads;
+        for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+            threads.emplace_back([&, i] {
+                for (size_t j = 0; j < ITERATIONS && errors[i] == 0; j++) {
+                    rst2rfcxml converter;
+                    converter.set_include_cache(&cache);
+                    ostringstream output;
+                    errors[i] = converter.process_files({input}, output);
+                    outputs[i] = output.str();
+                }
+            });
+        }
+        for (thread& t : threads) {
+            t.join();
+        }
+    }
+    for (size_t i = 0; i < CONVERTER_COUNT; i++) {
+        REQUIRE(errors[i] == 0);
+        REQUIRE(outputs[i] == expected);
+    }
+
+    filesystem::remove_all(directory);
+}
+
+#ifdef __linux__
+TEST_CASE("document watcher", "[concurrency]")
+{
+    filesystem::path directory = filesystem::temp_directory_path() / "rst2rfcxml-watch";
+    filesystem::remove_all(directory);
+    filesystem::create_directories(directory);
+    auto write_file = [&](const string& name, const string& contents) {
+        ofstream file(directory / name, ios::binary);
+        file << contents;
+    };
+    auto read_file = [&](const string& name) {
+        ifstream file(directory / name, ios::binary);
+        return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    };
+    write_file("prologue.rst", ".. include:: shared.rst\n\n");
+    write_file("shared.rst", "Shared text 1.\n\n");
+    write_file("a.rst", "Alpha\n=====\n\n.. include:: fragment.rst\n");
+    write_file("fragment.rst", "Fragment text 1.\n");
+    write_file("b.rst", "Beta\n====\n\nBeta text 1.\n");
+    string prologue = (directory / "prologue.rst").string();
+    vector<batch_job> jobs = {
+        {{prologue, (directory / "a.rst").string()}, (directory / "a.xml").string(), ""},
+        {{prologue, (directory / "b.rst").string()}, (directory / "b.xml").string(), ""},
+    };
+
+    document_watcher watcher(jobs, 2);
+    watcher.set_debounce(chrono::milliseconds(1));
+    ostringstream report;
+    ostringstream diagnostics;
+    int watch_error = -1;
+    thread watching([&] { watch_error = watcher.watch(report, diagnostics); });
+    auto wait_for_conversions = [&](size_t conversions) {
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+        while (watcher.statistics().conversions < conversions && chrono::steady_clock::now() < deadline) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        return watcher.statistics().conversions;
+    };
+    REQUIRE(wait_for_conversions(2) == 2);
+    while (watcher.statistics().directories == 0) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    REQUIRE(read_file("a.xml").find("Fragment text 1.") != string::npos);
+    REQUIRE(read_file("b.xml").find("Shared text 1.") != string::npos);
+
+    // Changing a file included by one output converts only that output.
+    write_file("fragment.rst", "Fragment text 2.\n");
+    REQUIRE(wait_for_conversions(3) == 3);
+    REQUIRE(read_file("a.xml").find("Fragment text 2.") != string::npos);
+
+    // So does an editor saving an input by replacing it.
+    write_file("b.rst.new", "Beta\n====\n\nBeta text 2.\n");
+    filesystem::rename(directory / "b.rst.new", directory / "b.rst");
+    REQUIRE(wait_for_conversions(4) == 4);
+    REQUIRE(read_file("b.xml").find("Beta text 2.") != string::npos);
+
+    // Changing a file included by the shared prologue converts both.
+    write_file("shared.rst", "Shared text 2.\n\n");
+    REQUIRE(wait_for_conversions(6) == 6);
+    REQUIRE(read_file("a.xml").find("Shared text 2.") != string::npos);
+    REQUIRE(read_file("b.xml").find("Shared text 2.") != string::npos);
+
+    // A failed conversion leaves the output as it was, and is tried again after
+    // any change, such as creating the missing file.
+    string previous_output = read_file("a.xml");
+    write_file("fragment.rst", ".. include:: missing.rst\n");
+    REQUIRE(wait_for_conversions(7) == 7);
+    REQUIRE(watcher.statistics().failures == 1);
+    REQUIRE(read_file("a.xml") == previous_output);
+    write_file("missing.rst", "Found text.\n");
+    REQUIRE(wait_for_conversions(8) == 8);
+    REQUIRE(read_file("a.xml").find("Found text.") != string::npos);
+
+    watcher.stop();
+    watching.join();
+    REQUIRE(watch_error == 0);
+    watch_stats stats = watcher.statistics();
+    REQUIRE(stats.conversions == 8);
+    REQUIRE(stats.rebuilds == 5);
+    REQUIRE(diagnostics.str() == "ERROR: missing.rst does not exist\n");
+    REQUIRE(report.str().find("a.xml: FAILED") != string::npos);
+    REQUIRE(!filesystem::exists(directory / "a.xml.rst2rfcxml-tmp"));
+    filesystem::remove_all(directory);
+}
+#endif